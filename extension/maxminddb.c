@@ -1,22 +1,277 @@
 #include <Python.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <maxminddb.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <sched.h>
 #include <structmember.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 
-static PyTypeObject Reader_Type;
-static PyTypeObject Metadata_Type;
-static PyObject *MaxMindDB_error;
+static struct PyModuleDef MaxMindDB_module;
+
+typedef struct worker_pool_s worker_pool_s;
+
+// The types and exception used by the module. Each interpreter that imports
+// the module has its own copy.
+typedef struct {
+    PyTypeObject *reader_type;
+    PyTypeObject *metadata_type;
+    PyTypeObject *lazy_record_type;
+    // The private type that exports the data section for get_raw views.
+    PyTypeObject *data_section_type;
+    PyObject *error;
+    // maxminddb.types.Column, for get_columns.
+    PyObject *column_type;
+    // maxminddb.compression, for opening compressed databases.
+    PyObject *compression;
+    // The threads that split large batches between them.
+    worker_pool_s *pool;
+} module_state_s;
+
+// The open modes from maxminddb.const that the extension supports.
+#define MODE_AUTO 0
+#define MODE_MMAP_EXT 1
+#define MODE_MEMORY 8
+#define MODE_FD 16
+#define MODE_HYBRID 32
+
+// MODE_HYBRID aligns the search tree to transparent huge pages of this size.
+#define HUGE_PAGE_SIZE ((size_t)2 * 1024 * 1024)
+
+// The metadata follows this marker, which is in the last 128 KiB of a
+// database. The data section follows the search tree after 16 zero bytes.
+#define METADATA_MARKER "\xab\xcd\xefMaxMind.com"
+#define METADATA_MAX_DISTANCE (128 * 1024)
+#define DATA_SECTION_SEPARATOR_SIZE 16
+
+// The same limit on nesting that libmaxminddb uses. This also stops pointer
+// loops in corrupt databases.
+#define RAW_MAXIMUM_DATA_STRUCTURE_DEPTH 512
+
+// The errors raw_value returns. It does not use the Python API, so that it
+// can run without the GIL, and raw_raise sets the matching exception.
+#define RAW_BAD_DATA -1
+#define RAW_TOO_DEEP -2
+#define RAW_NO_MEMORY -3
+
+// reload stops looking for cached records in the new database after
+// comparing this many of its distinct records.
+#define CARRY_OVER_MAX_RECORDS ((size_t)1 << 20)
+
+// With materialize="auto", records are materialized when the data section is
+// at most this many bytes.
+#define MATERIALIZE_AUTO_MAX_DATA_SECTION_SIZE (4 * 1024 * 1024)
+#define RECORD_TABLE_EMPTY UINT32_MAX
+
+// An open addressing hash table from data section offsets to the records
+// decoded when the database was opened with materialize.
+typedef struct {
+    uint32_t *offsets;
+    PyObject **records;
+    uint32_t bits;
+    size_t count;
+    double seconds;
+    Py_ssize_t memory;
+} record_table_s;
+
+// The record cache is set associative: an offset may only be stored in one
+// of the ways of the set it hashes to.
+#define RECORD_CACHE_WAYS 4
+#define RECORD_CACHE_MIN_SETS 2
+#define RECORD_CACHE_MAX_SET_BITS 28
+#define RECORD_CACHE_MAX_SHARDS 64
+
+typedef struct {
+    uint32_t offset;
+    bool referenced;
+    PyObject *record;
+} record_cache_entry_s;
+
+// Each shard guards every shard_count-th set with a spinlock, so threads
+// only contend when they look up records in the same shard. The lock is only
+// held to read or replace an entry, never while decoding. The statistics are
+// updated while holding the lock, and the padding keeps the shards on
+// separate cache lines.
+typedef struct {
+    char lock;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t contended;
+    char padding[64];
+} record_cache_shard_s;
+
+// A bounded cache from data section offsets to decoded records, used when
+// the database was opened with cache. Records are evicted with the clock
+// algorithm within each set.
+typedef struct {
+    record_cache_entry_s *entries;
+    record_cache_shard_s *shards;
+    uint32_t set_bits;
+    uint32_t shard_count;
+} record_cache_s;
+
+// The number of distinct records sampled when building a schema for
+// specialize alone. Typed records need every record in the schema.
+#define SCHEMA_SAMPLE_SIZE 1024
+
+typedef struct schema_node_s schema_node_s;
+
+// A key seen in a map, with the key object to use for it and the schema of
+// the maps found in its values, if any.
+typedef struct {
+    PyObject *key;
+    const char *name;
+    Py_ssize_t size;
+    schema_node_s *child;
+} schema_field_s;
+
+// The observed structure of the maps at one position in the records. Maps
+// in arrays share the schema of the array. With typed, cls is the record
+// class for the maps and offsets holds the offset of each field's slot.
+struct schema_node_s {
+    schema_field_s *fields;
+    uint32_t count;
+    uint32_t capacity;
+    PyObject *cls;
+    Py_ssize_t *offsets;
+};
+
+// A column of get_columns output. kind is the struct module format of the
+// values, 's' for strings, or 0 until a value has been found. Values and
+// validity flags are written directly into bytearrays, which are returned as
+// memoryviews.
+typedef struct {
+    PyObject *components;
+    const char **path;
+    char kind;
+    PyObject *values;
+    PyObject *valid;
+    PyObject *offsets;
+    Py_ssize_t next_row;
+} column_s;
+
+// A growable output buffer, used for JSON and raw record output.
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} byte_buffer_s;
+
+// A record from the old database's cache, with its offset there and its
+// encoding, while reload looks for it in the new database. new_offset is
+// where it was found, or RECORD_TABLE_EMPTY.
+typedef struct {
+    PyObject *record;
+    uint32_t offset;
+    byte_buffer_s raw;
+    uint64_t hash;
+    uint32_t new_offset;
+} carry_entry_s;
+
+// The state of carrying records over: the collected entries, an open
+// addressing index of them by hash, and the offsets of the new database
+// already compared. The search runs without the GIL, so it records an MMDB
+// or RAW_ error status rather than raising.
+typedef struct {
+    carry_entry_s *entries;
+    size_t count;
+    size_t *index;
+    size_t mask;
+    record_table_s seen;
+    byte_buffer_s raw;
+    int mmdb_status;
+    int raw_status;
+    bool no_memory;
+} carry_over_s;
+
+// An open database and the data built from it when it was opened. Readers
+// and lazy records hold a reference while they use it, so that closing a
+// reader on another thread, or while a batch runs with the GIL released,
+// does not unmap the database out from under a lookup. The count is updated
+// atomically, but the last reference must be dropped with the GIL held (or
+// the thread attached, on free-threaded builds) as it frees Python objects.
+typedef struct {
+    MMDB_s mmdb;
+    bool immutable;
+    record_table_s *materialized;
+    record_cache_s *cache;
+    schema_node_s *schema;
+    // InvalidDatabaseError from the module that opened it, for errors found
+    // while decoding.
+    PyObject *error;
+    // The DataSection_obj that get_raw takes views from.
+    PyObject *data_section;
+    // The caller's buffer that the database was opened from in place, if
+    // any. It stays exported until the database is closed.
+    Py_buffer buffer;
+    Py_ssize_t refcount;
+} mmdb_handle_s;
+
+// Free-threaded builds serialize access to the state of a reader with these.
+// Elsewhere, the GIL does that and they are plain blocks.
+#ifndef Py_BEGIN_CRITICAL_SECTION
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
+
+// The options a reader opens its database with. reload opens the new
+// database with the same ones.
+typedef struct {
+    int mode;
+    bool immutable;
+    bool materialize_all;
+    bool materialize_auto;
+    bool specialize;
+    bool typed;
+    Py_ssize_t cache;
+    // A bit for each entry of advice_names.
+    int advice;
+    bool prefault;
+    bool mlock_tree;
+} open_options_s;
+
+// The madvise hints that may be given for a database's mapping.
+static const struct {
+    const char *name;
+    int advice;
+} advice_names[] = {
+    {"normal", MADV_NORMAL},
+    {"random", MADV_RANDOM},
+    {"sequential", MADV_SEQUENTIAL},
+    {"willneed", MADV_WILLNEED},
+#ifdef MADV_HUGEPAGE
+    {"hugepage", MADV_HUGEPAGE},
+#endif
+};
+#define ADVICE_COUNT (sizeof(advice_names) / sizeof(advice_names[0]))
 
 // clang-format off
 typedef struct {
     PyObject_HEAD /* no semicolon */
-    MMDB_s *mmdb;
+    PyObject *module;
+    mmdb_handle_s *handle;
     PyObject *closed;
+    int threads;
+    // The path the database was opened from, as bytes, or NULL if it was
+    // opened from a buffer or file descriptor.
+    PyObject *filepath;
+    open_options_s options;
+    // The maxminddb.watch.Watcher that reloads the database when its file
+    // is replaced, if any.
+    PyObject *watcher;
+    Py_ssize_t reloads;
+    double last_reload;
+    // The number of cached records the last reload carried over.
+    Py_ssize_t cache_carried_over;
+    PyObject *weakreflist;
 } Reader_obj;
 
 typedef struct {
@@ -31,14 +286,162 @@ typedef struct {
     PyObject *node_count;
     PyObject *record_size;
 } Metadata_obj;
+
+typedef struct {
+    PyObject_HEAD /* no semicolon */
+    Reader_obj *reader;
+    mmdb_handle_s *handle;
+    MMDB_entry_s entry;
+    uint32_t size;
+    PyObject *values;
+    PyObject *keys;
+} LazyRecord_obj;
+
+// Exports the data section of a handle, which owns it, as a buffer. Each
+// export holds a reference to the handle, which is cleared when the handle
+// is freed.
+typedef struct {
+    PyObject_HEAD /* no semicolon */
+    mmdb_handle_s *handle;
+} DataSection_obj;
 // clang-format on
 
+static PyObject *type_module(PyTypeObject *type);
+static module_state_s *module_state(PyObject *module);
+static PyObject *reader_error(const Reader_obj *reader);
 static int get_record(PyObject *self, PyObject *args, PyObject **record);
+static PyObject *Reader_close(PyObject *self, PyObject *args);
+static PyObject *Reader_reload(PyObject *self, PyObject *args, PyObject *kwds);
+static PyObject *Reader_reload_stats(PyObject *self, PyObject *args);
+static PyObject *Reader_share(PyObject *self, PyObject *args);
+static PyObject *Reader_warm(PyObject *self, PyObject *args, PyObject *kwds);
+static PyObject *Reader_residency(PyObject *self, PyObject *args);
+static int parse_advice(PyObject *obj, int *advice);
+static int apply_residency(MMDB_s *mmdb, const open_options_s *options);
+static size_t tree_size(const MMDB_s *mmdb);
+static int move_tree_to_anonymous_memory(MMDB_s *mmdb);
+static void
+page_range(const void *start, size_t size, void **aligned, size_t *length);
+static void touch_pages(const uint8_t *start, size_t size);
+static double resident_fraction(const uint8_t *start, size_t size);
+static PyObject *watcher_start(PyObject *reader, PyObject *filepath);
+static int watcher_stop(PyObject *watcher);
+static mmdb_handle_s *open_handle(module_state_s *state,
+                                  PyObject *database,
+                                  const open_options_s *options);
+static bool is_path(PyObject *database);
+static int open_mmdb(module_state_s *state,
+                     PyObject *database,
+                     int mode,
+                     MMDB_s *mmdb,
+                     Py_buffer *buffer);
+static int open_path(module_state_s *state, PyObject *filepath, MMDB_s *mmdb);
+static int
+open_file_copy(module_state_s *state, PyObject *filepath, MMDB_s *mmdb);
+static bool is_compressed(const uint8_t *head, size_t size);
+static bool fd_is_compressed(int fd);
+static PyObject *
+call_compression(module_state_s *state, const char *name, PyObject *database);
+static int decompress_to_fd(module_state_s *state, PyObject *source);
+static int
+open_decompressed(module_state_s *state, PyObject *database, MMDB_s *mmdb);
+static int open_fd(module_state_s *state, PyObject *database, MMDB_s *mmdb);
+static void
+fd_open_error(module_state_s *state, PyObject *database, int src);
+static int open_buffer(module_state_s *state,
+                       PyObject *database,
+                       MMDB_s *mmdb,
+                       Py_buffer *buffer);
+static int mmdb_from_memory(const uint8_t *content, size_t size, MMDB_s *mmdb);
+static bool metadata_value(const MMDB_s *meta,
+                           const char *key,
+                           uint32_t type,
+                           MMDB_entry_data_s *data);
+static uint8_t *read_to_memory(int fd, size_t *size);
+static int open_mapping(uint8_t *content, size_t size, MMDB_s *mmdb);
+static void unmap_memory(uint8_t *content, size_t size);
+static int open_anonymous_file(int fd, MMDB_s *mmdb);
+static int map_fd(int fd, MMDB_s *mmdb);
+static mmdb_handle_s *reader_handle(Reader_obj *reader);
+static mmdb_handle_s *reader_open_handle(Reader_obj *reader);
+static void handle_decref(mmdb_handle_s *handle);
+static int lookup_entry(mmdb_handle_s *handle,
+                        PyObject *args,
+                        struct sockaddr_storage *ip_address_ss,
+                        MMDB_lookup_result_s *result);
+static int lookup_address(mmdb_handle_s *handle,
+                          PyObject *ip,
+                          struct sockaddr_storage *ip_address_ss,
+                          MMDB_lookup_result_s *result);
+static int prefix_length(const MMDB_s *mmdb, int family, uint16_t netmask);
+static PyObject *
+entry_record(mmdb_handle_s *handle, MMDB_entry_s *entry, int *status);
+static PyObject *lazy_value(Reader_obj *reader,
+                            mmdb_handle_s *handle,
+                            MMDB_entry_data_s *entry_data);
+static int materialize_records(mmdb_handle_s *handle);
+static int build_schema(mmdb_handle_s *handle, size_t limit);
+static int build_record_classes(mmdb_handle_s *handle);
+static PyObject *
+get_lazy(Reader_obj *reader, mmdb_handle_s *handle, PyObject *args);
+static PyObject *get_raw(mmdb_handle_s *handle, PyObject *args);
+static PyObject *materialize_stats(record_table_s *materialized);
+static const schema_field_s *schema_find(const schema_node_s *node,
+                                         uint32_t position,
+                                         const MMDB_entry_data_s *key);
+static void schema_free(schema_node_s *node);
+static PyObject *record_table_get(const record_table_s *table, uint32_t offset);
+static void record_table_free(record_table_s *table);
+static record_cache_s *record_cache_new(Py_ssize_t capacity);
+static PyObject *record_cache_get(record_cache_s *cache, uint32_t offset);
+static PyObject *
+record_cache_put(record_cache_s *cache, uint32_t offset, PyObject *record);
+static void record_cache_lock(record_cache_shard_s *shard);
+static void record_cache_unlock(record_cache_shard_s *shard);
+static void record_cache_free(record_cache_s *cache);
+static Py_ssize_t record_cache_carry_over(mmdb_handle_s *old,
+                                          mmdb_handle_s *new);
+static void carry_over_collect(const mmdb_handle_s *old, carry_over_s *carry);
+static int
+carry_over_match(carry_over_s *carry, const MMDB_s *old, MMDB_s *new);
+static bool carry_over_offset(carry_over_s *carry,
+                              const MMDB_s *new,
+                              uint32_t offset);
+static uint64_t raw_hash(const byte_buffer_s *raw);
+static Py_ssize_t deep_sizeof(PyObject *getsizeof, PyObject *obj);
 static bool format_sockaddr(struct sockaddr *addr, char *dst);
-static PyObject *from_entry_data_list(MMDB_entry_data_list_s **entry_data_list);
-static PyObject *from_map(MMDB_entry_data_list_s **entry_data_list);
-static PyObject *from_array(MMDB_entry_data_list_s **entry_data_list);
+static PyObject *from_entry_data_list(MMDB_entry_data_list_s **entry_data_list,
+                                      bool immutable,
+                                      const schema_node_s *schema,
+                                      PyObject *error);
+static PyObject *from_map(MMDB_entry_data_list_s **entry_data_list,
+                          bool immutable,
+                          const schema_node_s *schema,
+                          PyObject *error);
+static PyObject *from_array(MMDB_entry_data_list_s **entry_data_list,
+                            bool immutable,
+                            const schema_node_s *schema,
+                            PyObject *error);
 static PyObject *from_uint128(const MMDB_entry_data_list_s *entry_data_list);
+static void split_uint128(const MMDB_entry_data_s *entry_data,
+                          uint64_t *high,
+                          uint64_t *low);
+static int buffer_write(byte_buffer_s *buf, const char *data, size_t size);
+static int raw_value(const MMDB_s *mmdb,
+                     uint32_t offset,
+                     byte_buffer_s *out,
+                     uint32_t *next,
+                     bool *has_pointers,
+                     int depth);
+static int raw_raise(PyObject *error, int status);
+static int json_write_address(Reader_obj *reader,
+                              byte_buffer_s *buf,
+                              PyObject *ip,
+                              PyObject *fields);
+static int json_write_entry(mmdb_handle_s *handle,
+                            byte_buffer_s *buf,
+                            PyObject *ip,
+                            PyObject *fields);
 static int ip_converter(PyObject *obj, struct sockaddr_storage *ip_address);
 
 #ifdef __GNUC__
@@ -48,421 +451,5112 @@ static int ip_converter(PyObject *obj, struct sockaddr_storage *ip_address);
 #endif
 
 static int Reader_init(PyObject *self, PyObject *args, PyObject *kwds) {
-    PyObject *filepath = NULL;
-    int mode = 0;
+    PyObject *database = NULL;
+    int mode = MODE_AUTO;
+    int immutable = 0;
+    PyObject *materialize = Py_False;
+    int specialize = 0;
+    int typed = 0;
+    int threads = 1;
+    Py_ssize_t cache = 0;
+    int watch = 0;
+    int prefault = 0;
+    PyObject *advice_obj = Py_None;
+    int mlock_tree = 0;
 
-    static char *kwlist[] = {"database", "mode", NULL};
+    static char *kwlist[] = {"database",
+                             "mode",
+                             "immutable",
+                             "materialize",
+                             "specialize",
+                             "typed",
+                             "threads",
+                             "cache",
+                             "watch",
+                             "prefault",
+                             "advice",
+                             "mlock_tree",
+                             NULL};
     if (!PyArg_ParseTupleAndKeywords(args,
                                      kwds,
-                                     "O&|i",
+                                     "O|i$pOppinppOp",
                                      kwlist,
-                                     PyUnicode_FSConverter,
-                                     &filepath,
-                                     &mode)) {
+                                     &database,
+                                     &mode,
+                                     &immutable,
+                                     &materialize,
+                                     &specialize,
+                                     &typed,
+                                     &threads,
+                                     &cache,
+                                     &watch,
+                                     &prefault,
+                                     &advice_obj,
+                                     &mlock_tree)) {
         return -1;
     }
 
-    char *filename = PyBytes_AS_STRING(filepath);
-    if (filename == NULL) {
+    if (threads < 1) {
+        PyErr_SetString(PyExc_ValueError, "threads must be at least 1");
         return -1;
     }
+    // More threads than there are CPUs would only add scheduling overhead.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > 0 && threads > cpus) {
+        threads = (int)cpus;
+    }
 
-    if (mode != 0 && mode != 1) {
-        Py_XDECREF(filepath);
-        PyErr_Format(
-            PyExc_ValueError,
-            "Unsupported open mode (%i). Only "
-            "MODE_AUTO and MODE_MMAP_EXT are supported by this extension.",
-            mode);
+    if (cache < 0) {
+        PyErr_SetString(PyExc_ValueError, "cache must not be negative");
         return -1;
     }
 
-    if (0 != access(filename, R_OK)) {
+    Reader_obj *reader = (Reader_obj *)self;
+    if (NULL == reader->module) {
+        if (NULL == (reader->module = type_module(Py_TYPE(self)))) {
+            return -1;
+        }
+        Py_INCREF(reader->module);
+    }
 
-        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filepath);
-        Py_XDECREF(filepath);
+    bool materialize_auto = false;
+    if (PyUnicode_Check(materialize)) {
+        if (PyUnicode_CompareWithASCIIString(materialize, "auto") != 0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "materialize must be a bool or \"auto\"");
+            return -1;
+        }
+        materialize_auto = true;
+    }
+    int materialize_all = materialize_auto ? 0 : PyObject_IsTrue(materialize);
+    if (materialize_all == -1) {
         return -1;
     }
 
-    MMDB_s *mmdb = (MMDB_s *)malloc(sizeof(MMDB_s));
-    if (NULL == mmdb) {
-        Py_XDECREF(filepath);
-        PyErr_NoMemory();
+    if (mode != MODE_AUTO && mode != MODE_MMAP_EXT && mode != MODE_MEMORY &&
+        mode != MODE_FD && mode != MODE_HYBRID) {
+        PyErr_Format(PyExc_ValueError,
+                     "Unsupported open mode (%i). Only MODE_AUTO, "
+                     "MODE_MMAP_EXT, MODE_MEMORY, MODE_FD and MODE_HYBRID are "
+                     "supported by this extension.",
+                     mode);
         return -1;
     }
 
-    Reader_obj *mmdb_obj = (Reader_obj *)self;
-    if (!mmdb_obj) {
-        Py_XDECREF(filepath);
-        free(mmdb);
-        PyErr_NoMemory();
+    int advice;
+    if (parse_advice(advice_obj, &advice) == -1) {
         return -1;
     }
 
-    int const status = MMDB_open(filename, MMDB_MODE_MMAP, mmdb);
-    Py_XDECREF(filepath);
+    open_options_s options = {
+        .mode = mode,
+        .immutable = immutable,
+        .materialize_all = materialize_all,
+        .materialize_auto = materialize_auto,
+        .specialize = specialize,
+        .typed = typed,
+        .cache = cache,
+        .advice = advice,
+        .prefault = prefault,
+        .mlock_tree = mlock_tree,
+    };
+    PyObject *filepath = NULL;
+    if (mode != MODE_FD && is_path(database) &&
+        !PyUnicode_FSConverter(database, &filepath)) {
+        return -1;
+    }
+    if (watch && NULL == filepath) {
+        PyErr_SetString(PyExc_ValueError, "watch requires a database path");
+        return -1;
+    }
+    mmdb_handle_s *handle =
+        open_handle(module_state(reader->module), database, &options);
+    if (NULL == handle) {
+        Py_XDECREF(filepath);
+        return -1;
+    }
 
-    if (MMDB_SUCCESS != status) {
-        free(mmdb);
-        PyErr_Format(MaxMindDB_error,
-                     "Error opening database file (%s). Is this a valid "
-                     "MaxMind DB file?",
-                     filename);
+    mmdb_handle_s *previous;
+    PyObject *previous_filepath;
+    PyObject *previous_watcher;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    previous = reader->handle;
+    previous_filepath = reader->filepath;
+    previous_watcher = reader->watcher;
+    reader->handle = handle;
+    reader->filepath = filepath;
+    reader->options = options;
+    reader->watcher = NULL;
+    reader->closed = Py_False;
+    reader->threads = threads;
+    Py_END_CRITICAL_SECTION();
+    handle_decref(previous);
+    Py_XDECREF(previous_filepath);
+    if (watcher_stop(previous_watcher) == -1) {
         return -1;
     }
 
-    mmdb_obj->mmdb = mmdb;
-    mmdb_obj->closed = Py_False;
+    if (watch) {
+        PyObject *watcher = watcher_start(self, filepath);
+        if (NULL == watcher) {
+            return -1;
+        }
+        Py_BEGIN_CRITICAL_SECTION(self);
+        previous_watcher = reader->watcher;
+        reader->watcher = watcher;
+        Py_END_CRITICAL_SECTION();
+        return watcher_stop(previous_watcher);
+    }
     return 0;
 }
 
-static PyObject *Reader_get(PyObject *self, PyObject *args) {
-    PyObject *record = NULL;
-    if (get_record(self, args, &record) == -1) {
+// The watcher is shared with the pure Python reader, as with the asyncio
+// methods.
+static PyObject *watcher_start(PyObject *reader, PyObject *filepath) {
+    PyObject *watch = PyImport_ImportModule("maxminddb.watch");
+    if (NULL == watch) {
         return NULL;
     }
-    return record;
+    PyObject *watcher =
+        PyObject_CallMethod(watch, "Watcher", "OO", reader, filepath);
+    Py_DECREF(watch);
+    return watcher;
 }
 
-static PyObject *Reader_get_with_prefix_len(PyObject *self, PyObject *args) {
-    PyObject *record = NULL;
-    int prefix_len = get_record(self, args, &record);
-    if (prefix_len == -1) {
+// Stops the watcher, if any, and drops the reference to it.
+static int watcher_stop(PyObject *watcher) {
+    if (NULL == watcher) {
+        return 0;
+    }
+    PyObject *result = PyObject_CallMethod(watcher, "stop", NULL);
+    Py_DECREF(watcher);
+    if (NULL == result) {
+        return -1;
+    }
+    Py_DECREF(result);
+    return 0;
+}
+
+// Opens the database and prepares it for lookups as the options ask.
+static mmdb_handle_s *open_handle(module_state_s *state,
+                                  PyObject *database,
+                                  const open_options_s *options) {
+    mmdb_handle_s *handle = calloc(1, sizeof(mmdb_handle_s));
+    if (NULL == handle) {
+        PyErr_NoMemory();
         return NULL;
     }
 
-    PyObject *tuple = Py_BuildValue("(Oi)", record, prefix_len);
-    Py_DECREF(record);
+    if (open_mmdb(state,
+                  database,
+                  options->mode,
+                  &handle->mmdb,
+                  &handle->buffer) == -1) {
+        free(handle);
+        return NULL;
+    }
 
-    return tuple;
+    handle->error = state->error;
+    Py_INCREF(handle->error);
+    handle->refcount = 1;
+    PyTypeObject *type = state->data_section_type;
+    DataSection_obj *data_section = (DataSection_obj *)type->tp_alloc(type, 0);
+    if (NULL == data_section) {
+        handle_decref(handle);
+        return NULL;
+    }
+    data_section->handle = handle;
+    handle->data_section = (PyObject *)data_section;
+    if ((options->mode == MODE_HYBRID &&
+         move_tree_to_anonymous_memory(&handle->mmdb) == -1) ||
+        apply_residency(&handle->mmdb, options) == -1) {
+        handle_decref(handle);
+        return NULL;
+    }
+    // Materialized and cached records are shared between lookups, so they
+    // must not be modifiable.
+    handle->immutable = options->immutable || options->materialize_all ||
+                        options->materialize_auto || options->cache > 0;
+
+    bool should_materialize =
+        options->materialize_all ||
+        (options->materialize_auto &&
+         handle->mmdb.data_section_size <=
+             MATERIALIZE_AUTO_MAX_DATA_SECTION_SIZE);
+    // Typed records are built from the schema, so they imply specialize.
+    if (((options->specialize || options->typed) &&
+         build_schema(handle, options->typed ? 0 : SCHEMA_SAMPLE_SIZE) ==
+             -1) ||
+        (options->typed && build_record_classes(handle) == -1) ||
+        (should_materialize && materialize_records(handle) == -1)) {
+        handle_decref(handle);
+        return NULL;
+    }
+
+    // With every record materialized, there is nothing left to cache.
+    if (options->cache > 0 && NULL == handle->materialized &&
+        NULL == (handle->cache = record_cache_new(options->cache))) {
+        handle_decref(handle);
+        return NULL;
+    }
+    return handle;
 }
 
-static int get_record(PyObject *self, PyObject *args, PyObject **record) {
-    MMDB_s *mmdb = ((Reader_obj *)self)->mmdb;
-    if (NULL == mmdb) {
+// Opens the database again, or the given database in its place, with the
+// reader's options and then swaps it in. Lookups that are already running,
+// including those without the GIL, finish with the database they started
+// with, which is closed once the last of them is done. Opening, copying and
+// decompressing the database, walking its tree to materialize records and
+// searching it for the cached records to carry over run without the GIL.
+// Building the schema and decoding the materialized records create Python
+// objects, so they hold it, letting other threads run periodically, as do
+// collecting the cached records and adding those found to the new cache.
+static PyObject *Reader_reload(PyObject *self, PyObject *args, PyObject *kwds) {
+    PyObject *database = Py_None;
+    static char *kwlist[] = {"database", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &database)) {
+        return NULL;
+    }
+
+    Reader_obj *reader = (Reader_obj *)self;
+    open_options_s options;
+    PyObject *filepath;
+    bool closed;
+    Py_BEGIN_CRITICAL_SECTION(reader);
+    closed = NULL == reader->handle;
+    options = reader->options;
+    filepath = reader->filepath;
+    Py_XINCREF(filepath);
+    Py_END_CRITICAL_SECTION();
+
+    if (closed) {
+        Py_XDECREF(filepath);
         PyErr_SetString(PyExc_ValueError,
-                        "Attempt to read from a closed MaxMind DB.");
-        return -1;
+                        "Attempt to reload a closed MaxMind DB.");
+        return NULL;
     }
 
-    struct sockaddr_storage ip_address_ss = {0};
-    struct sockaddr *ip_address = (struct sockaddr *)&ip_address_ss;
-    if (!PyArg_ParseTuple(args, "O&", ip_converter, &ip_address_ss)) {
-        return -1;
+    if (database != Py_None) {
+        Py_CLEAR(filepath);
+        if (options.mode != MODE_FD && is_path(database) &&
+            !PyUnicode_FSConverter(database, &filepath)) {
+            return NULL;
+        }
+    } else if (NULL == filepath) {
+        PyErr_SetString(PyExc_ValueError,
+                        "reload requires a database when the reader was not "
+                        "opened from a path");
+        return NULL;
+    } else {
+        database = filepath;
     }
 
-    if (!ip_address->sa_family) {
-        PyErr_SetString(PyExc_ValueError, "Error parsing argument");
-        return -1;
+    mmdb_handle_s *handle =
+        open_handle(module_state(reader->module), database, &options);
+    if (NULL == handle) {
+        Py_XDECREF(filepath);
+        return NULL;
     }
 
-    int mmdb_error = MMDB_SUCCESS;
-    MMDB_lookup_result_s result =
-        MMDB_lookup_sockaddr(mmdb, ip_address, &mmdb_error);
+    // Typed records are instances of classes built for each database, so
+    // they are not carried over.
+    Py_ssize_t carried = 0;
+    mmdb_handle_s *current = reader_handle(reader);
+    if (NULL != current && NULL != current->cache && NULL != handle->cache &&
+        !options.typed) {
+        carried = record_cache_carry_over(current, handle);
+    }
+    handle_decref(current);
+    if (carried == -1) {
+        handle_decref(handle);
+        Py_XDECREF(filepath);
+        return NULL;
+    }
 
-    if (MMDB_SUCCESS != mmdb_error) {
-        PyObject *exception;
-        if (MMDB_IPV6_LOOKUP_IN_IPV4_DATABASE_ERROR == mmdb_error) {
-            exception = PyExc_ValueError;
-        } else {
-            exception = MaxMindDB_error;
-        }
-        char ipstr[INET6_ADDRSTRLEN] = {0};
-        if (format_sockaddr(ip_address, ipstr)) {
-            PyErr_Format(exception,
-                         "Error looking up %s. %s",
-                         ipstr,
-                         MMDB_strerror(mmdb_error));
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    double now = (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+    mmdb_handle_s *previous;
+    Py_BEGIN_CRITICAL_SECTION(reader);
+    previous = reader->handle;
+    // The reader may have been closed while the database was opening.
+    if (NULL != previous) {
+        reader->handle = handle;
+        Py_XSETREF(reader->filepath, filepath);
+        reader->reloads++;
+        reader->last_reload = now;
+        reader->cache_carried_over = carried;
+        filepath = NULL;
+        handle = NULL;
+    }
+    Py_END_CRITICAL_SECTION();
+    Py_XDECREF(filepath);
+    handle_decref(handle);
+    handle_decref(previous);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject *Reader_reload_stats(PyObject *self,
+                                     PyObject *UNUSED(args)) {
+    Reader_obj *reader = (Reader_obj *)self;
+    Py_ssize_t reloads;
+    double last_reload;
+    Py_ssize_t carried;
+    PyObject *watcher;
+    Py_BEGIN_CRITICAL_SECTION(reader);
+    reloads = reader->reloads;
+    last_reload = reader->last_reload;
+    carried = reader->cache_carried_over;
+    watcher = reader->watcher;
+    Py_XINCREF(watcher);
+    Py_END_CRITICAL_SECTION();
+
+    PyObject *errors;
+    PyObject *last_error;
+    if (NULL == watcher) {
+        errors = PyLong_FromLong(0);
+        last_error = Py_None;
+        Py_INCREF(last_error);
+    } else {
+        errors = PyObject_GetAttrString(watcher, "errors");
+        last_error = PyObject_GetAttrString(watcher, "last_error");
+        Py_DECREF(watcher);
+    }
+    PyObject *last_reload_obj = Py_None;
+    if (reloads > 0) {
+        last_reload_obj = PyFloat_FromDouble(last_reload);
+    } else {
+        Py_INCREF(last_reload_obj);
+    }
+
+    PyObject *stats = NULL;
+    if (NULL != errors && NULL != last_error && NULL != last_reload_obj) {
+        stats = Py_BuildValue("{s:n,s:O,s:n,s:O,s:O}",
+                              "reloads",
+                              reloads,
+                              "last_reload",
+                              last_reload_obj,
+                              "cache_carried_over",
+                              carried,
+                              "errors",
+                              errors,
+                              "last_error",
+                              last_error);
+    }
+    Py_XDECREF(errors);
+    Py_XDECREF(last_error);
+    Py_XDECREF(last_reload_obj);
+    return stats;
+}
+
+// Returns a new reader of the reader's database. The database, including its
+// caches and materialized records, is shared rather than opened again, but
+// each reader is closed on its own, and the database is closed with the last
+// of them. A later reload only replaces the database of the reader it is
+// called on.
+static PyObject *Reader_share(PyObject *self, PyObject *UNUSED(args)) {
+    Reader_obj *reader = (Reader_obj *)self;
+    Reader_obj *copy = (Reader_obj *)PyType_GenericAlloc(Py_TYPE(self), 0);
+    if (NULL == copy) {
+        return NULL;
+    }
+    copy->module = reader->module;
+    Py_XINCREF(copy->module);
+    copy->closed = Py_False;
+
+    mmdb_handle_s *handle;
+    Py_BEGIN_CRITICAL_SECTION(reader);
+    handle = reader->handle;
+    if (NULL != handle) {
+        __atomic_add_fetch(&handle->refcount, 1, __ATOMIC_RELAXED);
+        copy->handle = handle;
+        copy->threads = reader->threads;
+        copy->options = reader->options;
+        copy->filepath = reader->filepath;
+        Py_XINCREF(copy->filepath);
+    }
+    Py_END_CRITICAL_SECTION();
+    if (NULL == handle) {
+        Py_DECREF(copy);
+        PyErr_SetString(PyExc_ValueError,
+                        "Attempt to share a closed MaxMind DB.");
+        return NULL;
+    }
+    return (PyObject *)copy;
+}
+
+// Whether the database argument names a path rather than holding the
+// database. bytes are a path, as they are for open(), unless they contain a
+// NUL byte, which no path does and every database does.
+static bool is_path(PyObject *database) {
+    if (PyBytes_Check(database)) {
+        return NULL == memchr(PyBytes_AS_STRING(database),
+                              '\0',
+                              (size_t)PyBytes_GET_SIZE(database));
+    }
+    return PyUnicode_Check(database) ||
+           PyObject_HasAttrString(database, "__fspath__");
+}
+
+// Returned by open_path and open_file_copy for a compressed file, which
+// open_mmdb then decompresses.
+#define OPEN_COMPRESSED 1
+
+// Opens the database, which is either a path or a buffer holding the
+// database. A buffer is exported into buffer for as long as the database is
+// open.
+static int open_mmdb(module_state_s *state,
+                     PyObject *database,
+                     int mode,
+                     MMDB_s *mmdb,
+                     Py_buffer *buffer) {
+    if (mode == MODE_FD) {
+        return open_fd(state, database, mmdb);
+    }
+    if (!is_path(database) && PyObject_CheckBuffer(database)) {
+        // The other modes map a file, and MODE_HYBRID moves the mapping,
+        // which the caller's memory cannot be.
+        if (mode != MODE_AUTO && mode != MODE_MEMORY) {
+            PyErr_SetString(PyExc_ValueError,
+                            "Only MODE_AUTO and MODE_MEMORY open buffers");
+            return -1;
         }
-        return -1;
+        return open_buffer(state, database, mmdb, buffer);
     }
 
-    int prefix_len = result.netmask;
-    if (ip_address->sa_family == AF_INET && mmdb->metadata.ip_version == 6) {
-        // We return the prefix length given the IPv4 address. If there is
-        // no IPv4 subtree, we return a prefix length of 0.
-        prefix_len = prefix_len >= 96 ? prefix_len - 96 : 0;
+    PyObject *filepath = NULL;
+    if (!PyUnicode_FSConverter(database, &filepath)) {
+        return -1;
+    }
+    int status = mode == MODE_MEMORY ? open_file_copy(state, filepath, mmdb)
+                                     : open_path(state, filepath, mmdb);
+    Py_DECREF(filepath);
+    if (status == OPEN_COMPRESSED) {
+        return open_decompressed(state, database, mmdb);
     }
+    return status;
+}
 
-    if (!result.found_entry) {
-        Py_INCREF(Py_None);
-        *record = Py_None;
-        return prefix_len;
+static int open_path(module_state_s *state, PyObject *filepath, MMDB_s *mmdb) {
+    char *filename = PyBytes_AS_STRING(filepath);
+    if (0 != access(filename, R_OK)) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filepath);
+        return -1;
     }
 
-    MMDB_entry_data_list_s *entry_data_list = NULL;
-    int status = MMDB_get_entry_data_list(&result.entry, &entry_data_list);
+    int status;
+    Py_BEGIN_ALLOW_THREADS;
+    status = MMDB_open(filename, MMDB_MODE_MMAP, mmdb);
+    Py_END_ALLOW_THREADS;
     if (MMDB_SUCCESS != status) {
-        char ipstr[INET6_ADDRSTRLEN] = {0};
-        if (format_sockaddr(ip_address, ipstr)) {
-            PyErr_Format(MaxMindDB_error,
-                         "Error while looking up data for %s. %s",
-                         ipstr,
-                         MMDB_strerror(status));
+        // The file is only checked for compression once libmaxminddb has
+        // rejected it, so that an uncompressed database is opened once.
+        int fd = open(filename, O_RDONLY | O_CLOEXEC);
+        bool compressed = fd != -1 && fd_is_compressed(fd);
+        if (fd != -1) {
+            close(fd);
         }
-        MMDB_free_entry_data_list(entry_data_list);
+        if (compressed) {
+            return OPEN_COMPRESSED;
+        }
+        PyErr_Format(state->error,
+                     "Error opening database file (%s). Is this a valid "
+                     "MaxMind DB file?",
+                     filename);
         return -1;
     }
+    return 0;
+}
 
-    MMDB_entry_data_list_s *original_entry_data_list = entry_data_list;
-    *record = from_entry_data_list(&entry_data_list);
-    MMDB_free_entry_data_list(original_entry_data_list);
+// MODE_MEMORY reads the file into anonymous memory. Unlike the file, the
+// copy does not change if the file is replaced or truncated while it is
+// open.
+static int
+open_file_copy(module_state_s *state, PyObject *filepath, MMDB_s *mmdb) {
+    char *filename = PyBytes_AS_STRING(filepath);
+    int src = open(filename, O_RDONLY | O_CLOEXEC);
+    if (src == -1) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filepath);
+        return -1;
+    }
+    if (fd_is_compressed(src)) {
+        close(src);
+        return OPEN_COMPRESSED;
+    }
+    uint8_t *content;
+    size_t size;
+    Py_BEGIN_ALLOW_THREADS;
+    content = read_to_memory(src, &size);
+    Py_END_ALLOW_THREADS;
+    if (NULL == content) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, filepath);
+        close(src);
+        return -1;
+    }
+    close(src);
 
-    // from_entry_data_list will return NULL on errors.
-    if (*record == NULL) {
+    if (open_mapping(content, size, mmdb) == -1) {
+        PyErr_Format(state->error,
+                     "Error opening database file (%s). Is this a valid "
+                     "MaxMind DB file?",
+                     filename);
         return -1;
     }
+    return 0;
+}
 
-    return prefix_len;
+// Returns whether head starts a gzip or zstd stream. The magic numbers are
+// those maxminddb.compression looks for.
+static bool is_compressed(const uint8_t *head, size_t size) {
+    static const uint8_t gzip_magic[] = {0x1f, 0x8b};
+    static const uint8_t zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+    return (size >= sizeof(gzip_magic) &&
+            memcmp(head, gzip_magic, sizeof(gzip_magic)) == 0) ||
+           (size >= sizeof(zstd_magic) &&
+            memcmp(head, zstd_magic, sizeof(zstd_magic)) == 0);
 }
 
-static int ip_converter(PyObject *obj, struct sockaddr_storage *ip_address) {
-    if (PyUnicode_Check(obj)) {
-        Py_ssize_t len;
-        const char *ipstr = PyUnicode_AsUTF8AndSize(obj, &len);
+// Returns whether the file that fd refers to is compressed. Its offset is
+// not changed.
+static bool fd_is_compressed(int fd) {
+    uint8_t head[4];
+    ssize_t n = pread(fd, head, sizeof(head), 0);
+    return n > 0 && is_compressed(head, (size_t)n);
+}
 
-        if (!ipstr) {
-            PyErr_SetString(PyExc_TypeError,
-                            "argument 1 contains an invalid string");
-            return 0;
-        }
-        if (strlen(ipstr) != (size_t)len) {
-            PyErr_SetString(PyExc_TypeError,
-                            "argument 1 contains an embedded null character");
-            return 0;
-        }
+// Decompressing gzip and zstd compressed databases is shared with the pure
+// Python reader, as the watcher is.
+static PyObject *
+call_compression(module_state_s *state, const char *name, PyObject *database) {
+    return PyObject_CallMethod(state->compression, name, "O", database);
+}
 
-        struct addrinfo hints = {
-            .ai_family = AF_UNSPEC,
-            .ai_flags = AI_NUMERICHOST,
-            // We set ai_socktype so that we only get one result back
-            .ai_socktype = SOCK_STREAM};
+// Decompresses source, a path, descriptor or buffer, into an anonymous file
+// in one pass, without writing it to disk. Returns the file's descriptor, or
+// -1 with an exception set.
+static int decompress_to_fd(module_state_s *state, PyObject *source) {
+    PyObject *fd_obj = call_compression(state, "decompress_to_file", source);
+    if (NULL == fd_obj) {
+        return -1;
+    }
+    int fd = (int)PyLong_AsLong(fd_obj);
+    Py_DECREF(fd_obj);
+    return fd;
+}
 
-        struct addrinfo *addresses = NULL;
-        int gai_status = getaddrinfo(ipstr, NULL, &hints, &addresses);
-        if (gai_status) {
-            PyErr_Format(PyExc_ValueError,
-                         "'%s' does not appear to be an IPv4 or IPv6 address.",
-                         ipstr);
-            return 0;
+// Opens a compressed database, which is decompressed with decompress_to_fd.
+static int
+open_decompressed(module_state_s *state, PyObject *database, MMDB_s *mmdb) {
+    int fd = decompress_to_fd(state, database);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (open_anonymous_file(fd, mmdb) == -1) {
+        PyErr_Format(state->error,
+                     "Error opening database file (%S). Is this a valid "
+                     "MaxMind DB file?",
+                     database);
+        return -1;
+    }
+    return 0;
+}
+
+// Opens the database from a file descriptor or an object with a fileno()
+// method, which remains owned by the caller. A regular file is mapped
+// through the descriptor, so it is the caller's file rather than whatever
+// its path now names. Anything else, such as a pipe, cannot be mapped and
+// is read from its current position into anonymous memory. A compressed
+// database is decompressed: a regular file from its start, as it would be
+// mapped, and anything else once it has been read.
+static int open_fd(module_state_s *state, PyObject *database, MMDB_s *mmdb) {
+    int src = PyObject_AsFileDescriptor(database);
+    if (src == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(src, &st) == -1) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    int status;
+    if (S_ISREG(st.st_mode) && fd_is_compressed(src)) {
+        PyObject *fd_obj = PyLong_FromLong(src);
+        int fd = NULL == fd_obj ? -1 : decompress_to_fd(state, fd_obj);
+        Py_XDECREF(fd_obj);
+        if (fd == -1) {
+            return -1;
         }
-        if (!addresses) {
-            PyErr_SetString(
-                PyExc_RuntimeError,
-                "getaddrinfo was successful but failed to set the addrinfo");
-            return 0;
+        status = open_anonymous_file(fd, mmdb);
+    } else if (S_ISREG(st.st_mode)) {
+        Py_BEGIN_ALLOW_THREADS;
+        status = map_fd(src, mmdb);
+        Py_END_ALLOW_THREADS;
+    } else {
+        uint8_t *content;
+        size_t size;
+        Py_BEGIN_ALLOW_THREADS;
+        content = read_to_memory(src, &size);
+        Py_END_ALLOW_THREADS;
+        if (NULL == content) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        if (is_compressed(content, size)) {
+            // The compressed data is passed as a bytearray, which, unlike
+            // bytes, is never taken for a path.
+            PyObject *compressed = PyByteArray_FromStringAndSize(
+                (const char *)content, (Py_ssize_t)size);
+            unmap_memory(content, size);
+            int fd =
+                NULL == compressed ? -1 : decompress_to_fd(state, compressed);
+            Py_XDECREF(compressed);
+            if (fd == -1) {
+                return -1;
+            }
+            status = open_anonymous_file(fd, mmdb);
+        } else {
+            status = open_mapping(content, size, mmdb);
         }
-        memcpy(ip_address, addresses->ai_addr, addresses->ai_addrlen);
-        freeaddrinfo(addresses);
-        return 1;
-    }
-    PyObject *packed = PyObject_GetAttrString(obj, "packed");
-    if (!packed) {
-        PyErr_SetString(PyExc_TypeError,
-                        "argument 1 must be a string or ipaddress object");
-        return 0;
     }
-    Py_ssize_t len;
-    char *bytes;
-    int status = PyBytes_AsStringAndSize(packed, &bytes, &len);
     if (status == -1) {
-        PyErr_SetString(PyExc_TypeError,
-                        "argument 1 must be a string or ipaddress object");
-        Py_DECREF(packed);
+        fd_open_error(state, database, src);
+    }
+    return status;
+}
+
+// Sets the error for a database that could not be opened from src, using the
+// file object's name when there is one.
+static void
+fd_open_error(module_state_s *state, PyObject *database, int src) {
+    PyObject *name = NULL;
+    if (!PyLong_Check(database)) {
+        name = PyObject_GetAttrString(database, "name");
+        PyErr_Clear();
+    }
+    if (NULL == name) {
+        PyErr_Format(state->error,
+                     "Error opening database from file descriptor %d. Is "
+                     "this a valid MaxMind DB file?",
+                     src);
+        return;
+    }
+    PyErr_Format(state->error,
+                 "Error opening database file (%S). Is this a valid MaxMind "
+                 "DB file?",
+                 name);
+    Py_DECREF(name);
+}
+
+// Opens the database in the caller's buffer in place, without copying it.
+// The buffer stays exported in buffer, so that a bytearray, say, cannot be
+// resized, until handle_decref releases it. A compressed database is
+// decompressed instead, and the buffer is released at once.
+static int open_buffer(module_state_s *state,
+                       PyObject *database,
+                       MMDB_s *mmdb,
+                       Py_buffer *buffer) {
+    if (PyObject_GetBuffer(database, buffer, PyBUF_SIMPLE) == -1) {
+        return -1;
+    }
+    if (is_compressed(buffer->buf, (size_t)buffer->len)) {
+        PyBuffer_Release(buffer);
+        return open_decompressed(state, database, mmdb);
+    }
+
+    int status;
+    Py_BEGIN_ALLOW_THREADS;
+    status = mmdb_from_memory(buffer->buf, (size_t)buffer->len, mmdb);
+    Py_END_ALLOW_THREADS;
+    if (MMDB_SUCCESS != status) {
+        PyBuffer_Release(buffer);
+        PyErr_SetString(state->error,
+                        "Error opening database from buffer. Is this a "
+                        "valid MaxMind DB file?");
+        return -1;
+    }
+    return 0;
+}
+
+// Reads the value for key from the metadata, which meta decodes as its data
+// section, into data. Returns whether it is there and of the given type.
+static bool metadata_value(const MMDB_s *meta,
+                           const char *key,
+                           uint32_t type,
+                           MMDB_entry_data_s *data) {
+    MMDB_entry_s entry = {.mmdb = meta, .offset = 0};
+    return MMDB_SUCCESS == MMDB_get_value(&entry, data, key, NULL) &&
+           data->has_data && data->type == type;
+}
+
+// Sets up mmdb for the database in [content, content + size) as MMDB_open
+// does for the file it maps, and returns the MMDB status. libmaxminddb only
+// opens databases by path, so those in memory are opened this way. Only the
+// metadata the extension uses is read: the languages and descriptions are
+// left empty. MMDB_close unmaps content, so callers that do not own it clear
+// file_content first. It does not use the Python API.
+static int mmdb_from_memory(const uint8_t *content, size_t size, MMDB_s *mmdb) {
+    static const char marker[] = METADATA_MARKER;
+    const size_t marker_size = sizeof(marker) - 1;
+    memset(mmdb, 0, sizeof(MMDB_s));
+    if (size < marker_size) {
+        return MMDB_INVALID_METADATA_ERROR;
+    }
+
+    // The last marker is the one that starts the metadata.
+    const size_t first =
+        size > METADATA_MAX_DISTANCE ? size - METADATA_MAX_DISTANCE : 0;
+    const uint8_t *metadata = NULL;
+    size_t i;
+    for (i = size - marker_size + 1; NULL == metadata && i-- > first;) {
+        if (0 == memcmp(content + i, marker, marker_size)) {
+            metadata = content + i + marker_size;
+        }
+    }
+    if (NULL == metadata) {
+        return MMDB_INVALID_METADATA_ERROR;
+    }
+
+    MMDB_s meta;
+    memset(&meta, 0, sizeof(MMDB_s));
+    meta.data_section = meta.metadata_section = metadata;
+    meta.data_section_size = meta.metadata_section_size =
+        (uint32_t)(content + size - metadata);
+    MMDB_entry_data_s node_count, record_size, ip_version, database_type,
+        major_version, minor_version, build_epoch;
+    if (!metadata_value(
+            &meta, "node_count", MMDB_DATA_TYPE_UINT32, &node_count) ||
+        !metadata_value(
+            &meta, "record_size", MMDB_DATA_TYPE_UINT16, &record_size) ||
+        !metadata_value(
+            &meta, "ip_version", MMDB_DATA_TYPE_UINT16, &ip_version) ||
+        !metadata_value(&meta,
+                        "database_type",
+                        MMDB_DATA_TYPE_UTF8_STRING,
+                        &database_type) ||
+        !metadata_value(&meta,
+                        "binary_format_major_version",
+                        MMDB_DATA_TYPE_UINT16,
+                        &major_version) ||
+        !metadata_value(&meta,
+                        "binary_format_minor_version",
+                        MMDB_DATA_TYPE_UINT16,
+                        &minor_version) ||
+        !metadata_value(
+            &meta, "build_epoch", MMDB_DATA_TYPE_UINT64, &build_epoch)) {
+        return MMDB_INVALID_METADATA_ERROR;
+    }
+    if (2 != major_version.uint16 ||
+        (24 != record_size.uint16 && 28 != record_size.uint16 &&
+         32 != record_size.uint16)) {
+        return MMDB_UNKNOWN_DATABASE_FORMAT_ERROR;
+    }
+    if (4 != ip_version.uint16 && 6 != ip_version.uint16) {
+        return MMDB_INVALID_METADATA_ERROR;
+    }
+
+    // As libmaxminddb requires, the data section holds at least 3 bytes.
+    size_t data_start = (size_t)node_count.uint32 * record_size.uint16 / 4 +
+                        DATA_SECTION_SEPARATOR_SIZE;
+    size_t data_end = (size_t)(metadata - content) - marker_size;
+    if (data_start > data_end || data_end - data_start < 3 ||
+        data_end - data_start > UINT32_MAX) {
+        return MMDB_INVALID_METADATA_ERROR;
+    }
+
+    char *type = malloc(database_type.data_size + 1);
+    if (NULL == type) {
+        return MMDB_OUT_OF_MEMORY_ERROR;
+    }
+    memcpy(type, database_type.utf8_string, database_type.data_size);
+    type[database_type.data_size] = '\0';
+
+    mmdb->flags = MMDB_MODE_MMAP;
+    mmdb->file_size = (ssize_t)size;
+    mmdb->file_content = content;
+    mmdb->data_section = content + data_start;
+    mmdb->data_section_size = (uint32_t)(data_end - data_start);
+    mmdb->metadata_section = metadata;
+    mmdb->metadata_section_size = meta.metadata_section_size;
+    mmdb->full_record_byte_size = record_size.uint16 / 4;
+    mmdb->depth = 4 == ip_version.uint16 ? 32 : 128;
+    mmdb->metadata.node_count = node_count.uint32;
+    mmdb->metadata.record_size = record_size.uint16;
+    mmdb->metadata.ip_version = ip_version.uint16;
+    mmdb->metadata.database_type = type;
+    mmdb->metadata.binary_format_major_version = major_version.uint16;
+    mmdb->metadata.binary_format_minor_version = minor_version.uint16;
+    mmdb->metadata.build_epoch = build_epoch.uint64;
+
+    // IPv4 lookups in an IPv6 database start at the node for ::/96, which
+    // MMDB_open finds up front.
+    if (6 == ip_version.uint16) {
+        uint32_t node_value = 0;
+        uint16_t netmask;
+        for (netmask = 0;
+             netmask < 96 && node_value < mmdb->metadata.node_count;
+             netmask++) {
+            MMDB_search_node_s node;
+            if (MMDB_SUCCESS != MMDB_read_node(mmdb, node_value, &node)) {
+                break;
+            }
+            node_value = (uint32_t)node.left_record;
+        }
+        mmdb->ipv4_start_node.node_value = node_value;
+        mmdb->ipv4_start_node.netmask = netmask;
+    }
+    return MMDB_SUCCESS;
+}
+
+// Reads the rest of fd into new anonymous memory, which is then read-only
+// and is unmapped with the size read, as MMDB_close does. Returns NULL with
+// errno set on errors. It is called without the GIL.
+static uint8_t *read_to_memory(int fd, size_t *size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    // A regular file is read into memory allocated once, with room to see
+    // that it has ended.
+    size_t capacity = 64 * 1024;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        (size_t)st.st_size >= capacity) {
+        capacity = ((size_t)st.st_size + page) & ~(page - 1);
+    }
+    uint8_t *content = mmap(NULL,
+                            capacity,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS,
+                            -1,
+                            0);
+    if (MAP_FAILED == content) {
+        return NULL;
+    }
+
+    *size = 0;
+    int read_errno = 0;
+    while (0 == read_errno) {
+        if (*size == capacity) {
+            uint8_t *grown = mmap(NULL,
+                                  capacity * 2,
+                                  PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS,
+                                  -1,
+                                  0);
+            if (MAP_FAILED == grown) {
+                read_errno = errno;
+                break;
+            }
+            memcpy(grown, content, capacity);
+            munmap(content, capacity);
+            content = grown;
+            capacity *= 2;
+        }
+        ssize_t n = read(fd, content + *size, capacity - *size);
+        if (n == 0) {
+            break;
+        }
+        if (n == -1) {
+            if (errno != EINTR) {
+                read_errno = errno;
+            }
+            continue;
+        }
+        *size += (size_t)n;
+    }
+    if (0 != read_errno) {
+        munmap(content, capacity);
+        errno = read_errno;
+        return NULL;
+    }
+
+    // Give back the pages past the end, keeping at least one.
+    size_t used = *size > 0 ? (*size + page - 1) & ~(page - 1) : page;
+    if (capacity > used) {
+        munmap(content + used, capacity - used);
+    }
+    mprotect(content, used, PROT_READ);
+    return content;
+}
+
+// Opens the database in content, memory from mmap that MMDB_close then
+// unmaps. On errors, content is unmapped here.
+static int open_mapping(uint8_t *content, size_t size, MMDB_s *mmdb) {
+    if (MMDB_SUCCESS != mmdb_from_memory(content, size, mmdb)) {
+        unmap_memory(content, size);
+        return -1;
+    }
+    return 0;
+}
+
+// Unmaps memory given to open_mapping. read_to_memory keeps a page even when
+// it reads nothing.
+static void unmap_memory(uint8_t *content, size_t size) {
+    munmap(content, size > 0 ? size : 1);
+}
+
+// Opens the database written to fd and closes fd. The database's mapping
+// keeps the file alive.
+static int open_anonymous_file(int fd, MMDB_s *mmdb) {
+    int status;
+    Py_BEGIN_ALLOW_THREADS;
+    status = map_fd(fd, mmdb);
+    close(fd);
+    Py_END_ALLOW_THREADS;
+    return status;
+}
+
+// Maps the whole file that fd refers to, which stays open, and opens the
+// database in the mapping. It is called without the GIL.
+static int map_fd(int fd, MMDB_s *mmdb) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+        return -1;
+    }
+    uint8_t *content =
+        mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (MAP_FAILED == content) {
+        return -1;
+    }
+    return open_mapping(content, (size_t)st.st_size, mmdb);
+}
+
+// Reads advice, which is None, a name from advice_names or an iterable of
+// them, into a bit for each name.
+static int parse_advice(PyObject *obj, int *advice) {
+    *advice = 0;
+    if (Py_None == obj) {
         return 0;
     }
+    PyObject *names = PyUnicode_Check(obj) ? PyTuple_Pack(1, obj)
+                                           : PySequence_Tuple(obj);
+    if (NULL == names) {
+        return -1;
+    }
+    Py_ssize_t i;
+    for (i = 0; i < PyTuple_GET_SIZE(names); i++) {
+        PyObject *name = PyTuple_GET_ITEM(names, i);
+        size_t j = 0;
+        while (j < ADVICE_COUNT &&
+               (!PyUnicode_Check(name) ||
+                PyUnicode_CompareWithASCIIString(name, advice_names[j].name) !=
+                    0)) {
+            j++;
+        }
+        if (j == ADVICE_COUNT) {
+            PyErr_Format(PyExc_ValueError,
+                         "Unsupported advice (%R). This platform supports "
+                         "normal, random, sequential, willneed%s.",
+                         name,
+#ifdef MADV_HUGEPAGE
+                         " and hugepage"
+#else
+                         ""
+#endif
+            );
+            Py_DECREF(names);
+            return -1;
+        }
+        *advice |= 1 << j;
+    }
+    Py_DECREF(names);
+    return 0;
+}
 
-    switch (len) {
-        case 16: {
-            ip_address->ss_family = AF_INET6;
-            struct sockaddr_in6 *sin = (struct sockaddr_in6 *)ip_address;
-            memcpy(sin->sin6_addr.s6_addr, bytes, (size_t)len);
-            Py_DECREF(packed);
-            return 1;
+// Applies the advice, mlock_tree and prefault options to a newly opened
+// database. These are only hints: the kernel may not support some advice,
+// e.g., hugepage without transparent huge pages, and mlock fails above
+// RLIMIT_MEMLOCK. Such failures leave the database usable, so they are
+// reported with a RuntimeWarning rather than failing the open.
+static int apply_residency(MMDB_s *mmdb, const open_options_s *options) {
+    void *start;
+    size_t length;
+    page_range(mmdb->file_content, (size_t)mmdb->file_size, &start, &length);
+    size_t i;
+    for (i = 0; i < ADVICE_COUNT; i++) {
+        if ((options->advice & (1 << i)) &&
+            madvise(start, length, advice_names[i].advice) == -1 &&
+            PyErr_WarnFormat(PyExc_RuntimeWarning,
+                             1,
+                             "Ignoring the %s advice, which failed (%s)",
+                             advice_names[i].name,
+                             strerror(errno)) == -1) {
+            return -1;
         }
-        case 4: {
-            ip_address->ss_family = AF_INET;
-            struct sockaddr_in *sin = (struct sockaddr_in *)ip_address;
-            memcpy(&(sin->sin_addr.s_addr), bytes, (size_t)len);
-            Py_DECREF(packed);
-            return 1;
+    }
+
+    if (options->mlock_tree) {
+        void *tree;
+        size_t tree_length;
+        page_range(mmdb->file_content, tree_size(mmdb), &tree, &tree_length);
+        if (mlock(tree, tree_length) == -1 &&
+            PyErr_WarnFormat(PyExc_RuntimeWarning,
+                             1,
+                             "The search tree could not be locked in memory "
+                             "(%s)",
+                             strerror(errno)) == -1) {
+            return -1;
         }
-        default:
-            PyErr_SetString(
-                PyExc_ValueError,
-                "argument 1 returned an unexpected packed length for address");
-            Py_DECREF(packed);
-            return 0;
     }
+
+    if (options->prefault) {
+        Py_BEGIN_ALLOW_THREADS;
+        madvise(start, length, MADV_WILLNEED);
+        touch_pages(mmdb->file_content, (size_t)mmdb->file_size);
+        Py_END_ALLOW_THREADS;
+    }
+    return 0;
 }
 
-static bool format_sockaddr(struct sockaddr *sa, char *dst) {
-    char *addr;
-    if (sa->sa_family == AF_INET) {
-        struct sockaddr_in *sin = (struct sockaddr_in *)sa;
-        addr = (char *)&sin->sin_addr;
-    } else {
-        struct sockaddr_in6 *sin = (struct sockaddr_in6 *)sa;
-        addr = (char *)&sin->sin6_addr;
+// The size of the search tree, which is at the start of the file.
+static size_t tree_size(const MMDB_s *mmdb) {
+    return (size_t)mmdb->metadata.node_count * mmdb->metadata.record_size / 4;
+}
+
+// With MODE_HYBRID, the search tree is copied out of the file mapping into
+// anonymous memory aligned to, and advised to use, transparent huge pages,
+// so that walking the tree takes fewer TLB misses. The rest of the file is
+// moved with mremap to follow the copy without being read, so the database
+// is again one contiguous range that MMDB_close unmaps as usual. On error,
+// the database is left as it was.
+static int move_tree_to_anonymous_memory(MMDB_s *mmdb) {
+#ifdef MREMAP_FIXED
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = ((size_t)mmdb->file_size + page - 1) & ~(page - 1);
+    size_t tree_length = (tree_size(mmdb) + page - 1) & ~(page - 1);
+    if (tree_length > length) {
+        tree_length = length;
     }
 
-    if (inet_ntop(sa->sa_family, addr, dst, INET6_ADDRSTRLEN)) {
-        return true;
+    // Reserve enough to align the start to a huge page and give back the
+    // rest.
+    size_t reserved = length + HUGE_PAGE_SIZE;
+    uint8_t *region = mmap(NULL,
+                           reserved,
+                           PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS,
+                           -1,
+                           0);
+    if (MAP_FAILED == region) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
     }
-    PyErr_SetString(PyExc_RuntimeError, "unable to format IP address");
-    return false;
+    uint8_t *start =
+        (uint8_t *)(((uintptr_t)region + HUGE_PAGE_SIZE - 1) &
+                    ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (start > region) {
+        munmap(region, (size_t)(start - region));
+    }
+    munmap(start + length, (size_t)(region + reserved - (start + length)));
+
+    uint8_t *content = (uint8_t *)mmdb->file_content;
+    bool moved;
+    Py_BEGIN_ALLOW_THREADS;
+#ifdef MADV_HUGEPAGE
+    // This is only a hint. Without transparent huge pages, the copy still
+    // keeps the tree resident.
+    madvise(start, tree_length, MADV_HUGEPAGE);
+#endif
+    memcpy(start, content, tree_length);
+    moved = mprotect(start, tree_length, PROT_READ) == 0 &&
+            (tree_length == length ||
+             MAP_FAILED != mremap(content + tree_length,
+                                  length - tree_length,
+                                  length - tree_length,
+                                  MREMAP_MAYMOVE | MREMAP_FIXED,
+                                  start + tree_length));
+    Py_END_ALLOW_THREADS;
+    if (!moved) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        munmap(start, length);
+        return -1;
+    }
+
+    munmap(content, tree_length);
+    mmdb->data_section = start + (mmdb->data_section - content);
+    mmdb->metadata_section = start + (mmdb->metadata_section - content);
+    mmdb->file_content = start;
+    return 0;
+#else
+    (void)mmdb;
+    PyErr_SetString(PyExc_ValueError,
+                    "MODE_HYBRID is not supported on this platform");
+    return -1;
+#endif
 }
 
-static PyObject *Reader_metadata(PyObject *self, PyObject *UNUSED(args)) {
-    Reader_obj *mmdb_obj = (Reader_obj *)self;
+// Widens [start, start + size) to whole pages, as madvise, mlock and mincore
+// require.
+static void
+page_range(const void *start, size_t size, void **aligned, size_t *length) {
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t first = (uintptr_t)start & ~(page - 1);
+    uintptr_t end = ((uintptr_t)start + size + page - 1) & ~(page - 1);
+    *aligned = (void *)first;
+    *length = end - first;
+}
 
-    if (NULL == mmdb_obj->mmdb) {
-        PyErr_SetString(PyExc_IOError,
-                        "Attempt to read from a closed MaxMind DB.");
-        return NULL;
+// Reads a byte of each page so that the pages are faulted in.
+static void touch_pages(const uint8_t *start, size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    volatile uint8_t sink = 0;
+    size_t i;
+    for (i = 0; i < size; i += page) {
+        sink = start[i];
     }
+    (void)sink;
+}
 
-    MMDB_entry_data_list_s *entry_data_list;
-    MMDB_get_metadata_as_entry_data_list(mmdb_obj->mmdb, &entry_data_list);
-    MMDB_entry_data_list_s *original_entry_data_list = entry_data_list;
+// Returns the fraction of the pages of [start, start + size) that are in
+// memory, or -1 with an exception set.
+static double resident_fraction(const uint8_t *start, size_t size) {
+    void *aligned;
+    size_t length;
+    page_range(start, size, &aligned, &length);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t pages = length / page;
+    if (pages == 0) {
+        return 1.0;
+    }
+    unsigned char *vec = malloc(pages);
+    if (NULL == vec) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (mincore(aligned, length, (void *)vec) == -1) {
+        free(vec);
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    size_t resident = 0;
+    size_t i;
+    for (i = 0; i < pages; i++) {
+        resident += vec[i] & 1;
+    }
+    free(vec);
+    return (double)resident / (double)pages;
+}
 
-    PyObject *metadata_dict = from_entry_data_list(&entry_data_list);
-    MMDB_free_entry_data_list(original_entry_data_list);
-    if (NULL == metadata_dict || !PyDict_Check(metadata_dict)) {
-        PyErr_SetString(MaxMindDB_error, "Error decoding metadata.");
+static PyObject *Reader_warm(PyObject *self, PyObject *args, PyObject *kwds) {
+    int tree = 1;
+    int data = 1;
+    static char *kwlist[] = {"tree", "data", NULL};
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kwds, "|$pp", kwlist, &tree, &data)) {
+        return NULL;
+    }
+    mmdb_handle_s *handle = reader_open_handle((Reader_obj *)self);
+    if (NULL == handle) {
         return NULL;
     }
+    MMDB_s *mmdb = &handle->mmdb;
+    Py_BEGIN_ALLOW_THREADS;
+    if (tree) {
+        touch_pages(mmdb->file_content, tree_size(mmdb));
+    }
+    if (data) {
+        touch_pages(mmdb->data_section, mmdb->data_section_size);
+    }
+    Py_END_ALLOW_THREADS;
+    handle_decref(handle);
+    Py_RETURN_NONE;
+}
 
-    PyObject *args = PyTuple_New(0);
-    if (NULL == args) {
-        Py_DECREF(metadata_dict);
+static PyObject *Reader_residency(PyObject *self, PyObject *UNUSED(args)) {
+    mmdb_handle_s *handle = reader_open_handle((Reader_obj *)self);
+    if (NULL == handle) {
+        return NULL;
+    }
+    MMDB_s *mmdb = &handle->mmdb;
+    double tree = resident_fraction(mmdb->file_content, tree_size(mmdb));
+    double data = -1;
+    if (tree != -1) {
+        data = resident_fraction(mmdb->data_section, mmdb->data_section_size);
+    }
+    handle_decref(handle);
+    if (data == -1) {
         return NULL;
     }
+    return Py_BuildValue("{s:d,s:d}", "tree", tree, "data", data);
+}
 
-    PyObject *metadata =
-        PyObject_Call((PyObject *)&Metadata_Type, args, metadata_dict);
+// Returns a new reference to the reader's database, or NULL if the reader is
+// closed.
+static mmdb_handle_s *reader_handle(Reader_obj *reader) {
+    mmdb_handle_s *handle;
+    Py_BEGIN_CRITICAL_SECTION(reader);
+    handle = reader->handle;
+    if (NULL != handle) {
+        __atomic_add_fetch(&handle->refcount, 1, __ATOMIC_RELAXED);
+    }
+    Py_END_CRITICAL_SECTION();
+    return handle;
+}
 
-    Py_DECREF(metadata_dict);
-    return metadata;
+// As reader_handle, but with a ValueError set if the reader is closed.
+static mmdb_handle_s *reader_open_handle(Reader_obj *reader) {
+    mmdb_handle_s *handle = reader_handle(reader);
+    if (NULL == handle) {
+        PyErr_SetString(PyExc_ValueError,
+                        "Attempt to read from a closed MaxMind DB.");
+    }
+    return handle;
 }
 
-static PyObject *Reader_close(PyObject *self, PyObject *UNUSED(args)) {
-    Reader_obj *mmdb_obj = (Reader_obj *)self;
+// Drops a reference to the handle, closing the database with the last one.
+static void handle_decref(mmdb_handle_s *handle) {
+    if (NULL == handle ||
+        __atomic_sub_fetch(&handle->refcount, 1, __ATOMIC_ACQ_REL) != 0) {
+        return;
+    }
+    if (NULL != handle->buffer.obj) {
+        // The memory is the caller's, so MMDB_close must not unmap it.
+        handle->mmdb.file_content = NULL;
+        MMDB_close(&handle->mmdb);
+        PyBuffer_Release(&handle->buffer);
+    } else {
+        MMDB_close(&handle->mmdb);
+    }
+    if (NULL != handle->materialized) {
+        record_table_free(handle->materialized);
+    }
+    if (NULL != handle->cache) {
+        record_cache_free(handle->cache);
+    }
+    schema_free(handle->schema);
+    Py_XDECREF(handle->error);
+    if (NULL != handle->data_section) {
+        DataSection_obj *data_section = (DataSection_obj *)handle->data_section;
+        Py_BEGIN_CRITICAL_SECTION(data_section);
+        data_section->handle = NULL;
+        Py_END_CRITICAL_SECTION();
+        Py_DECREF(data_section);
+    }
+    free(handle);
+}
 
-    if (NULL != mmdb_obj->mmdb) {
-        MMDB_close(mmdb_obj->mmdb);
-        free(mmdb_obj->mmdb);
-        mmdb_obj->mmdb = NULL;
+static PyObject *Reader_get(PyObject *self, PyObject *args) {
+    PyObject *record = NULL;
+    if (get_record(self, args, &record) == -1) {
+        return NULL;
     }
+    return record;
+}
 
-    mmdb_obj->closed = Py_True;
+static PyObject *Reader_get_with_prefix_len(PyObject *self, PyObject *args) {
+    PyObject *record = NULL;
+    int prefix_len = get_record(self, args, &record);
+    if (prefix_len == -1) {
+        return NULL;
+    }
 
-    Py_RETURN_NONE;
+    PyObject *tuple = Py_BuildValue("(Oi)", record, prefix_len);
+    Py_DECREF(record);
+
+    return tuple;
 }
 
-static PyObject *Reader__enter__(PyObject *self, PyObject *UNUSED(args)) {
-    Reader_obj *mmdb_obj = (Reader_obj *)self;
+// The asyncio methods only schedule work on the event loop, so they share
+// the Python implementation in maxminddb.aio with the pure Python reader.
+static PyObject *call_aio(const char *name, PyObject *self, PyObject *args) {
+    PyObject *arg;
+    if (!PyArg_ParseTuple(args, "O", &arg)) {
+        return NULL;
+    }
+    PyObject *aio = PyImport_ImportModule("maxminddb.aio");
+    if (NULL == aio) {
+        return NULL;
+    }
+    PyObject *coroutine = PyObject_CallMethod(aio, name, "OO", self, arg);
+    Py_DECREF(aio);
+    return coroutine;
+}
+
+static PyObject *Reader_aget(PyObject *self, PyObject *args) {
+    return call_aio("aget", self, args);
+}
+
+static PyObject *Reader_aget_many(PyObject *self, PyObject *args) {
+    return call_aio("aget_many", self, args);
+}
+
+static PyObject *Reader_get_lazy(PyObject *self, PyObject *args) {
+    mmdb_handle_s *handle = reader_open_handle((Reader_obj *)self);
+    if (NULL == handle) {
+        return NULL;
+    }
+    PyObject *record = get_lazy((Reader_obj *)self, handle, args);
+    handle_decref(handle);
+    return record;
+}
+
+static PyObject *
+get_lazy(Reader_obj *reader, mmdb_handle_s *handle, PyObject *args) {
+    struct sockaddr_storage ip_address_ss = {0};
+    MMDB_lookup_result_s result;
+    if (lookup_entry(handle, args, &ip_address_ss, &result) == -1) {
+        return NULL;
+    }
+
+    if (!result.found_entry) {
+        Py_RETURN_NONE;
+    }
+
+    record_table_s *materialized = handle->materialized;
+    if (NULL != materialized) {
+        // The record has already been decoded in full, so there is nothing
+        // to gain from decoding it lazily.
+        PyObject *record = record_table_get(materialized, result.entry.offset);
+        if (NULL != record) {
+            Py_INCREF(record);
+            return record;
+        }
+    }
+
+    const char *const path[] = {NULL};
+    MMDB_entry_data_s entry_data;
+    int status = MMDB_aget_value(&result.entry, &entry_data, path);
+    if (MMDB_SUCCESS != status) {
+        char ipstr[INET6_ADDRSTRLEN] = {0};
+        if (format_sockaddr((struct sockaddr *)&ip_address_ss, ipstr)) {
+            PyErr_Format(reader_error(reader),
+                         "Error while looking up data for %s. %s",
+                         ipstr,
+                         MMDB_strerror(status));
+        }
+        return NULL;
+    }
+
+    return lazy_value(reader, handle, &entry_data);
+}
+
+// Returns a borrowed reference to a fast sequence of the field names, Py_None
+// if fields is Py_None, or NULL with an exception set.
+static PyObject *json_fields(PyObject *fields) {
+    if (Py_None == fields) {
+        return fields;
+    }
+    if (PyUnicode_Check(fields)) {
+        PyErr_SetString(PyExc_TypeError,
+                        "fields must be a sequence of strings, not a string");
+        return NULL;
+    }
+
+    PyObject *fast = PySequence_Fast(fields, "fields must be a sequence");
+    if (NULL == fast) {
+        return NULL;
+    }
+    Py_ssize_t i;
+    for (i = 0; i < PySequence_Fast_GET_SIZE(fast); i++) {
+        if (!PyUnicode_Check(PySequence_Fast_GET_ITEM(fast, i))) {
+            Py_DECREF(fast);
+            PyErr_SetString(PyExc_TypeError, "fields must be strings");
+            return NULL;
+        }
+    }
+    return fast;
+}
+
+static PyObject *
+Reader_get_json(PyObject *self, PyObject *args, PyObject *kwds) {
+    PyObject *ip;
+    PyObject *fields = Py_None;
+
+    static char *kwlist[] = {"ip_address", "fields", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|O", kwlist, &ip, &fields)) {
+        return NULL;
+    }
+
+    fields = json_fields(fields);
+    if (NULL == fields) {
+        return NULL;
+    }
+
+    byte_buffer_s buf = {0};
+    int status = json_write_address((Reader_obj *)self, &buf, ip, fields);
+    if (Py_None != fields) {
+        Py_DECREF(fields);
+    }
+
+    PyObject *json = NULL;
+    if (1 == status) {
+        json = PyBytes_FromStringAndSize(buf.data, (Py_ssize_t)buf.size);
+    } else if (0 == status) {
+        Py_INCREF(Py_None);
+        json = Py_None;
+    }
+    free(buf.data);
+    return json;
+}
+
+static PyObject *
+Reader_get_many_json(PyObject *self, PyObject *args, PyObject *kwds) {
+    PyObject *ips;
+    PyObject *fields = Py_None;
+
+    static char *kwlist[] = {"ip_addresses", "fields", NULL};
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kwds, "O|O", kwlist, &ips, &fields)) {
+        return NULL;
+    }
+
+    PyObject *iterator = PyObject_GetIter(ips);
+    if (NULL == iterator) {
+        return NULL;
+    }
+
+    fields = json_fields(fields);
+    if (NULL == fields) {
+        Py_DECREF(iterator);
+        return NULL;
+    }
+
+    byte_buffer_s buf = {0};
+    int status = buffer_write(&buf, "[", 1);
+    bool first = true;
+    PyObject *ip;
+    while (status != -1 && NULL != (ip = PyIter_Next(iterator))) {
+        if (!first) {
+            status = buffer_write(&buf, ",", 1);
+        }
+        first = false;
+        if (status != -1) {
+            status =
+                json_write_address((Reader_obj *)self, &buf, ip, fields);
+        }
+        if (0 == status) {
+            status = buffer_write(&buf, "null", 4);
+        }
+        Py_DECREF(ip);
+    }
+    Py_DECREF(iterator);
+    if (Py_None != fields) {
+        Py_DECREF(fields);
+    }
+
+    PyObject *json = NULL;
+    if (status != -1 && !PyErr_Occurred() && buffer_write(&buf, "]", 1) != -1) {
+        json = PyBytes_FromStringAndSize(buf.data, (Py_ssize_t)buf.size);
+    }
+    free(buf.data);
+    return json;
+}
+
+static PyObject *Reader_get_raw(PyObject *self, PyObject *args) {
+    mmdb_handle_s *handle = reader_open_handle((Reader_obj *)self);
+    if (NULL == handle) {
+        return NULL;
+    }
+    PyObject *raw = get_raw(handle, args);
+    handle_decref(handle);
+    return raw;
+}
+
+static PyObject *get_raw(mmdb_handle_s *handle, PyObject *args) {
+    struct sockaddr_storage ip_address_ss = {0};
+    MMDB_lookup_result_s result;
+    if (lookup_entry(handle, args, &ip_address_ss, &result) == -1) {
+        return NULL;
+    }
+
+    if (!result.found_entry) {
+        Py_RETURN_NONE;
+    }
+
+    MMDB_s *mmdb = &handle->mmdb;
+    uint32_t end;
+    bool has_pointers = false;
+    int status =
+        raw_value(mmdb, result.entry.offset, NULL, &end, &has_pointers, 0);
+    if (0 != status) {
+        raw_raise(handle->error, status);
+        return NULL;
+    }
+
+    if (!has_pointers) {
+        // The record is already self-contained, so return a view of it in
+        // the database it was found in. The view keeps that database mapped.
+        PyObject *view = PyMemoryView_FromObject(handle->data_section);
+        if (NULL == view) {
+            return NULL;
+        }
+        PyObject *start_obj = PyLong_FromUnsignedLong(result.entry.offset);
+        PyObject *end_obj = PyLong_FromUnsignedLong(end);
+        PyObject *slice = NULL;
+        PyObject *raw = NULL;
+        if (NULL != start_obj && NULL != end_obj) {
+            slice = PySlice_New(start_obj, end_obj, NULL);
+        }
+        if (NULL != slice) {
+            raw = PyObject_GetItem(view, slice);
+        }
+        Py_XDECREF(slice);
+        Py_XDECREF(start_obj);
+        Py_XDECREF(end_obj);
+        Py_DECREF(view);
+        return raw;
+    }
+
+    byte_buffer_s buf = {0};
+    PyObject *raw = NULL;
+    status = raw_value(mmdb, result.entry.offset, &buf, &end, &has_pointers, 0);
+    if (0 != status) {
+        raw_raise(handle->error, status);
+    } else {
+        raw = PyBytes_FromStringAndSize(buf.data, (Py_ssize_t)buf.size);
+    }
+    free(buf.data);
+    return raw;
+}
+
+// Returns the column format for values of the given type or 0 if the type
+// cannot be stored in a column.
+static char column_kind(uint32_t type) {
+    switch (type) {
+        case MMDB_DATA_TYPE_UTF8_STRING:
+            return 's';
+        case MMDB_DATA_TYPE_DOUBLE:
+        case MMDB_DATA_TYPE_FLOAT:
+            return 'd';
+        case MMDB_DATA_TYPE_UINT16:
+        case MMDB_DATA_TYPE_UINT32:
+            return 'I';
+        case MMDB_DATA_TYPE_INT32:
+            return 'i';
+        case MMDB_DATA_TYPE_UINT64:
+            return 'Q';
+        case MMDB_DATA_TYPE_BOOLEAN:
+            return '?';
+        default:
+            return 0;
+    }
+}
+
+static size_t column_item_size(char kind) {
+    switch (kind) {
+        case 'd':
+        case 'Q':
+        case 's':
+            // String columns hold 64-bit offsets.
+            return 8;
+        case 'I':
+        case 'i':
+            return 4;
+        default:
+            return 1;
+    }
+}
+
+// Allocates the value buffers of a column with n rows once the type of its
+// values is known.
+static int column_init(column_s *column, char kind, Py_ssize_t n) {
+    column->kind = kind;
+    Py_ssize_t size = n * (Py_ssize_t)column_item_size(kind);
+    if ('s' == kind) {
+        column->offsets = PyByteArray_FromStringAndSize(NULL, size + 8);
+        column->values = PyByteArray_FromStringAndSize(NULL, 0);
+        if (NULL == column->offsets || NULL == column->values) {
+            return -1;
+        }
+        memset(PyByteArray_AS_STRING(column->offsets), 0, size + 8);
+        return 0;
+    }
+
+    column->values = PyByteArray_FromStringAndSize(NULL, size);
+    if (NULL == column->values) {
+        return -1;
+    }
+    if ('d' == kind) {
+        // Missing floating point values are NaN.
+        double *values = (double *)PyByteArray_AS_STRING(column->values);
+        Py_ssize_t i;
+        for (i = 0; i < n; i++) {
+            values[i] = Py_NAN;
+        }
+    } else {
+        memset(PyByteArray_AS_STRING(column->values), 0, size);
+    }
+    return 0;
+}
+
+// Sets the offsets of the rows before row, which have no string, to the
+// current end of the string data.
+static void column_fill_offsets(column_s *column, Py_ssize_t row) {
+    int64_t *offsets = (int64_t *)PyByteArray_AS_STRING(column->offsets);
+    while (column->next_row < row) {
+        offsets[column->next_row + 1] = offsets[column->next_row];
+        column->next_row++;
+    }
+}
+
+static int column_store(column_s *column,
+                        PyObject *field,
+                        Py_ssize_t row,
+                        Py_ssize_t n,
+                        const MMDB_entry_data_s *entry_data) {
+    char kind = column_kind(entry_data->type);
+    if (0 == kind) {
+        PyErr_Format(PyExc_TypeError,
+                     "The values of %R cannot be stored in a column",
+                     field);
+        return -1;
+    }
+    if (0 == column->kind) {
+        if (column_init(column, kind, n) == -1) {
+            return -1;
+        }
+    } else if (kind != column->kind) {
+        PyErr_Format(PyExc_ValueError,
+                     "The values of %R have more than one type",
+                     field);
+        return -1;
+    }
+
+    char *values = PyByteArray_AS_STRING(column->values);
+    switch (kind) {
+        case 's': {
+            column_fill_offsets(column, row);
+            Py_ssize_t size = PyByteArray_GET_SIZE(column->values);
+            if (PyByteArray_Resize(column->values,
+                                   size + entry_data->data_size) == -1) {
+                return -1;
+            }
+            memcpy(PyByteArray_AS_STRING(column->values) + size,
+                   entry_data->utf8_string,
+                   entry_data->data_size);
+            int64_t *offsets =
+                (int64_t *)PyByteArray_AS_STRING(column->offsets);
+            offsets[row + 1] = size + entry_data->data_size;
+            column->next_row = row + 1;
+            break;
+        }
+        case 'd':
+            ((double *)values)[row] =
+                MMDB_DATA_TYPE_DOUBLE == entry_data->type
+                    ? entry_data->double_value
+                    : entry_data->float_value;
+            break;
+        case 'I':
+            ((uint32_t *)values)[row] =
+                MMDB_DATA_TYPE_UINT16 == entry_data->type ? entry_data->uint16
+                                                          : entry_data->uint32;
+            break;
+        case 'i':
+            ((int32_t *)values)[row] = entry_data->int32;
+            break;
+        case 'Q':
+            ((uint64_t *)values)[row] = entry_data->uint64;
+            break;
+        default:
+            ((uint8_t *)values)[row] = entry_data->boolean;
+    }
+    PyByteArray_AS_STRING(column->valid)[row] = 1;
+    return 0;
+}
+
+// Returns a memoryview of the bytearray with the given format.
+static PyObject *column_view(PyObject *buffer, const char *format) {
+    PyObject *view = PyMemoryView_FromObject(buffer);
+    if (NULL == view) {
+        return NULL;
+    }
+    PyObject *cast = PyObject_CallMethod(view, "cast", "s", format);
+    Py_DECREF(view);
+    return cast;
+}
+
+static PyObject *column_result(column_s *column,
+                               Py_ssize_t n,
+                               PyObject *column_type) {
+    if (0 == column->kind && column_init(column, 'd', n) == -1) {
+        return NULL;
+    }
+
+    PyObject *offsets = Py_None;
+    Py_INCREF(offsets);
+    char format[2] = {column->kind, 0};
+    if ('s' == column->kind) {
+        column_fill_offsets(column, n);
+        Py_DECREF(offsets);
+        offsets = column_view(column->offsets, "q");
+        format[0] = 'B';
+    }
+    PyObject *values = column_view(column->values, format);
+    PyObject *valid = column_view(column->valid, "?");
+
+    PyObject *result = NULL;
+    if (NULL != values && NULL != valid && NULL != offsets) {
+        result = PyObject_CallFunctionObjArgs(
+            column_type, values, valid, offsets, NULL);
+    }
+    Py_XDECREF(values);
+    Py_XDECREF(valid);
+    Py_XDECREF(offsets);
+    return result;
+}
+
+static void column_free(column_s *column) {
+    Py_XDECREF(column->components);
+    PyMem_Free(column->path);
+    Py_XDECREF(column->values);
+    Py_XDECREF(column->valid);
+    Py_XDECREF(column->offsets);
+}
+
+// Sets up a column for a field given either as a dotted string or as a
+// sequence of keys.
+static int column_setup(column_s *column, PyObject *field, Py_ssize_t n) {
+    if (PyUnicode_Check(field)) {
+        PyObject *separator = PyUnicode_FromString(".");
+        if (NULL == separator) {
+            return -1;
+        }
+        column->components = PyUnicode_Split(field, separator, -1);
+        Py_DECREF(separator);
+    } else {
+        column->components = PySequence_List(field);
+    }
+    if (NULL == column->components) {
+        return -1;
+    }
+
+    Py_ssize_t count = PyList_GET_SIZE(column->components);
+    column->path = PyMem_New(const char *, count + 1);
+    if (NULL == column->path) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    Py_ssize_t i;
+    for (i = 0; i < count; i++) {
+        PyObject *component = PyList_GET_ITEM(column->components, i);
+        if (PyLong_Check(component)) {
+            // Array indexes are passed to libmaxminddb as strings.
+            PyObject *str = PyObject_Str(component);
+            if (NULL == str) {
+                return -1;
+            }
+            PyList_SET_ITEM(column->components, i, str);
+            Py_DECREF(component);
+            component = str;
+        }
+        column->path[i] = PyUnicode_Check(component)
+                              ? PyUnicode_AsUTF8(component)
+                              : NULL;
+        if (NULL == column->path[i]) {
+            if (!PyErr_Occurred()) {
+                PyErr_SetString(PyExc_TypeError,
+                                "fields must be strings or sequences of "
+                                "keys and indexes");
+            }
+            return -1;
+        }
+    }
+    column->path[count] = NULL;
+
+    column->valid = PyByteArray_FromStringAndSize(NULL, n);
+    if (NULL == column->valid) {
+        return -1;
+    }
+    memset(PyByteArray_AS_STRING(column->valid), 0, n);
+    return 0;
+}
+
+// Looks up each address and stores the values of its record in the columns.
+static int fill_columns(mmdb_handle_s *handle,
+                        PyObject *ip_seq,
+                        PyObject *field_seq,
+                        column_s *columns) {
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(ip_seq);
+    Py_ssize_t column_count = PySequence_Fast_GET_SIZE(field_seq);
+    Py_ssize_t c, row;
+    for (c = 0; c < column_count; c++) {
+        if (column_setup(
+                &columns[c], PySequence_Fast_GET_ITEM(field_seq, c), n) == -1) {
+            return -1;
+        }
+    }
+
+    for (row = 0; row < n; row++) {
+        struct sockaddr_storage ip_address_ss = {0};
+        MMDB_lookup_result_s lookup;
+        if (lookup_address(handle,
+                           PySequence_Fast_GET_ITEM(ip_seq, row),
+                           &ip_address_ss,
+                           &lookup) == -1) {
+            return -1;
+        }
+        if (!lookup.found_entry) {
+            continue;
+        }
+
+        for (c = 0; c < column_count; c++) {
+            MMDB_entry_data_s entry_data;
+            int status =
+                MMDB_aget_value(&lookup.entry, &entry_data, columns[c].path);
+            if (MMDB_LOOKUP_PATH_DOES_NOT_MATCH_DATA_ERROR == status ||
+                MMDB_INVALID_LOOKUP_PATH_ERROR == status ||
+                (MMDB_SUCCESS == status && !entry_data.has_data)) {
+                continue;
+            }
+            if (MMDB_SUCCESS != status) {
+                char ipstr[INET6_ADDRSTRLEN] = {0};
+                if (format_sockaddr((struct sockaddr *)&ip_address_ss, ipstr)) {
+                    PyErr_Format(handle->error,
+                                 "Error while looking up data for %s. %s",
+                                 ipstr,
+                                 MMDB_strerror(status));
+                }
+                return -1;
+            }
+            if (column_store(&columns[c],
+                             PySequence_Fast_GET_ITEM(field_seq, c),
+                             row,
+                             n,
+                             &entry_data) == -1) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static PyObject *columns_dict(PyObject *column_type,
+                              PyObject *field_seq,
+                              column_s *columns,
+                              Py_ssize_t n) {
+    PyObject *result = PyDict_New();
+    Py_ssize_t c;
+    for (c = 0; NULL != result && c < PySequence_Fast_GET_SIZE(field_seq);
+         c++) {
+        PyObject *column = column_result(&columns[c], n, column_type);
+        if (NULL == column ||
+            PyDict_SetItem(
+                result, PySequence_Fast_GET_ITEM(field_seq, c), column) == -1) {
+            Py_XDECREF(column);
+            Py_CLEAR(result);
+            break;
+        }
+        Py_DECREF(column);
+    }
+    return result;
+}
+
+static PyObject *Reader_get_columns(PyObject *self, PyObject *args) {
+    PyObject *ips, *fields;
+    if (!PyArg_ParseTuple(args, "OO", &ips, &fields)) {
+        return NULL;
+    }
+
+    PyObject *ip_seq = PySequence_Fast(ips, "ip_addresses must be iterable");
+    if (NULL == ip_seq) {
+        return NULL;
+    }
+    PyObject *field_seq = PySequence_Fast(fields, "fields must be iterable");
+    if (NULL == field_seq) {
+        Py_DECREF(ip_seq);
+        return NULL;
+    }
+
+    Py_ssize_t column_count = PySequence_Fast_GET_SIZE(field_seq);
+    column_s *columns =
+        PyMem_Calloc(column_count ? column_count : 1, sizeof(column_s));
+    mmdb_handle_s *handle = NULL;
+    PyObject *result = NULL;
+    if (NULL == columns) {
+        PyErr_NoMemory();
+    } else if (NULL != (handle = reader_open_handle((Reader_obj *)self)) &&
+               fill_columns(handle, ip_seq, field_seq, columns) != -1) {
+        result = columns_dict(
+            module_state(((Reader_obj *)self)->module)->column_type,
+            field_seq,
+            columns,
+            PySequence_Fast_GET_SIZE(ip_seq));
+    }
+    handle_decref(handle);
+
+    if (NULL != columns) {
+        Py_ssize_t c;
+        for (c = 0; c < column_count; c++) {
+            column_free(&columns[c]);
+        }
+        PyMem_Free(columns);
+    }
+    Py_DECREF(field_seq);
+    Py_DECREF(ip_seq);
+    return result;
+}
+
+// Batches are not split into shares of fewer addresses or bytes of text than
+// these, as starting a thread would cost more than it saves.
+#define PARALLEL_MIN_ADDRESSES 4096
+#define PARALLEL_MIN_TEXT_BYTES (64 * 1024)
+
+// A share of a batch, queued for the worker pool. pending counts the shares
+// of its batch that are not done yet.
+typedef struct worker_job_s {
+    void (*run)(void *task);
+    void *task;
+    int *pending;
+    struct worker_job_s *next;
+} worker_job_s;
+
+// The native threads that run the shares of large batches. They are started
+// as batches first need them and kept until the module is freed, so that a
+// batch does not pay for starting threads. The fields are protected by the
+// mutex.
+struct worker_pool_s {
+    pthread_mutex_t mutex;
+    // Signalled when a job is queued or the pool is stopping.
+    pthread_cond_t queued;
+    // Signalled when a job is done.
+    pthread_cond_t finished;
+    worker_job_s *head;
+    worker_job_s *tail;
+    pthread_t *threads;
+    int thread_count;
+    bool stopping;
+    // The process that started the threads. A forked child has none of
+    // them, so it starts its own.
+    pid_t pid;
+};
+
+static worker_pool_s *worker_pool_new(void) {
+    worker_pool_s *pool = calloc(1, sizeof(worker_pool_s));
+    if (NULL == pool) {
+        return NULL;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->queued, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    pool->pid = getpid();
+    return pool;
+}
+
+// In a forked child, forgets the parent's threads and the jobs of its
+// batches, and resets the mutex, which one of them may have held.
+static void worker_pool_after_fork(worker_pool_s *pool) {
+    if (pool->pid == getpid()) {
+        return;
+    }
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->queued, NULL);
+    pthread_cond_init(&pool->finished, NULL);
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->thread_count = 0;
+    pool->pid = getpid();
+}
+
+// Stops and joins the threads. No batch may be running.
+static void worker_pool_free(worker_pool_s *pool) {
+    if (NULL == pool) {
+        return;
+    }
+    worker_pool_after_fork(pool);
+    pthread_mutex_lock(&pool->mutex);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->queued);
+    pthread_mutex_unlock(&pool->mutex);
+    int i;
+    for (i = 0; i < pool->thread_count; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->queued);
+    pthread_cond_destroy(&pool->finished);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool);
+}
+
+// Runs the job at the head of the queue, which must not be empty. The mutex
+// is released while it runs.
+static void worker_pool_run_job(worker_pool_s *pool) {
+    worker_job_s *job = pool->head;
+    pool->head = job->next;
+    if (NULL == pool->head) {
+        pool->tail = NULL;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    job->run(job->task);
+    pthread_mutex_lock(&pool->mutex);
+    // The batch's jobs may be freed as soon as the count reaches 0.
+    if (0 == --*job->pending) {
+        pthread_cond_broadcast(&pool->finished);
+    }
+}
+
+static void *worker_main(void *arg) {
+    worker_pool_s *pool = arg;
+    pthread_mutex_lock(&pool->mutex);
+    for (;;) {
+        while (NULL == pool->head && !pool->stopping) {
+            pthread_cond_wait(&pool->queued, &pool->mutex);
+        }
+        if (NULL == pool->head) {
+            break;
+        }
+        worker_pool_run_job(pool);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
+
+// Starts threads until there are count of them or one cannot be started.
+// Called with the mutex held.
+static void worker_pool_grow(worker_pool_s *pool, int count) {
+    if (count <= pool->thread_count) {
+        return;
+    }
+    pthread_t *threads = realloc(pool->threads, count * sizeof(pthread_t));
+    if (NULL == threads) {
+        return;
+    }
+    pool->threads = threads;
+    while (pool->thread_count < count &&
+           0 == pthread_create(&pool->threads[pool->thread_count],
+                               NULL,
+                               worker_main,
+                               pool)) {
+        pool->thread_count++;
+    }
+}
+
+// Returns the number of tasks to split a batch of size items into: at most
+// one per thread of the reader and each with at least min_size items.
+static int
+parallel_tasks(Reader_obj *reader, Py_ssize_t size, Py_ssize_t min_size) {
+    Py_ssize_t tasks = size / min_size;
+    int threads;
+    // A concurrent __init__ may change it.
+    Py_BEGIN_CRITICAL_SECTION(reader);
+    threads = reader->threads;
+    Py_END_CRITICAL_SECTION();
+    if (tasks > threads) {
+        tasks = threads;
+    }
+    return tasks < 1 ? 1 : (int)tasks;
+}
+
+// Runs each of the count tasks, which are task_size bytes apart, with the GIL
+// released. The first task runs on the calling thread and the others on the
+// module's worker pool. While it waits for them, the calling thread runs
+// queued tasks too, so every task runs even if no thread could be started.
+// The tasks must not use the Python API, and the caller must hold a
+// reference to the database they use.
+static int run_parallel(worker_pool_s *pool,
+                        void (*run)(void *task),
+                        void *tasks,
+                        size_t task_size,
+                        int count) {
+    worker_job_s *jobs = NULL;
+    if (count > 1 &&
+        NULL == (jobs = PyMem_Calloc(count - 1, sizeof(worker_job_s)))) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    int pending = count - 1;
+    int i;
+    for (i = 1; i < count; i++) {
+        jobs[i - 1].run = run;
+        jobs[i - 1].task = (char *)tasks + i * task_size;
+        jobs[i - 1].pending = &pending;
+    }
+
+    if (count > 1) {
+        worker_pool_after_fork(pool);
+    }
+    PyThreadState *thread_state = PyEval_SaveThread();
+    if (count > 1) {
+        pthread_mutex_lock(&pool->mutex);
+        worker_pool_grow(pool, count - 1);
+        for (i = 0; i < count - 1; i++) {
+            if (NULL == pool->tail) {
+                pool->head = &jobs[i];
+            } else {
+                pool->tail->next = &jobs[i];
+            }
+            pool->tail = &jobs[i];
+        }
+        pthread_cond_broadcast(&pool->queued);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    run(tasks);
+    if (count > 1) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pending > 0) {
+            if (NULL != pool->head) {
+                worker_pool_run_job(pool);
+            } else {
+                pthread_cond_wait(&pool->finished, &pool->mutex);
+            }
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+    PyEval_RestoreThread(thread_state);
+
+    PyMem_Free(jobs);
+    return 0;
+}
+
+// Returns the struct module type code of the buffer's items, ignoring a
+// native byte order prefix, or 0 if the items are not in native order.
+static char buffer_type(const Py_buffer *view) {
+    const char *format = NULL == view->format ? "B" : view->format;
+    if ('@' == format[0] || '=' == format[0]) {
+        format++;
+    }
+    return '\0' != format[0] && '\0' == format[1] ? format[0] : 0;
+}
+
+// Gets a writable one-dimensional buffer of at least count integers of the
+// given size.
+static int output_buffer(PyObject *obj,
+                         Py_buffer *view,
+                         const char *name,
+                         Py_ssize_t itemsize,
+                         Py_ssize_t count) {
+    if (PyObject_GetBuffer(
+            obj, view, PyBUF_WRITABLE | PyBUF_FORMAT | PyBUF_ND) == -1) {
+        return -1;
+    }
+    char type = buffer_type(view);
+    bool is_int = (8 == itemsize && ('q' == type || 'l' == type)) ||
+                  (1 == itemsize && 'B' == type);
+    if (!is_int || view->itemsize != itemsize || view->ndim != 1) {
+        PyErr_Format(PyExc_TypeError,
+                     "%s must be a contiguous buffer of %s",
+                     name,
+                     8 == itemsize ? "int64" : "uint8");
+    } else if (view->shape[0] < count) {
+        PyErr_Format(PyExc_ValueError,
+                     "%s must have room for %zd values",
+                     name,
+                     count);
+    } else {
+        return 0;
+    }
+    PyBuffer_Release(view);
+    return -1;
+}
+
+// A share of a lookup_buffer call. The addresses from start to start +
+// count are looked up with the GIL released.
+typedef struct {
+    MMDB_s *mmdb;
+    const uint8_t *addresses;
+    Py_ssize_t width;
+    Py_ssize_t start;
+    Py_ssize_t count;
+    int64_t *offsets;
+    uint8_t *prefix_lens;
+    Py_ssize_t found;
+    Py_ssize_t failed;
+    int status;
+} lookup_task_s;
+
+// Looks up the task's addresses from the packed address buffer, which holds
+// either native uint32 IPv4 addresses (width 0) or width bytes per address
+// in network order.
+static void lookup_packed(void *arg) {
+    lookup_task_s *task = arg;
+    Py_ssize_t i;
+    for (i = task->start; i < task->start + task->count; i++) {
+        struct sockaddr_storage ss = {0};
+        if (16 == task->width) {
+            struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&ss;
+            sin6->sin6_family = AF_INET6;
+            memcpy(&sin6->sin6_addr, task->addresses + i * 16, 16);
+        } else {
+            struct sockaddr_in *sin = (struct sockaddr_in *)&ss;
+            sin->sin_family = AF_INET;
+            if (0 == task->width) {
+                uint32_t address;
+                memcpy(&address, task->addresses + i * 4, 4);
+                sin->sin_addr.s_addr = htonl(address);
+            } else {
+                memcpy(&sin->sin_addr, task->addresses + i * 4, 4);
+            }
+        }
+
+        MMDB_lookup_result_s result = MMDB_lookup_sockaddr(
+            task->mmdb, (struct sockaddr *)&ss, &task->status);
+        if (MMDB_SUCCESS != task->status) {
+            task->failed = i;
+            return;
+        }
+
+        task->offsets[i] =
+            result.found_entry ? (int64_t)result.entry.offset : -1;
+        task->found += result.found_entry;
+        if (NULL != task->prefix_lens) {
+            task->prefix_lens[i] = (uint8_t)prefix_length(
+                task->mmdb, ss.ss_family, result.netmask);
+        }
+    }
+}
+
+// Splits the addresses between the reader's threads and returns the number
+// of addresses with a record.
+static PyObject *lookup_buffer_tasks(Reader_obj *reader,
+                                     mmdb_handle_s *handle,
+                                     const uint8_t *addresses,
+                                     Py_ssize_t width,
+                                     Py_ssize_t count,
+                                     int64_t *offsets,
+                                     uint8_t *prefix_lens) {
+    int task_count = parallel_tasks(reader, count, PARALLEL_MIN_ADDRESSES);
+    lookup_task_s *tasks = PyMem_Calloc(task_count, sizeof(lookup_task_s));
+    if (NULL == tasks) {
+        return PyErr_NoMemory();
+    }
+    int i;
+    for (i = 0; i < task_count; i++) {
+        tasks[i].mmdb = &handle->mmdb;
+        tasks[i].addresses = addresses;
+        tasks[i].width = width;
+        tasks[i].start = count * i / task_count;
+        tasks[i].count = count * (i + 1) / task_count - tasks[i].start;
+        tasks[i].offsets = offsets;
+        tasks[i].prefix_lens = prefix_lens;
+    }
+
+    PyObject *found = NULL;
+    if (run_parallel(module_state(reader->module)->pool,
+                     lookup_packed,
+                     tasks,
+                     sizeof(lookup_task_s),
+                     task_count) != -1) {
+        Py_ssize_t total = 0;
+        for (i = 0; i < task_count && NULL == PyErr_Occurred(); i++) {
+            if (MMDB_SUCCESS != tasks[i].status) {
+                PyErr_Format(
+                    MMDB_IPV6_LOOKUP_IN_IPV4_DATABASE_ERROR == tasks[i].status
+                        ? PyExc_ValueError
+                        : reader_error(reader),
+                    "Error looking up address %zd. %s",
+                    tasks[i].failed,
+                    MMDB_strerror(tasks[i].status));
+            }
+            total += tasks[i].found;
+        }
+        if (NULL == PyErr_Occurred()) {
+            found = PyLong_FromSsize_t(total);
+        }
+    }
+    PyMem_Free(tasks);
+    return found;
+}
+
+static PyObject *
+Reader_lookup_buffer(PyObject *self, PyObject *args, PyObject *kwds) {
+    PyObject *addresses_obj, *offsets_obj, *prefix_lens_obj = Py_None;
+    static char *kwlist[] = {"addresses", "offsets", "prefix_lens", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwds,
+                                     "OO|O",
+                                     kwlist,
+                                     &addresses_obj,
+                                     &offsets_obj,
+                                     &prefix_lens_obj)) {
+        return NULL;
+    }
+
+    Py_buffer addresses;
+    if (PyObject_GetBuffer(addresses_obj,
+                           &addresses,
+                           PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) == -1) {
+        return NULL;
+    }
+    char type = buffer_type(&addresses);
+    Py_ssize_t width = -1;
+    if (1 == addresses.ndim && 4 == addresses.itemsize &&
+        ('I' == type || 'L' == type)) {
+        width = 0;
+    } else if (2 == addresses.ndim && 1 == addresses.itemsize && 'B' == type &&
+               (4 == addresses.shape[1] || 16 == addresses.shape[1])) {
+        width = addresses.shape[1];
+    }
+    if (-1 == width) {
+        PyErr_SetString(PyExc_TypeError,
+                        "addresses must be a contiguous buffer of uint32 "
+                        "IPv4 addresses or an (N, 4) or (N, 16) buffer of "
+                        "packed addresses");
+        PyBuffer_Release(&addresses);
+        return NULL;
+    }
+    Py_ssize_t count = addresses.shape[0];
+
+    Py_buffer offsets, prefix_lens = {0};
+    PyObject *found = NULL;
+    mmdb_handle_s *handle = reader_open_handle((Reader_obj *)self);
+    if (NULL != handle &&
+        output_buffer(offsets_obj, &offsets, "offsets", 8, count) != -1) {
+        if (Py_None == prefix_lens_obj ||
+            output_buffer(
+                prefix_lens_obj, &prefix_lens, "prefix_lens", 1, count) !=
+                -1) {
+            found = lookup_buffer_tasks((Reader_obj *)self,
+                                        handle,
+                                        addresses.buf,
+                                        width,
+                                        count,
+                                        offsets.buf,
+                                        prefix_lens.buf);
+            if (Py_None != prefix_lens_obj) {
+                PyBuffer_Release(&prefix_lens);
+            }
+        }
+        PyBuffer_Release(&offsets);
+    }
+    handle_decref(handle);
+    PyBuffer_Release(&addresses);
+    return found;
+}
+
+static PyObject *Reader_decode_offset(PyObject *self, PyObject *args) {
+    Py_ssize_t offset;
+    if (!PyArg_ParseTuple(args, "n", &offset)) {
+        return NULL;
+    }
+
+    mmdb_handle_s *handle = reader_open_handle((Reader_obj *)self);
+    if (NULL == handle) {
+        return NULL;
+    }
+    PyObject *record = NULL;
+    if (offset < 0 || offset >= handle->mmdb.data_section_size) {
+        PyErr_Format(PyExc_ValueError,
+                     "%zd is not an offset in the data section",
+                     offset);
+    } else {
+        MMDB_entry_s entry = {.mmdb = &handle->mmdb,
+                              .offset = (uint32_t)offset};
+        int status = MMDB_SUCCESS;
+        record = entry_record(handle, &entry, &status);
+        if (MMDB_SUCCESS != status) {
+            PyErr_Format(reader_error((Reader_obj *)self),
+                         "Error while decoding data at offset %zd. %s",
+                         offset,
+                         MMDB_strerror(status));
+        }
+    }
+    handle_decref(handle);
+    return record;
+}
+
+// Parses a dotted quad IPv4 address of len characters.
+static bool parse_ipv4(const char *text, size_t len, struct in_addr *addr) {
+    uint32_t address = 0;
+    size_t i = 0;
+    int parts;
+    for (parts = 0; parts < 4; parts++) {
+        if (parts > 0) {
+            if (i == len || '.' != text[i]) {
+                return false;
+            }
+            i++;
+        }
+        size_t start = i;
+        uint32_t part = 0;
+        while (i < len && i - start < 3 && text[i] >= '0' && text[i] <= '9') {
+            part = part * 10 + (uint32_t)(text[i] - '0');
+            i++;
+        }
+        // Like inet_pton, we do not accept leading zeros.
+        if (i == start || part > 255 || ('0' == text[start] && i - start > 1)) {
+            return false;
+        }
+        address = address << 8 | part;
+    }
+    if (i != len) {
+        return false;
+    }
+    addr->s_addr = htonl(address);
+    return true;
+}
+
+// Parses an IPv4 or IPv6 address of len characters that is not
+// null-terminated.
+static bool
+parse_text_address(const char *text, size_t len, struct sockaddr_storage *ss) {
+    if (NULL == memchr(text, ':', len)) {
+        ss->ss_family = AF_INET;
+        return parse_ipv4(text, len, &((struct sockaddr_in *)ss)->sin_addr);
+    }
+    char ipstr[INET6_ADDRSTRLEN];
+    if (len >= sizeof(ipstr)) {
+        return false;
+    }
+    memcpy(ipstr, text, len);
+    ipstr[len] = '\0';
+    ss->ss_family = AF_INET6;
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)ss;
+    return inet_pton(AF_INET6, ipstr, &sin6->sin6_addr) == 1;
+}
+
+static bool is_text_space(char c) {
+    return ' ' == c || '\t' == c || '\r' == c || '\n' == c || '\v' == c ||
+           '\f' == c;
+}
+
+#define TEXT_PARSE_ERROR -1
+
+// A share of a get_many_text call. The lines from start to end are parsed
+// and looked up with the GIL released. The status is TEXT_PARSE_ERROR or
+// an MMDB status, with the failing address in error_text.
+typedef struct {
+    MMDB_s *mmdb;
+    const char *start;
+    const char *end;
+    char delimiter;
+    int64_t *offsets;
+    Py_ssize_t count;
+    Py_ssize_t capacity;
+    Py_ssize_t lines;
+    int status;
+    const char *error_text;
+    size_t error_len;
+} text_task_s;
+
+// Appends the data offset of the record, or -1 if there is none, to the
+// task's offsets.
+static bool text_task_append(text_task_s *task, int64_t offset) {
+    if (task->count == task->capacity) {
+        Py_ssize_t capacity = task->capacity ? task->capacity * 2 : 256;
+        int64_t *offsets =
+            PyMem_RawRealloc(task->offsets, capacity * sizeof(int64_t));
+        if (NULL == offsets) {
+            task->status = MMDB_OUT_OF_MEMORY_ERROR;
+            return false;
+        }
+        task->offsets = offsets;
+        task->capacity = capacity;
+    }
+    task->offsets[task->count++] = offset;
+    return true;
+}
+
+static void lookup_text(void *arg) {
+    text_task_s *task = arg;
+    const char *p = task->start;
+    while (p < task->end) {
+        const char *stop = memchr(p, task->delimiter, (size_t)(task->end - p));
+        if (NULL == stop) {
+            stop = task->end;
+        }
+        const char *start = p;
+        p = stop + 1;
+        task->lines++;
+
+        while (start < stop && is_text_space(*start)) {
+            start++;
+        }
+        while (stop > start && is_text_space(stop[-1])) {
+            stop--;
+        }
+        if (start == stop) {
+            continue;
+        }
+
+        struct sockaddr_storage ss = {0};
+        if (!parse_text_address(start, (size_t)(stop - start), &ss)) {
+            task->status = TEXT_PARSE_ERROR;
+            task->error_text = start;
+            task->error_len = (size_t)(stop - start);
+            return;
+        }
+        MMDB_lookup_result_s result = MMDB_lookup_sockaddr(
+            task->mmdb, (struct sockaddr *)&ss, &task->status);
+        if (MMDB_SUCCESS != task->status ||
+            !text_task_append(task,
+                              result.found_entry
+                                  ? (int64_t)result.entry.offset
+                                  : -1)) {
+            return;
+        }
+    }
+}
+
+// Sets the error for the first task that failed, if any, and returns -1.
+static int text_tasks_error(const mmdb_handle_s *handle,
+                            const text_task_s *tasks,
+                            int count) {
+    Py_ssize_t line = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        line += tasks[i].lines;
+        if (TEXT_PARSE_ERROR == tasks[i].status) {
+            // The address is only copied for the error message.
+            char ipstr[INET6_ADDRSTRLEN];
+            size_t copied = tasks[i].error_len < sizeof(ipstr)
+                                ? tasks[i].error_len
+                                : sizeof(ipstr) - 1;
+            memcpy(ipstr, tasks[i].error_text, copied);
+            ipstr[copied] = '\0';
+            PyErr_Format(PyExc_ValueError,
+                         "'%s' on line %zd does not appear to be an IPv4 or "
+                         "IPv6 address.",
+                         ipstr,
+                         line);
+            return -1;
+        }
+        if (MMDB_SUCCESS != tasks[i].status) {
+            PyErr_Format(
+                MMDB_IPV6_LOOKUP_IN_IPV4_DATABASE_ERROR == tasks[i].status
+                    ? PyExc_ValueError
+                    : handle->error,
+                "Error looking up the address on line %zd. %s",
+                line,
+                MMDB_strerror(tasks[i].status));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Returns the list of records for the offsets found by the tasks.
+static PyObject *text_tasks_records(mmdb_handle_s *handle,
+                                    const text_task_s *tasks,
+                                    int count) {
+    Py_ssize_t total = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        total += tasks[i].count;
+    }
+    PyObject *records = PyList_New(total);
+    Py_ssize_t index = 0;
+    for (i = 0; NULL != records && i < count; i++) {
+        Py_ssize_t j;
+        for (j = 0; j < tasks[i].count; j++, index++) {
+            PyObject *record = Py_None;
+            if (tasks[i].offsets[j] < 0) {
+                Py_INCREF(record);
+            } else {
+                MMDB_entry_s entry = {.mmdb = &handle->mmdb,
+                                      .offset = (uint32_t)tasks[i].offsets[j]};
+                int status = MMDB_SUCCESS;
+                record = entry_record(handle, &entry, &status);
+                if (MMDB_SUCCESS != status) {
+                    PyErr_Format(handle->error,
+                                 "Error while looking up data for address "
+                                 "%zd. %s",
+                                 index,
+                                 MMDB_strerror(status));
+                }
+            }
+            if (NULL == record) {
+                Py_CLEAR(records);
+                break;
+            }
+            PyList_SET_ITEM(records, index, record);
+        }
+    }
+    return records;
+}
+
+static PyObject *
+Reader_get_many_text(PyObject *self, PyObject *args, PyObject *kwds) {
+    Py_buffer text;
+    char delimiter = '\n';
+    static char *kwlist[] = {"buf", "delimiter", NULL};
+    if (!PyArg_ParseTupleAndKeywords(
+            args, kwds, "y*|c", kwlist, &text, &delimiter)) {
+        return NULL;
+    }
+
+    mmdb_handle_s *handle = reader_open_handle((Reader_obj *)self);
+    if (NULL == handle) {
+        PyBuffer_Release(&text);
+        return NULL;
+    }
+
+    int task_count = parallel_tasks(
+        (Reader_obj *)self, text.len, PARALLEL_MIN_TEXT_BYTES);
+    text_task_s *tasks = PyMem_Calloc(task_count, sizeof(text_task_s));
+    if (NULL == tasks) {
+        handle_decref(handle);
+        PyBuffer_Release(&text);
+        return PyErr_NoMemory();
+    }
+
+    // Each task starts after the first delimiter in its share of the text.
+    const char *end = (const char *)text.buf + text.len;
+    const char *start = text.buf;
+    int i;
+    for (i = 0; i < task_count; i++) {
+        const char *stop = end;
+        if (i + 1 < task_count) {
+            stop = (const char *)text.buf + text.len * (i + 1) / task_count;
+            stop = stop < start ? start : stop;
+            stop = memchr(stop, delimiter, (size_t)(end - stop));
+            stop = NULL == stop ? end : stop + 1;
+        }
+        tasks[i].mmdb = &handle->mmdb;
+        tasks[i].start = start;
+        tasks[i].end = stop;
+        tasks[i].delimiter = delimiter;
+        start = stop;
+    }
+
+    PyObject *records = NULL;
+    if (run_parallel(module_state(((Reader_obj *)self)->module)->pool,
+                     lookup_text,
+                     tasks,
+                     sizeof(text_task_s),
+                     task_count) != -1 &&
+        text_tasks_error(handle, tasks, task_count) != -1) {
+        records = text_tasks_records(handle, tasks, task_count);
+    }
+
+    for (i = 0; i < task_count; i++) {
+        PyMem_RawFree(tasks[i].offsets);
+    }
+    PyMem_Free(tasks);
+    handle_decref(handle);
+    PyBuffer_Release(&text);
+    return records;
+}
+
+static int get_record(PyObject *self, PyObject *args, PyObject **record) {
+    mmdb_handle_s *handle = reader_open_handle((Reader_obj *)self);
+    if (NULL == handle) {
+        return -1;
+    }
+
+    struct sockaddr_storage ip_address_ss = {0};
+    MMDB_lookup_result_s result;
+    int prefix_len = lookup_entry(handle, args, &ip_address_ss, &result);
+    if (prefix_len != -1 && !result.found_entry) {
+        Py_INCREF(Py_None);
+        *record = Py_None;
+    } else if (prefix_len != -1) {
+        int status = MMDB_SUCCESS;
+        *record = entry_record(handle, &result.entry, &status);
+        if (MMDB_SUCCESS != status) {
+            char ipstr[INET6_ADDRSTRLEN] = {0};
+            if (format_sockaddr((struct sockaddr *)&ip_address_ss, ipstr)) {
+                PyErr_Format(reader_error((Reader_obj *)self),
+                             "Error while looking up data for %s. %s",
+                             ipstr,
+                             MMDB_strerror(status));
+            }
+        }
+        // entry_record will return NULL on errors.
+        if (*record == NULL) {
+            prefix_len = -1;
+        }
+    }
+
+    handle_decref(handle);
+    return prefix_len;
+}
+
+// Returns the record for the entry, using the materialized or cached records
+// if there are any. If libmaxminddb fails to read the data, NULL is returned
+// with status set and no exception.
+static PyObject *
+entry_record(mmdb_handle_s *handle, MMDB_entry_s *entry, int *status) {
+    if (NULL != handle->materialized) {
+        PyObject *record =
+            record_table_get(handle->materialized, entry->offset);
+        if (NULL != record) {
+            Py_INCREF(record);
+            return record;
+        }
+    }
+
+    if (NULL != handle->cache) {
+        PyObject *record = record_cache_get(handle->cache, entry->offset);
+        if (NULL != record) {
+            return record;
+        }
+    }
+
+    MMDB_entry_data_list_s *entry_data_list = NULL;
+    *status = MMDB_get_entry_data_list(entry, &entry_data_list);
+    if (MMDB_SUCCESS != *status) {
+        MMDB_free_entry_data_list(entry_data_list);
+        return NULL;
+    }
+
+    MMDB_entry_data_list_s *original_entry_data_list = entry_data_list;
+    PyObject *record = from_entry_data_list(
+        &entry_data_list, handle->immutable, handle->schema, handle->error);
+    MMDB_free_entry_data_list(original_entry_data_list);
+    if (NULL != record && NULL != handle->cache) {
+        record = record_cache_put(handle->cache, entry->offset, record);
+    }
+    return record;
+}
+
+// Looks up the address in args and returns the prefix length, or -1 with an
+// exception set. The parsed address is left in ip_address_ss for use in error
+// messages.
+static int lookup_entry(mmdb_handle_s *handle,
+                        PyObject *args,
+                        struct sockaddr_storage *ip_address_ss,
+                        MMDB_lookup_result_s *result) {
+    PyObject *ip;
+    if (!PyArg_ParseTuple(args, "O", &ip)) {
+        return -1;
+    }
+    return lookup_address(handle, ip, ip_address_ss, result);
+}
+
+// As lookup_entry, but for a single address object rather than an argument
+// tuple.
+static int lookup_address(mmdb_handle_s *handle,
+                          PyObject *ip,
+                          struct sockaddr_storage *ip_address_ss,
+                          MMDB_lookup_result_s *result) {
+    MMDB_s *mmdb = &handle->mmdb;
+    struct sockaddr *ip_address = (struct sockaddr *)ip_address_ss;
+    if (!ip_converter(ip, ip_address_ss)) {
+        return -1;
+    }
+
+    if (!ip_address->sa_family) {
+        PyErr_SetString(PyExc_ValueError, "Error parsing argument");
+        return -1;
+    }
+
+    int mmdb_error = MMDB_SUCCESS;
+    *result = MMDB_lookup_sockaddr(mmdb, ip_address, &mmdb_error);
+
+    if (MMDB_SUCCESS != mmdb_error) {
+        PyObject *exception;
+        if (MMDB_IPV6_LOOKUP_IN_IPV4_DATABASE_ERROR == mmdb_error) {
+            exception = PyExc_ValueError;
+        } else {
+            exception = handle->error;
+        }
+        char ipstr[INET6_ADDRSTRLEN] = {0};
+        if (format_sockaddr(ip_address, ipstr)) {
+            PyErr_Format(exception,
+                         "Error looking up %s. %s",
+                         ipstr,
+                         MMDB_strerror(mmdb_error));
+        }
+        return -1;
+    }
+
+    return prefix_length(mmdb, ip_address->sa_family, result->netmask);
+}
+
+static int prefix_length(const MMDB_s *mmdb, int family, uint16_t netmask) {
+    int prefix_len = netmask;
+    if (family == AF_INET && mmdb->metadata.ip_version == 6) {
+        // We return the prefix length given the IPv4 address. If there is
+        // no IPv4 subtree, we return a prefix length of 0.
+        prefix_len = prefix_len >= 96 ? prefix_len - 96 : 0;
+    }
+    return prefix_len;
+}
+
+static int ip_converter(PyObject *obj, struct sockaddr_storage *ip_address) {
+    if (PyUnicode_Check(obj)) {
+        Py_ssize_t len;
+        const char *ipstr = PyUnicode_AsUTF8AndSize(obj, &len);
+
+        if (!ipstr) {
+            PyErr_SetString(PyExc_TypeError,
+                            "argument 1 contains an invalid string");
+            return 0;
+        }
+        if (strlen(ipstr) != (size_t)len) {
+            PyErr_SetString(PyExc_TypeError,
+                            "argument 1 contains an embedded null character");
+            return 0;
+        }
+
+        struct addrinfo hints = {
+            .ai_family = AF_UNSPEC,
+            .ai_flags = AI_NUMERICHOST,
+            // We set ai_socktype so that we only get one result back
+            .ai_socktype = SOCK_STREAM};
+
+        struct addrinfo *addresses = NULL;
+        int gai_status = getaddrinfo(ipstr, NULL, &hints, &addresses);
+        if (gai_status) {
+            PyErr_Format(PyExc_ValueError,
+                         "'%s' does not appear to be an IPv4 or IPv6 address.",
+                         ipstr);
+            return 0;
+        }
+        if (!addresses) {
+            PyErr_SetString(
+                PyExc_RuntimeError,
+                "getaddrinfo was successful but failed to set the addrinfo");
+            return 0;
+        }
+        memcpy(ip_address, addresses->ai_addr, addresses->ai_addrlen);
+        freeaddrinfo(addresses);
+        return 1;
+    }
+    PyObject *packed = PyObject_GetAttrString(obj, "packed");
+    if (!packed) {
+        PyErr_SetString(PyExc_TypeError,
+                        "argument 1 must be a string or ipaddress object");
+        return 0;
+    }
+    Py_ssize_t len;
+    char *bytes;
+    int status = PyBytes_AsStringAndSize(packed, &bytes, &len);
+    if (status == -1) {
+        PyErr_SetString(PyExc_TypeError,
+                        "argument 1 must be a string or ipaddress object");
+        Py_DECREF(packed);
+        return 0;
+    }
+
+    switch (len) {
+        case 16: {
+            ip_address->ss_family = AF_INET6;
+            struct sockaddr_in6 *sin = (struct sockaddr_in6 *)ip_address;
+            memcpy(sin->sin6_addr.s6_addr, bytes, (size_t)len);
+            Py_DECREF(packed);
+            return 1;
+        }
+        case 4: {
+            ip_address->ss_family = AF_INET;
+            struct sockaddr_in *sin = (struct sockaddr_in *)ip_address;
+            memcpy(&(sin->sin_addr.s_addr), bytes, (size_t)len);
+            Py_DECREF(packed);
+            return 1;
+        }
+        default:
+            PyErr_SetString(
+                PyExc_ValueError,
+                "argument 1 returned an unexpected packed length for address");
+            Py_DECREF(packed);
+            return 0;
+    }
+}
+
+static bool format_sockaddr(struct sockaddr *sa, char *dst) {
+    char *addr;
+    if (sa->sa_family == AF_INET) {
+        struct sockaddr_in *sin = (struct sockaddr_in *)sa;
+        addr = (char *)&sin->sin_addr;
+    } else {
+        struct sockaddr_in6 *sin = (struct sockaddr_in6 *)sa;
+        addr = (char *)&sin->sin6_addr;
+    }
+
+    if (inet_ntop(sa->sa_family, addr, dst, INET6_ADDRSTRLEN)) {
+        return true;
+    }
+    PyErr_SetString(PyExc_RuntimeError, "unable to format IP address");
+    return false;
+}
+
+static PyObject *Reader_metadata(PyObject *self, PyObject *UNUSED(args)) {
+    mmdb_handle_s *handle = reader_handle((Reader_obj *)self);
+    if (NULL == handle) {
+        PyErr_SetString(PyExc_IOError,
+                        "Attempt to read from a closed MaxMind DB.");
+        return NULL;
+    }
+
+    MMDB_entry_data_list_s *entry_data_list;
+    MMDB_get_metadata_as_entry_data_list(&handle->mmdb, &entry_data_list);
+    handle_decref(handle);
+    MMDB_entry_data_list_s *original_entry_data_list = entry_data_list;
+
+    PyObject *error = reader_error((Reader_obj *)self);
+    PyObject *metadata_dict =
+        from_entry_data_list(&entry_data_list, false, NULL, error);
+    MMDB_free_entry_data_list(original_entry_data_list);
+    if (NULL == metadata_dict || !PyDict_Check(metadata_dict)) {
+        PyErr_SetString(error, "Error decoding metadata.");
+        return NULL;
+    }
+
+    PyObject *args = PyTuple_New(0);
+    if (NULL == args) {
+        Py_DECREF(metadata_dict);
+        return NULL;
+    }
+
+    PyObject *metadata = PyObject_Call(
+        (PyObject *)module_state(((Reader_obj *)self)->module)->metadata_type,
+        args,
+        metadata_dict);
+
+    Py_DECREF(metadata_dict);
+    return metadata;
+}
+
+static PyObject *Reader_materialize_stats(PyObject *self,
+                                          PyObject *UNUSED(args)) {
+    mmdb_handle_s *handle = reader_handle((Reader_obj *)self);
+    if (NULL == handle) {
+        Py_RETURN_NONE;
+    }
+    PyObject *stats = materialize_stats(handle->materialized);
+    handle_decref(handle);
+    return stats;
+}
+
+static PyObject *materialize_stats(record_table_s *materialized) {
+    if (NULL == materialized) {
+        Py_RETURN_NONE;
+    }
+
+    // Walking every record is comparatively slow, so the memory use is only
+    // calculated when it is first requested. Concurrent callers may both
+    // calculate it, but they arrive at the same value.
+    Py_ssize_t memory =
+        __atomic_load_n(&materialized->memory, __ATOMIC_RELAXED);
+    if (memory == -1) {
+        PyObject *getsizeof = PySys_GetObject("getsizeof");
+        if (NULL == getsizeof) {
+            PyErr_SetString(PyExc_RuntimeError, "sys.getsizeof not found");
+            return NULL;
+        }
+
+        memory = 0;
+        size_t slot;
+        for (slot = 0; slot < ((size_t)1 << materialized->bits); slot++) {
+            PyObject *record = materialized->records[slot];
+            if (NULL == record) {
+                continue;
+            }
+            Py_ssize_t size = deep_sizeof(getsizeof, record);
+            if (size == -1) {
+                return NULL;
+            }
+            memory += size;
+        }
+        __atomic_store_n(&materialized->memory, memory, __ATOMIC_RELAXED);
+    }
+
+    return Py_BuildValue("{s:n,s:d,s:n}",
+                         "records",
+                         (Py_ssize_t)materialized->count,
+                         "seconds",
+                         materialized->seconds,
+                         "memory",
+                         memory);
+}
+
+static PyObject *Reader_cache_stats(PyObject *self, PyObject *UNUSED(args)) {
+    mmdb_handle_s *handle = reader_handle((Reader_obj *)self);
+    if (NULL == handle) {
+        Py_RETURN_NONE;
+    }
+    PyObject *stats = NULL;
+    record_cache_s *cache = handle->cache;
+    if (NULL == cache) {
+        Py_INCREF(Py_None);
+        stats = Py_None;
+    } else {
+        uint64_t hits = 0, misses = 0, evictions = 0, contended = 0;
+        uint32_t i;
+        for (i = 0; i < cache->shard_count; i++) {
+            record_cache_shard_s *shard = &cache->shards[i];
+            record_cache_lock(shard);
+            hits += shard->hits;
+            misses += shard->misses;
+            evictions += shard->evictions;
+            contended += shard->contended;
+            record_cache_unlock(shard);
+        }
+        stats = Py_BuildValue(
+            "{s:n,s:K,s:K,s:K,s:K}",
+            "capacity",
+            (Py_ssize_t)(RECORD_CACHE_WAYS << cache->set_bits),
+            "hits",
+            (unsigned long long)hits,
+            "misses",
+            (unsigned long long)misses,
+            "evictions",
+            (unsigned long long)evictions,
+            "contended",
+            (unsigned long long)contended);
+    }
+    handle_decref(handle);
+    return stats;
+}
+
+// Readers export their data section as a read-only buffer so that get_raw
+// can return views of it.
+// Takes a reference to handle unless its last one has already been dropped.
+static bool handle_tryincref(mmdb_handle_s *handle) {
+    Py_ssize_t count = __atomic_load_n(&handle->refcount, __ATOMIC_RELAXED);
+    do {
+        if (0 == count) {
+            return false;
+        }
+    } while (!__atomic_compare_exchange_n(&handle->refcount,
+                                          &count,
+                                          count + 1,
+                                          true,
+                                          __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    return true;
+}
+
+static int DataSection_getbuffer(PyObject *self, Py_buffer *view, int flags) {
+    DataSection_obj *obj = (DataSection_obj *)self;
+    int status = -1;
+    Py_BEGIN_CRITICAL_SECTION(obj);
+    mmdb_handle_s *handle = obj->handle;
+    if (NULL == handle || !handle_tryincref(handle)) {
+        PyErr_SetString(PyExc_ValueError,
+                        "Attempt to read from a closed MaxMind DB.");
+        view->obj = NULL;
+    } else if (PyBuffer_FillInfo(view,
+                                 self,
+                                 (void *)handle->mmdb.data_section,
+                                 (Py_ssize_t)handle->mmdb.data_section_size,
+                                 1,
+                                 flags) == -1) {
+        handle_decref(handle);
+    } else {
+        // The view keeps the database mapped after the reader that it came
+        // from is reloaded or closed.
+        view->internal = handle;
+        status = 0;
+    }
+    Py_END_CRITICAL_SECTION();
+    return status;
+}
+
+static void DataSection_releasebuffer(PyObject *UNUSED(self), Py_buffer *view) {
+    handle_decref(view->internal);
+}
+
+static void DataSection_dealloc(PyObject *self) {
+    PyTypeObject *type = Py_TYPE(self);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static PyObject *Reader_close(PyObject *self, PyObject *UNUSED(args)) {
+    Reader_obj *mmdb_obj = (Reader_obj *)self;
+    mmdb_handle_s *handle = NULL;
+    PyObject *watcher = NULL;
+
+    Py_BEGIN_CRITICAL_SECTION(mmdb_obj);
+    handle = mmdb_obj->handle;
+    watcher = mmdb_obj->watcher;
+    mmdb_obj->handle = NULL;
+    mmdb_obj->watcher = NULL;
+    mmdb_obj->closed = Py_True;
+    Py_END_CRITICAL_SECTION();
+
+    // Lookups that are still running and views from get_raw hold their own
+    // reference, so the database is only unmapped once the last of them is
+    // done.
+    handle_decref(handle);
+
+    if (watcher_stop(watcher) == -1) {
+        return NULL;
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *Reader__enter__(PyObject *self, PyObject *UNUSED(args)) {
+    Reader_obj *mmdb_obj = (Reader_obj *)self;
+
+    if (mmdb_obj->closed == Py_True) {
+        PyErr_SetString(PyExc_ValueError,
+                        "Attempt to reopen a closed MaxMind DB.");
+        return NULL;
+    }
+
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *Reader__exit__(PyObject *self, PyObject *UNUSED(args)) {
+    PyObject *ret = Reader_close(self, NULL);
+    if (NULL == ret) {
+        return NULL;
+    }
+    Py_DECREF(ret);
+    Py_RETURN_NONE;
+}
+
+static void Reader_dealloc(PyObject *self) {
+    PyTypeObject *type = Py_TYPE(self);
+    if (NULL != ((Reader_obj *)self)->weakreflist) {
+        // This also stops the watcher, which only holds a weak reference.
+        PyObject_ClearWeakRefs(self);
+    }
+    Py_XDECREF(((Reader_obj *)self)->watcher);
+    handle_decref(((Reader_obj *)self)->handle);
+    Py_XDECREF(((Reader_obj *)self)->filepath);
+    Py_XDECREF(((Reader_obj *)self)->module);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static int Metadata_init(PyObject *self, PyObject *args, PyObject *kwds) {
+
+    PyObject *binary_format_major_version, *binary_format_minor_version,
+        *build_epoch, *database_type, *description, *ip_version, *languages,
+        *node_count, *record_size;
+
+    static char *kwlist[] = {"binary_format_major_version",
+                             "binary_format_minor_version",
+                             "build_epoch",
+                             "database_type",
+                             "description",
+                             "ip_version",
+                             "languages",
+                             "node_count",
+                             "record_size",
+                             NULL};
+
+    if (!PyArg_ParseTupleAndKeywords(args,
+                                     kwds,
+                                     "|OOOOOOOOO",
+                                     kwlist,
+                                     &binary_format_major_version,
+                                     &binary_format_minor_version,
+                                     &build_epoch,
+                                     &database_type,
+                                     &description,
+                                     &ip_version,
+                                     &languages,
+                                     &node_count,
+                                     &record_size)) {
+        return -1;
+    }
+
+    Metadata_obj *obj = (Metadata_obj *)self;
+
+    obj->binary_format_major_version = binary_format_major_version;
+    obj->binary_format_minor_version = binary_format_minor_version;
+    obj->build_epoch = build_epoch;
+    obj->database_type = database_type;
+    obj->description = description;
+    obj->ip_version = ip_version;
+    obj->languages = languages;
+    obj->node_count = node_count;
+    obj->record_size = record_size;
+
+    Py_INCREF(obj->binary_format_major_version);
+    Py_INCREF(obj->binary_format_minor_version);
+    Py_INCREF(obj->build_epoch);
+    Py_INCREF(obj->database_type);
+    Py_INCREF(obj->description);
+    Py_INCREF(obj->ip_version);
+    Py_INCREF(obj->languages);
+    Py_INCREF(obj->node_count);
+    Py_INCREF(obj->record_size);
+
+    return 0;
+}
+
+static void Metadata_dealloc(PyObject *self) {
+    Metadata_obj *obj = (Metadata_obj *)self;
+    Py_DECREF(obj->binary_format_major_version);
+    Py_DECREF(obj->binary_format_minor_version);
+    Py_DECREF(obj->build_epoch);
+    Py_DECREF(obj->database_type);
+    Py_DECREF(obj->description);
+    Py_DECREF(obj->ip_version);
+    Py_DECREF(obj->languages);
+    Py_DECREF(obj->node_count);
+    Py_DECREF(obj->record_size);
+    PyTypeObject *type = Py_TYPE(self);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+// Lazy records keep the database they came from open, but reading from them
+// after the reader is closed is still an error.
+static int lazy_record_check_open(LazyRecord_obj *obj) {
+    bool closed;
+    Py_BEGIN_CRITICAL_SECTION(obj->reader);
+    closed = NULL == obj->reader->handle;
+    Py_END_CRITICAL_SECTION();
+    if (closed) {
+        PyErr_SetString(PyExc_ValueError,
+                        "Attempt to read from a closed MaxMind DB.");
+        return -1;
+    }
+    return 0;
+}
+
+// Returns a new reference to the cache of decoded values, creating it first
+// if create is set. Returns NULL without an exception when there is no cache.
+static PyObject *lazy_record_values(LazyRecord_obj *obj, bool create) {
+    PyObject *values;
+    Py_BEGIN_CRITICAL_SECTION(obj);
+    if (NULL == obj->values && create) {
+        obj->values = PyDict_New();
+    }
+    values = obj->values;
+    Py_XINCREF(values);
+    Py_END_CRITICAL_SECTION();
+    if (NULL == values && create) {
+        PyErr_NoMemory();
+    }
+    return values;
+}
+
+static void set_key_error(PyObject *key) {
+    // A bare tuple key would be unpacked into the exception arguments.
+    PyObject *args = PyTuple_Pack(1, key);
+    if (NULL != args) {
+        PyErr_SetObject(PyExc_KeyError, args);
+        Py_DECREF(args);
+    }
+}
+
+// Returns 1 and fills in entry_data if the map contains the key, 0 if it does
+// not, and -1 with an exception set on errors.
+static int lazy_record_find(LazyRecord_obj *obj,
+                            PyObject *key,
+                            MMDB_entry_data_s *entry_data) {
+    if (lazy_record_check_open(obj) == -1) {
+        return -1;
+    }
+
+    if (!PyUnicode_Check(key)) {
+        return 0;
+    }
+
+    Py_ssize_t len;
+    const char *keystr = PyUnicode_AsUTF8AndSize(key, &len);
+    if (NULL == keystr) {
+        return -1;
+    }
+    if (strlen(keystr) != (size_t)len) {
+        // libmaxminddb cannot match keys with embedded null characters.
+        return 0;
+    }
+
+    const char *const path[] = {keystr, NULL};
+    int status = MMDB_aget_value(&obj->entry, entry_data, path);
+    if (MMDB_LOOKUP_PATH_DOES_NOT_MATCH_DATA_ERROR == status ||
+        (MMDB_SUCCESS == status && !entry_data->has_data)) {
+        return 0;
+    }
+    if (MMDB_SUCCESS != status) {
+        PyErr_Format(reader_error(obj->reader),
+                     "Error while decoding data. %s",
+                     MMDB_strerror(status));
+        return -1;
+    }
+    return 1;
+}
+
+// Returns the last entry of the value that starts at entry_data_list, i.e.,
+// the entry just before the next sibling value.
+static MMDB_entry_data_list_s *
+last_entry_of_value(MMDB_entry_data_list_s *entry_data_list) {
+    uint64_t remaining = 1;
+    while (NULL != entry_data_list) {
+        remaining--;
+        if (MMDB_DATA_TYPE_MAP == entry_data_list->entry_data.type) {
+            remaining += 2 * (uint64_t)entry_data_list->entry_data.data_size;
+        } else if (MMDB_DATA_TYPE_ARRAY == entry_data_list->entry_data.type) {
+            remaining += entry_data_list->entry_data.data_size;
+        }
+        if (0 == remaining) {
+            return entry_data_list;
+        }
+        entry_data_list = entry_data_list->next;
+    }
+    return NULL;
+}
+
+// Returns a borrowed reference to the tuple of keys in the map, decoding the
+// keys on first use.
+static PyObject *lazy_record_keys(LazyRecord_obj *obj) {
+    PyObject *cached;
+    Py_BEGIN_CRITICAL_SECTION(obj);
+    cached = obj->keys;
+    Py_END_CRITICAL_SECTION();
+    if (NULL != cached) {
+        return cached;
+    }
+
+    if (lazy_record_check_open(obj) == -1) {
+        return NULL;
+    }
+
+    MMDB_entry_data_list_s *entry_data_list = NULL;
+    int status = MMDB_get_entry_data_list(&obj->entry, &entry_data_list);
+    if (MMDB_SUCCESS != status) {
+        PyErr_Format(reader_error(obj->reader),
+                     "Error while decoding data. %s",
+                     MMDB_strerror(status));
+        MMDB_free_entry_data_list(entry_data_list);
+        return NULL;
+    }
+
+    PyObject *keys = PyTuple_New(obj->size);
+    if (NULL == keys) {
+        MMDB_free_entry_data_list(entry_data_list);
+        return NULL;
+    }
+
+    MMDB_entry_data_list_s *current = entry_data_list;
+    uint32_t i;
+    for (i = 0; i < obj->size; i++) {
+        current = NULL == current ? NULL : current->next;
+        if (NULL == current ||
+            MMDB_DATA_TYPE_UTF8_STRING != current->entry_data.type) {
+            PyErr_SetString(reader_error(obj->reader),
+                            "Error while decoding data. Your database may be "
+                            "corrupt or you have found a bug in "
+                            "libmaxminddb.");
+            Py_DECREF(keys);
+            MMDB_free_entry_data_list(entry_data_list);
+            return NULL;
+        }
+
+        PyObject *key = PyUnicode_FromStringAndSize(
+            current->entry_data.utf8_string, current->entry_data.data_size);
+        if (NULL == key) {
+            Py_DECREF(keys);
+            MMDB_free_entry_data_list(entry_data_list);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(keys, i, key);
+
+        current = last_entry_of_value(current->next);
+    }
+    MMDB_free_entry_data_list(entry_data_list);
+
+    // Another thread may have decoded the keys in the meantime. Keeping the
+    // first tuple means borrowed references to it stay valid.
+    Py_BEGIN_CRITICAL_SECTION(obj);
+    if (NULL == obj->keys) {
+        obj->keys = keys;
+    } else {
+        Py_DECREF(keys);
+    }
+    cached = obj->keys;
+    Py_END_CRITICAL_SECTION();
+    return cached;
+}
+
+static PyObject *lazy_value(Reader_obj *reader,
+                            mmdb_handle_s *handle,
+                            MMDB_entry_data_s *entry_data) {
+    if (MMDB_DATA_TYPE_MAP == entry_data->type) {
+        PyTypeObject *type = module_state(reader->module)->lazy_record_type;
+        LazyRecord_obj *obj = (LazyRecord_obj *)type->tp_alloc(type, 0);
+        if (NULL == obj) {
+            return NULL;
+        }
+        Py_INCREF(reader);
+        obj->reader = reader;
+        __atomic_add_fetch(&handle->refcount, 1, __ATOMIC_RELAXED);
+        obj->handle = handle;
+        obj->entry.mmdb = &handle->mmdb;
+        obj->entry.offset = entry_data->offset;
+        obj->size = entry_data->data_size;
+        return (PyObject *)obj;
+    }
+
+    if (MMDB_DATA_TYPE_ARRAY != entry_data->type) {
+        // Scalar values are fully described by their entry data, so there is
+        // no need to build an entry data list for them.
+        MMDB_entry_data_list_s scalar = {.entry_data = *entry_data};
+        MMDB_entry_data_list_s *entry_data_list = &scalar;
+        return from_entry_data_list(
+            &entry_data_list, handle->immutable, NULL, handle->error);
+    }
+
+    MMDB_entry_s entry = {.mmdb = &handle->mmdb, .offset = entry_data->offset};
+    MMDB_entry_data_list_s *entry_data_list = NULL;
+    int status = MMDB_get_entry_data_list(&entry, &entry_data_list);
+    if (MMDB_SUCCESS != status) {
+        PyErr_Format(reader_error(reader),
+                     "Error while decoding data. %s",
+                     MMDB_strerror(status));
+        MMDB_free_entry_data_list(entry_data_list);
+        return NULL;
+    }
+
+    MMDB_entry_data_list_s *original_entry_data_list = entry_data_list;
+    PyObject *value = from_entry_data_list(
+        &entry_data_list, handle->immutable, NULL, handle->error);
+    MMDB_free_entry_data_list(original_entry_data_list);
+    return value;
+}
+
+static PyObject *LazyRecord_subscript(PyObject *self, PyObject *key) {
+    LazyRecord_obj *obj = (LazyRecord_obj *)self;
+
+    PyObject *values = lazy_record_values(obj, false);
+    if (NULL != values) {
+        PyObject *value = PyDict_GetItemWithError(values, key);
+        Py_XINCREF(value);
+        Py_DECREF(values);
+        if (NULL != value || PyErr_Occurred()) {
+            return value;
+        }
+    }
+
+    MMDB_entry_data_s entry_data;
+    int found = lazy_record_find(obj, key, &entry_data);
+    if (found != 1) {
+        if (found == 0) {
+            set_key_error(key);
+        }
+        return NULL;
+    }
+
+    PyObject *value = lazy_value(obj->reader, obj->handle, &entry_data);
+    if (NULL == value) {
+        return NULL;
+    }
+
+    values = lazy_record_values(obj, true);
+    if (NULL == values) {
+        Py_DECREF(value);
+        return NULL;
+    }
+    // If another thread decoded the same key first, return its value so that
+    // repeated lookups always give the same object.
+    PyObject *cached = PyDict_SetDefault(values, key, value);
+    Py_XINCREF(cached);
+    Py_DECREF(value);
+    Py_DECREF(values);
+    return cached;
+}
+
+static Py_ssize_t LazyRecord_length(PyObject *self) {
+    return ((LazyRecord_obj *)self)->size;
+}
+
+static int LazyRecord_contains(PyObject *self, PyObject *key) {
+    LazyRecord_obj *obj = (LazyRecord_obj *)self;
+
+    PyObject *values = lazy_record_values(obj, false);
+    if (NULL != values) {
+        int contains = PyDict_Contains(values, key);
+        Py_DECREF(values);
+        if (contains != 0) {
+            return contains;
+        }
+    }
+
+    MMDB_entry_data_s entry_data;
+    return lazy_record_find(obj, key, &entry_data);
+}
+
+static PyObject *LazyRecord_iter(PyObject *self) {
+    PyObject *keys = lazy_record_keys((LazyRecord_obj *)self);
+    if (NULL == keys) {
+        return NULL;
+    }
+    return PyObject_GetIter(keys);
+}
+
+static PyObject *LazyRecord_keys(PyObject *self, PyObject *UNUSED(args)) {
+    PyObject *keys = lazy_record_keys((LazyRecord_obj *)self);
+    if (NULL == keys) {
+        return NULL;
+    }
+    return PySequence_List(keys);
+}
+
+// Builds a list of the values, or of (key, value) tuples when with_keys is
+// set.
+static PyObject *lazy_record_list(PyObject *self, bool with_keys) {
+    PyObject *keys = lazy_record_keys((LazyRecord_obj *)self);
+    if (NULL == keys) {
+        return NULL;
+    }
+
+    Py_ssize_t size = PyTuple_GET_SIZE(keys);
+    PyObject *list = PyList_New(size);
+    if (NULL == list) {
+        return NULL;
+    }
+
+    Py_ssize_t i;
+    for (i = 0; i < size; i++) {
+        PyObject *key = PyTuple_GET_ITEM(keys, i);
+        PyObject *value = LazyRecord_subscript(self, key);
+        if (NULL == value) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        if (with_keys) {
+            PyObject *item = PyTuple_Pack(2, key, value);
+            Py_DECREF(value);
+            if (NULL == item) {
+                Py_DECREF(list);
+                return NULL;
+            }
+            value = item;
+        }
+        // PyList_SET_ITEM 'steals' the reference
+        PyList_SET_ITEM(list, i, value);
+    }
+    return list;
+}
+
+static PyObject *LazyRecord_values(PyObject *self, PyObject *UNUSED(args)) {
+    return lazy_record_list(self, false);
+}
+
+static PyObject *LazyRecord_items(PyObject *self, PyObject *UNUSED(args)) {
+    return lazy_record_list(self, true);
+}
+
+static PyObject *LazyRecord_get(PyObject *self, PyObject *args) {
+    PyObject *key;
+    PyObject *default_value = Py_None;
+    if (!PyArg_ParseTuple(args, "O|O", &key, &default_value)) {
+        return NULL;
+    }
+
+    PyObject *value = LazyRecord_subscript(self, key);
+    if (NULL == value && PyErr_ExceptionMatches(PyExc_KeyError)) {
+        PyErr_Clear();
+        Py_INCREF(default_value);
+        return default_value;
+    }
+    return value;
+}
+
+// Returns a dict with the top level of the map decoded. Nested maps remain
+// LazyRecord objects.
+static PyObject *lazy_record_dict(PyObject *self) {
+    PyObject *items = lazy_record_list(self, true);
+    if (NULL == items) {
+        return NULL;
+    }
+
+    PyObject *dict = PyDict_New();
+    if (NULL != dict && PyDict_MergeFromSeq2(dict, items, 0) == -1) {
+        Py_CLEAR(dict);
+    }
+    Py_DECREF(items);
+    return dict;
+}
+
+static PyObject *
+LazyRecord_richcompare(PyObject *self, PyObject *other, int op) {
+    if (op != Py_EQ && op != Py_NE) {
+        Py_RETURN_NOTIMPLEMENTED;
+    }
+
+    PyObject *dict = lazy_record_dict(self);
+    if (NULL == dict) {
+        return NULL;
+    }
+    PyObject *result = PyObject_RichCompare(dict, other, op);
+    Py_DECREF(dict);
+    return result;
+}
+
+static PyObject *LazyRecord_repr(PyObject *self) {
+    PyObject *dict = lazy_record_dict(self);
+    if (NULL == dict) {
+        return NULL;
+    }
+    PyObject *repr = PyUnicode_FromFormat("LazyRecord(%R)", dict);
+    Py_DECREF(dict);
+    return repr;
+}
+
+static int LazyRecord_traverse(PyObject *self, visitproc visit, void *arg) {
+    Py_VISIT(((LazyRecord_obj *)self)->values);
+#if PY_VERSION_HEX >= 0x03090000
+    // Instances of heap types must visit their type from Python 3.9.
+    Py_VISIT(Py_TYPE(self));
+#endif
+    return 0;
+}
+
+static int LazyRecord_clear(PyObject *self) {
+    Py_CLEAR(((LazyRecord_obj *)self)->values);
+    return 0;
+}
+
+static void LazyRecord_dealloc(PyObject *self) {
+    LazyRecord_obj *obj = (LazyRecord_obj *)self;
+    PyObject_GC_UnTrack(self);
+    Py_XDECREF(obj->values);
+    Py_XDECREF(obj->keys);
+    Py_DECREF(obj->reader);
+    handle_decref(obj->handle);
+    PyTypeObject *type = Py_TYPE(self);
+    type->tp_free(self);
+    Py_DECREF(type);
+}
+
+static size_t record_table_slot(const record_table_s *table, uint32_t offset) {
+    size_t mask = ((size_t)1 << table->bits) - 1;
+    // Fibonacci hashing, as consecutive offsets are common.
+    size_t slot = (uint32_t)(offset * 2654435761U) >> (32 - table->bits);
+    while (RECORD_TABLE_EMPTY != table->offsets[slot] &&
+           offset != table->offsets[slot]) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static int record_table_init(record_table_s *table, uint32_t bits) {
+    size_t size = (size_t)1 << bits;
+    table->offsets = malloc(size * sizeof(uint32_t));
+    table->records = calloc(size, sizeof(PyObject *));
+    if (NULL == table->offsets || NULL == table->records) {
+        free(table->offsets);
+        free(table->records);
+        return -1;
+    }
+    memset(table->offsets, 0xff, size * sizeof(uint32_t));
+    table->bits = bits;
+    table->count = 0;
+    return 0;
+}
+
+static int record_table_add(record_table_s *table, uint32_t offset) {
+    // Keep the table at most half full so that probe sequences stay short.
+    if ((table->count + 1) * 2 > ((size_t)1 << table->bits)) {
+        record_table_s grown;
+        if (record_table_init(&grown, table->bits + 1) == -1) {
+            return -1;
+        }
+        size_t slot;
+        for (slot = 0; slot < ((size_t)1 << table->bits); slot++) {
+            if (RECORD_TABLE_EMPTY == table->offsets[slot]) {
+                continue;
+            }
+            size_t new_slot = record_table_slot(&grown, table->offsets[slot]);
+            grown.offsets[new_slot] = table->offsets[slot];
+            grown.records[new_slot] = table->records[slot];
+        }
+        free(table->offsets);
+        free(table->records);
+        table->offsets = grown.offsets;
+        table->records = grown.records;
+        table->bits = grown.bits;
+    }
+
+    size_t slot = record_table_slot(table, offset);
+    if (RECORD_TABLE_EMPTY == table->offsets[slot]) {
+        table->offsets[slot] = offset;
+        table->count++;
+    }
+    return 0;
+}
+
+// Returns a borrowed reference to the record at offset or NULL if there is
+// none.
+static PyObject *record_table_get(const record_table_s *table,
+                                  uint32_t offset) {
+    return table->records[record_table_slot(table, offset)];
+}
+
+static void record_table_free(record_table_s *table) {
+    size_t slot;
+    for (slot = 0; slot < ((size_t)1 << table->bits); slot++) {
+        Py_XDECREF(table->records[slot]);
+    }
+    free(table->offsets);
+    free(table->records);
+    free(table);
+}
+
+static record_cache_s *record_cache_new(Py_ssize_t capacity) {
+    uint32_t set_bits = 1;
+    while (set_bits < RECORD_CACHE_MAX_SET_BITS &&
+           ((size_t)RECORD_CACHE_WAYS << set_bits) < (size_t)capacity) {
+        set_bits++;
+    }
+    size_t sets = (size_t)1 << set_bits;
+    uint32_t shard_count =
+        sets < RECORD_CACHE_MAX_SHARDS ? sets : RECORD_CACHE_MAX_SHARDS;
+
+    record_cache_s *cache = calloc(1, sizeof(record_cache_s));
+    if (NULL != cache) {
+        cache->entries =
+            calloc(sets * RECORD_CACHE_WAYS, sizeof(record_cache_entry_s));
+        cache->shards = calloc(shard_count, sizeof(record_cache_shard_s));
+    }
+    if (NULL == cache || NULL == cache->entries || NULL == cache->shards) {
+        if (NULL != cache) {
+            free(cache->entries);
+            free(cache->shards);
+            free(cache);
+        }
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    size_t i;
+    for (i = 0; i < sets * RECORD_CACHE_WAYS; i++) {
+        cache->entries[i].offset = RECORD_TABLE_EMPTY;
+    }
+    cache->set_bits = set_bits;
+    cache->shard_count = shard_count;
+    return cache;
+}
+
+static void record_cache_lock(record_cache_shard_s *shard) {
+    if (!__atomic_test_and_set(&shard->lock, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    do {
+        while (__atomic_load_n(&shard->lock, __ATOMIC_RELAXED)) {
+            sched_yield();
+        }
+    } while (__atomic_test_and_set(&shard->lock, __ATOMIC_ACQUIRE));
+    shard->contended++;
+}
+
+static void record_cache_unlock(record_cache_shard_s *shard) {
+    __atomic_clear(&shard->lock, __ATOMIC_RELEASE);
+}
+
+// Returns the first entry of the set for the offset and its shard.
+static record_cache_entry_s *record_cache_set(record_cache_s *cache,
+                                              uint32_t offset,
+                                              record_cache_shard_s **shard) {
+    size_t set = (uint32_t)(offset * 2654435761U) >> (32 - cache->set_bits);
+    *shard = &cache->shards[set & (cache->shard_count - 1)];
+    return &cache->entries[set * RECORD_CACHE_WAYS];
+}
+
+// Returns a new reference to the cached record at offset or NULL if there is
+// none.
+static PyObject *record_cache_get(record_cache_s *cache, uint32_t offset) {
+    record_cache_shard_s *shard;
+    record_cache_entry_s *entries = record_cache_set(cache, offset, &shard);
+    PyObject *record = NULL;
+
+    record_cache_lock(shard);
+    int way;
+    for (way = 0; way < RECORD_CACHE_WAYS; way++) {
+        if (entries[way].offset == offset) {
+            entries[way].referenced = true;
+            record = entries[way].record;
+            Py_INCREF(record);
+            break;
+        }
+    }
+    if (NULL == record) {
+        shard->misses++;
+    } else {
+        shard->hits++;
+    }
+    record_cache_unlock(shard);
+    return record;
+}
+
+// Adds the record, stealing the reference, and returns a new reference to
+// the cached record. This is the record another thread added if it decoded
+// the same one first.
+static PyObject *
+record_cache_put(record_cache_s *cache, uint32_t offset, PyObject *record) {
+    record_cache_shard_s *shard;
+    record_cache_entry_s *entries = record_cache_set(cache, offset, &shard);
+    PyObject *evicted = NULL;
+
+    record_cache_lock(shard);
+    int way, victim = -1;
+    for (way = 0; way < RECORD_CACHE_WAYS; way++) {
+        if (entries[way].offset == offset) {
+            evicted = record;
+            record = entries[way].record;
+            Py_INCREF(record);
+            break;
+        }
+        if (-1 == victim && (RECORD_TABLE_EMPTY == entries[way].offset ||
+                             !entries[way].referenced)) {
+            victim = way;
+        }
+    }
+    if (NULL == evicted) {
+        // Every way was recently used, so give each another chance and
+        // replace the first.
+        if (-1 == victim) {
+            for (way = 0; way < RECORD_CACHE_WAYS; way++) {
+                entries[way].referenced = false;
+            }
+            victim = 0;
+        }
+        if (RECORD_TABLE_EMPTY != entries[victim].offset) {
+            evicted = entries[victim].record;
+            shard->evictions++;
+        }
+        entries[victim].offset = offset;
+        entries[victim].referenced = false;
+        entries[victim].record = record;
+        Py_INCREF(record);
+    }
+    record_cache_unlock(shard);
+
+    // Deallocating the evicted record may run arbitrary code, so it must not
+    // happen while holding the lock.
+    Py_XDECREF(evicted);
+    return record;
+}
+
+static void record_cache_free(record_cache_s *cache) {
+    size_t i;
+    for (i = 0; i < ((size_t)RECORD_CACHE_WAYS << cache->set_bits); i++) {
+        Py_XDECREF(cache->entries[i].record);
+    }
+    free(cache->entries);
+    free(cache->shards);
+    free(cache);
+}
+
+// Adds the records in old's cache to new's cache when they are unchanged in
+// new. A record is unchanged if its encoding, with pointers followed, is
+// byte-for-byte the same, wherever it now is in the data section. The
+// records are found without the GIL, which is only taken to collect them and
+// add them to the new cache. Returns the number of records carried over, or
+// -1 with an exception set.
+static Py_ssize_t record_cache_carry_over(mmdb_handle_s *old,
+                                          mmdb_handle_s *new) {
+    record_cache_s *cache = old->cache;
+    carry_over_s carry = {0};
+    carry.entries = calloc((size_t)RECORD_CACHE_WAYS << cache->set_bits,
+                           sizeof(carry_entry_s));
+    if (NULL == carry.entries) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    carry_over_collect(old, &carry);
+    int status = 0;
+    if (carry.count > 0) {
+        Py_BEGIN_ALLOW_THREADS;
+        status = carry_over_match(&carry, &old->mmdb, &new->mmdb);
+        Py_END_ALLOW_THREADS;
+    }
+
+    Py_ssize_t carried = 0;
+    if (MMDB_SUCCESS != carry.mmdb_status) {
+        PyErr_Format(new->error,
+                     "Error while carrying over cached records. %s",
+                     MMDB_strerror(carry.mmdb_status));
+        carried = -1;
+    } else if (0 != carry.raw_status) {
+        raw_raise(new->error, carry.raw_status);
+        carried = -1;
+    } else if (status == -1) {
+        PyErr_NoMemory();
+        carried = -1;
+    }
+
+    size_t i;
+    for (i = 0; i < carry.count; i++) {
+        carry_entry_s *entry = &carry.entries[i];
+        if (carried != -1 && RECORD_TABLE_EMPTY != entry->new_offset) {
+            Py_INCREF(entry->record);
+            Py_DECREF(
+                record_cache_put(new->cache, entry->new_offset, entry->record));
+            carried++;
+        }
+        Py_DECREF(entry->record);
+        free(entry->raw.data);
+    }
+    free(carry.entries);
+    free(carry.index);
+    if (NULL != carry.seen.offsets) {
+        free(carry.seen.offsets);
+        free(carry.seen.records);
+    }
+    free(carry.raw.data);
+    return carried;
+}
+
+// Copies the records and their offsets out of the cache. The cache may still
+// be in use by lookups, so each entry is read under its shard's lock.
+static void carry_over_collect(const mmdb_handle_s *old, carry_over_s *carry) {
+    record_cache_s *cache = old->cache;
+    size_t i;
+    for (i = 0; i < ((size_t)RECORD_CACHE_WAYS << cache->set_bits); i++) {
+        size_t set = i / RECORD_CACHE_WAYS;
+        record_cache_shard_s *shard =
+            &cache->shards[set & (cache->shard_count - 1)];
+        record_cache_lock(shard);
+        uint32_t offset = cache->entries[i].offset;
+        PyObject *record = cache->entries[i].record;
+        if (RECORD_TABLE_EMPTY != offset) {
+            Py_INCREF(record);
+        }
+        record_cache_unlock(shard);
+        if (RECORD_TABLE_EMPTY == offset) {
+            continue;
+        }
+
+        carry_entry_s *entry = &carry->entries[carry->count++];
+        entry->record = record;
+        entry->offset = offset;
+        entry->new_offset = RECORD_TABLE_EMPTY;
+    }
+}
+
+// Encodes the collected records and then walks the new database's search
+// tree, noting where each is found, until every one has been found or
+// CARRY_OVER_MAX_RECORDS records have been compared. It does not use the
+// Python API. Returns -1 if memory ran out, and otherwise 0, with any error
+// found in the databases in carry's statuses.
+static int
+carry_over_match(carry_over_s *carry, const MMDB_s *old, MMDB_s *new) {
+    size_t i;
+    for (i = 0; i < carry->count; i++) {
+        carry_entry_s *entry = &carry->entries[i];
+        uint32_t next;
+        bool has_pointers = false;
+        carry->raw_status = raw_value(
+            old, entry->offset, &entry->raw, &next, &has_pointers, 0);
+        if (0 != carry->raw_status) {
+            return 0;
+        }
+        entry->hash = raw_hash(&entry->raw);
+    }
+
+    uint32_t bits = 1;
+    while (((size_t)1 << bits) < carry->count * 2) {
+        bits++;
+    }
+    carry->mask = ((size_t)1 << bits) - 1;
+    carry->index = calloc(carry->mask + 1, sizeof(size_t));
+    if (NULL == carry->index || record_table_init(&carry->seen, 10) == -1) {
+        return -1;
+    }
+    for (i = 0; i < carry->count; i++) {
+        size_t slot = carry->entries[i].hash & carry->mask;
+        while (0 != carry->index[slot]) {
+            slot = (slot + 1) & carry->mask;
+        }
+        carry->index[slot] = i + 1;
+    }
+
+    size_t found = 0;
+    uint32_t node_number;
+    for (node_number = 0;
+         node_number < new->metadata.node_count && found < carry->count &&
+         carry->seen.count < CARRY_OVER_MAX_RECORDS;
+         node_number++) {
+        MMDB_search_node_s node;
+        carry->mmdb_status = MMDB_read_node(new, node_number, &node);
+        if (MMDB_SUCCESS != carry->mmdb_status) {
+            return 0;
+        }
+        if (MMDB_RECORD_TYPE_DATA == node.left_record_type) {
+            found +=
+                carry_over_offset(carry, new, node.left_record_entry.offset);
+        }
+        if (MMDB_RECORD_TYPE_DATA == node.right_record_type) {
+            found +=
+                carry_over_offset(carry, new, node.right_record_entry.offset);
+        }
+        if (carry->no_memory) {
+            return -1;
+        }
+        if (0 != carry->raw_status) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Notes the offset in new as the place of the collected record with the same
+// encoding as the record there, if there is one that has not been found yet.
+// Returns whether there was.
+static bool carry_over_offset(carry_over_s *carry,
+                              const MMDB_s *new,
+                              uint32_t offset) {
+    if (carry->seen.offsets[record_table_slot(&carry->seen, offset)] ==
+        offset) {
+        return false;
+    }
+    if (record_table_add(&carry->seen, offset) == -1) {
+        carry->no_memory = true;
+        return false;
+    }
+
+    carry->raw.size = 0;
+    uint32_t next;
+    bool has_pointers = false;
+    carry->raw_status =
+        raw_value(new, offset, &carry->raw, &next, &has_pointers, 0);
+    if (0 != carry->raw_status) {
+        return false;
+    }
+    uint64_t hash = raw_hash(&carry->raw);
+    size_t slot;
+    for (slot = hash & carry->mask; 0 != carry->index[slot];
+         slot = (slot + 1) & carry->mask) {
+        carry_entry_s *entry = &carry->entries[carry->index[slot] - 1];
+        if (RECORD_TABLE_EMPTY != entry->new_offset || entry->hash != hash ||
+            entry->raw.size != carry->raw.size ||
+            memcmp(entry->raw.data, carry->raw.data, carry->raw.size) != 0) {
+            continue;
+        }
+        entry->new_offset = offset;
+        return true;
+    }
+    return false;
+}
+
+// FNV-1a.
+static uint64_t raw_hash(const byte_buffer_s *raw) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < raw->size; i++) {
+        hash = (hash ^ (unsigned char)raw->data[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Adds the distinct data offsets in the search tree to table, stopping once
+// it holds limit of them unless limit is 0. Returns an MMDB status, or -1 if
+// memory ran out. It creates no Python objects, so it may run without the
+// GIL.
+static int collect_record_offsets(const MMDB_s *mmdb,
+                                  record_table_s *table,
+                                  size_t limit) {
+    uint32_t node_number;
+    for (node_number = 0;
+         node_number < mmdb->metadata.node_count &&
+         (0 == limit || table->count < limit);
+         node_number++) {
+        MMDB_search_node_s node;
+        int status = MMDB_read_node(mmdb, node_number, &node);
+        if (MMDB_SUCCESS != status) {
+            return status;
+        }
+        if ((MMDB_RECORD_TYPE_DATA == node.left_record_type &&
+             record_table_add(table, node.left_record_entry.offset) == -1) ||
+            (MMDB_RECORD_TYPE_DATA == node.right_record_type &&
+             record_table_add(table, node.right_record_entry.offset) == -1)) {
+            return -1;
+        }
+    }
+    return MMDB_SUCCESS;
+}
+
+// Decodes every distinct record referenced from the search tree.
+static int materialize_records(mmdb_handle_s *handle) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    MMDB_s *mmdb = &handle->mmdb;
+    record_table_s *table = calloc(1, sizeof(record_table_s));
+    if (NULL == table || record_table_init(table, 10) == -1) {
+        free(table);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    int status;
+    Py_BEGIN_ALLOW_THREADS;
+    status = collect_record_offsets(mmdb, table, 0);
+    Py_END_ALLOW_THREADS;
+    if (-1 == status) {
+        record_table_free(table);
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (MMDB_SUCCESS != status) {
+        PyErr_Format(handle->error,
+                     "Error while materializing records. %s",
+                     MMDB_strerror(status));
+        record_table_free(table);
+        return -1;
+    }
+
+    size_t slot;
+    size_t decoded = 0;
+    for (slot = 0; slot < ((size_t)1 << table->bits); slot++) {
+        if (RECORD_TABLE_EMPTY == table->offsets[slot]) {
+            continue;
+        }
+        // Decoding builds the records, so it holds the GIL, but lets other
+        // threads run now and then.
+        if (0 == (++decoded & 0xfff)) {
+            Py_BEGIN_ALLOW_THREADS;
+            Py_END_ALLOW_THREADS;
+        }
+
+        MMDB_entry_s entry = {.mmdb = mmdb, .offset = table->offsets[slot]};
+        MMDB_entry_data_list_s *entry_data_list = NULL;
+        status = MMDB_get_entry_data_list(&entry, &entry_data_list);
+        if (MMDB_SUCCESS != status) {
+            PyErr_Format(handle->error,
+                         "Error while materializing records. %s",
+                         MMDB_strerror(status));
+            MMDB_free_entry_data_list(entry_data_list);
+            record_table_free(table);
+            return -1;
+        }
+
+        MMDB_entry_data_list_s *original_entry_data_list = entry_data_list;
+        table->records[slot] =
+            from_entry_data_list(
+                &entry_data_list, true, handle->schema, handle->error);
+        MMDB_free_entry_data_list(original_entry_data_list);
+        if (NULL == table->records[slot]) {
+            record_table_free(table);
+            return -1;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    table->seconds = (double)(end.tv_sec - start.tv_sec) +
+                     (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    table->memory = -1;
+
+    handle->materialized = table;
+    return 0;
+}
+
+// Returns the field for key, or NULL if the key was not seen when the schema
+// was built. Keys usually appear in the same order in every record, so the
+// field at the key's position is checked first.
+static const schema_field_s *schema_find(const schema_node_s *node,
+                                         uint32_t position,
+                                         const MMDB_entry_data_s *key) {
+    if (MMDB_DATA_TYPE_UTF8_STRING != key->type) {
+        return NULL;
+    }
+    uint32_t i;
+    for (i = 0; i < node->count; i++) {
+        const schema_field_s *field =
+            &node->fields[(position + i) % node->count];
+        if ((size_t)field->size == key->data_size &&
+            0 == memcmp(field->name, key->utf8_string, key->data_size)) {
+            return field;
+        }
+    }
+    return NULL;
+}
+
+static schema_field_s *schema_add(schema_node_s *node,
+                                  const MMDB_entry_data_s *key) {
+    if (node->count == node->capacity) {
+        uint32_t capacity = node->capacity ? node->capacity * 2 : 8;
+        schema_field_s *fields =
+            realloc(node->fields, capacity * sizeof(schema_field_s));
+        if (NULL == fields) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+        node->fields = fields;
+        node->capacity = capacity;
+    }
+
+    PyObject *name =
+        PyUnicode_FromStringAndSize(key->utf8_string, key->data_size);
+    if (NULL == name) {
+        return NULL;
+    }
+    PyUnicode_InternInPlace(&name);
+    // The hash is cached on the key object, so dicts built from the schema
+    // never need to hash their keys.
+    if (PyObject_Hash(name) == -1) {
+        Py_DECREF(name);
+        return NULL;
+    }
+
+    schema_field_s *field = &node->fields[node->count++];
+    field->key = name;
+    field->name = PyUnicode_AsUTF8AndSize(name, &field->size);
+    field->child = NULL;
+    if (NULL == field->name) {
+        node->count--;
+        Py_DECREF(name);
+        return NULL;
+    }
+    return field;
+}
+
+static int schema_merge(schema_node_s **node,
+                        MMDB_entry_data_list_s **entry_data_list);
+
+// Adds the keys of the map at entry_data_list to node. As with
+// from_entry_data_list, entry_data_list is left at the map's last entry.
+static int schema_merge_map(schema_node_s *node,
+                            MMDB_entry_data_list_s **entry_data_list) {
+    const uint32_t map_size = (*entry_data_list)->entry_data.data_size;
+    uint32_t i;
+    for (i = 0; i < map_size; i++) {
+        *entry_data_list = (*entry_data_list)->next;
+        if (NULL == *entry_data_list || NULL == (*entry_data_list)->next) {
+            return -1;
+        }
+        MMDB_entry_data_s *key = &(*entry_data_list)->entry_data;
+        schema_field_s *field = (schema_field_s *)schema_find(node, i, key);
+        if (NULL == field && MMDB_DATA_TYPE_UTF8_STRING == key->type) {
+            field = schema_add(node, key);
+            if (NULL == field) {
+                return -1;
+            }
+        }
+
+        *entry_data_list = (*entry_data_list)->next;
+        if (NULL == field) {
+            *entry_data_list = last_entry_of_value(*entry_data_list);
+            if (NULL == *entry_data_list) {
+                return -1;
+            }
+        } else if (schema_merge(&field->child, entry_data_list) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Merges the maps in the value at entry_data_list into *node, creating it if
+// needed. Values other than maps and arrays are skipped.
+static int schema_merge(schema_node_s **node,
+                        MMDB_entry_data_list_s **entry_data_list) {
+    uint32_t type = (*entry_data_list)->entry_data.type;
+    if (MMDB_DATA_TYPE_MAP != type && MMDB_DATA_TYPE_ARRAY != type) {
+        return 0;
+    }
+
+    if (NULL == *node) {
+        *node = calloc(1, sizeof(schema_node_s));
+        if (NULL == *node) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+
+    if (MMDB_DATA_TYPE_MAP == type) {
+        return schema_merge_map(*node, entry_data_list);
+    }
+
+    const uint32_t size = (*entry_data_list)->entry_data.data_size;
+    uint32_t i;
+    for (i = 0; i < size; i++) {
+        *entry_data_list = (*entry_data_list)->next;
+        if (NULL == *entry_data_list ||
+            schema_merge(node, entry_data_list) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void schema_free(schema_node_s *node) {
+    if (NULL == node) {
+        return;
+    }
+    uint32_t i;
+    for (i = 0; i < node->count; i++) {
+        Py_DECREF(node->fields[i].key);
+        schema_free(node->fields[i].child);
+    }
+    Py_XDECREF(node->cls);
+    free(node->offsets);
+    free(node->fields);
+    free(node);
+}
+
+// Builds the schema of the records from the first limit distinct records in
+// the search tree, or from all of them if limit is 0.
+static int build_schema(mmdb_handle_s *handle, size_t limit) {
+    MMDB_s *mmdb = &handle->mmdb;
+    record_table_s *records = calloc(1, sizeof(record_table_s));
+    if (NULL == records || record_table_init(records, 10) == -1) {
+        free(records);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    int status;
+    Py_BEGIN_ALLOW_THREADS;
+    status = collect_record_offsets(mmdb, records, limit);
+    Py_END_ALLOW_THREADS;
+    if (-1 == status) {
+        record_table_free(records);
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (MMDB_SUCCESS != status) {
+        PyErr_Format(handle->error,
+                     "Error while building schema. %s",
+                     MMDB_strerror(status));
+        record_table_free(records);
+        return -1;
+    }
+
+    schema_node_s *schema = NULL;
+    size_t slot;
+    size_t merged = 0;
+    for (slot = 0; slot < ((size_t)1 << records->bits); slot++) {
+        if (RECORD_TABLE_EMPTY == records->offsets[slot]) {
+            continue;
+        }
+        // As when materializing, other threads may run now and then.
+        if (0 == (++merged & 0xfff)) {
+            Py_BEGIN_ALLOW_THREADS;
+            Py_END_ALLOW_THREADS;
+        }
+
+        MMDB_entry_s entry = {.mmdb = mmdb, .offset = records->offsets[slot]};
+        MMDB_entry_data_list_s *entry_data_list = NULL;
+        status = MMDB_get_entry_data_list(&entry, &entry_data_list);
+        MMDB_entry_data_list_s *original_entry_data_list = entry_data_list;
+        if (MMDB_SUCCESS != status || NULL == entry_data_list ||
+            schema_merge(&schema, &entry_data_list) == -1) {
+            if (!PyErr_Occurred()) {
+                PyErr_Format(handle->error,
+                             "Error while building schema. %s",
+                             MMDB_strerror(MMDB_SUCCESS == status
+                                               ? MMDB_INVALID_DATA_ERROR
+                                               : status));
+            }
+            MMDB_free_entry_data_list(original_entry_data_list);
+            schema_free(schema);
+            record_table_free(records);
+            return -1;
+        }
+        MMDB_free_entry_data_list(original_entry_data_list);
+    }
+    record_table_free(records);
+
+    handle->schema = schema;
+    return 0;
+}
+
+static int schema_build_classes(schema_node_s *node,
+                                PyObject *name,
+                                PyObject *factory) {
+    uint32_t i;
+    for (i = 0; i < node->count; i++) {
+        if (NULL != node->fields[i].child &&
+            schema_build_classes(
+                node->fields[i].child, node->fields[i].key, factory) == -1) {
+            return -1;
+        }
+    }
+
+    PyObject *fields = PyTuple_New(node->count);
+    if (NULL == fields) {
+        return -1;
+    }
+    for (i = 0; i < node->count; i++) {
+        Py_INCREF(node->fields[i].key);
+        PyTuple_SET_ITEM(fields, i, node->fields[i].key);
+    }
+    PyObject *cls = PyObject_CallFunctionObjArgs(factory, name, fields, NULL);
+    Py_DECREF(fields);
+    if (NULL == cls) {
+        return -1;
+    }
+    if (Py_None == cls) {
+        // The keys cannot be used as attribute names, so the maps remain
+        // dicts.
+        Py_DECREF(cls);
+        return 0;
+    }
+
+    node->offsets = malloc(node->count * sizeof(Py_ssize_t));
+    if (NULL == node->offsets) {
+        Py_DECREF(cls);
+        PyErr_NoMemory();
+        return -1;
+    }
+    // The values are stored directly in the slots of the class, bypassing
+    // the read-only __setattr__.
+    for (i = 0; i < node->count; i++) {
+        PyObject *descr = PyObject_GetAttr(cls, node->fields[i].key);
+        if (NULL == descr) {
+            Py_DECREF(cls);
+            return -1;
+        }
+        if (!PyObject_TypeCheck(descr, &PyMemberDescr_Type) ||
+            T_OBJECT_EX != ((PyMemberDescrObject *)descr)->d_member->type) {
+            Py_DECREF(descr);
+            Py_DECREF(cls);
+            PyErr_SetString(PyExc_TypeError,
+                            "record classes must store fields in slots");
+            return -1;
+        }
+        node->offsets[i] = ((PyMemberDescrObject *)descr)->d_member->offset;
+        Py_DECREF(descr);
+    }
+    node->cls = cls;
+    return 0;
+}
+
+// Creates the typed record classes for the maps in the schema.
+static int build_record_classes(mmdb_handle_s *handle) {
+    if (NULL == handle->schema) {
+        return 0;
+    }
+
+    PyObject *types_mod = PyImport_ImportModule("maxminddb.types");
+    if (NULL == types_mod) {
+        return -1;
+    }
+    PyObject *factory = PyObject_GetAttrString(types_mod, "typed_record_class");
+    Py_DECREF(types_mod);
+    if (NULL == factory) {
+        return -1;
+    }
+    PyObject *name =
+        PyUnicode_FromString(handle->mmdb.metadata.database_type);
+    if (NULL == name) {
+        Py_DECREF(factory);
+        return -1;
+    }
+
+    int status = schema_build_classes(handle->schema, name, factory);
+    Py_DECREF(name);
+    Py_DECREF(factory);
+    return status;
+}
+
+static Py_ssize_t object_sizeof(PyObject *getsizeof, PyObject *obj) {
+    PyObject *size = PyObject_CallFunctionObjArgs(getsizeof, obj, NULL);
+    if (NULL == size) {
+        return -1;
+    }
+    Py_ssize_t result = PyLong_AsSsize_t(size);
+    Py_DECREF(size);
+    return result;
+}
+
+// Returns the approximate number of bytes used by an immutable record and
+// the objects it contains, or -1 on errors.
+static Py_ssize_t deep_sizeof(PyObject *getsizeof, PyObject *obj) {
+    Py_ssize_t size = object_sizeof(getsizeof, obj);
+    if (size == -1) {
+        return -1;
+    }
+
+    if (PyTuple_Check(obj)) {
+        Py_ssize_t i;
+        for (i = 0; i < PyTuple_GET_SIZE(obj); i++) {
+            Py_ssize_t item_size =
+                deep_sizeof(getsizeof, PyTuple_GET_ITEM(obj, i));
+            if (item_size == -1) {
+                return -1;
+            }
+            size += item_size;
+        }
+    } else if (Py_TYPE(obj) == &PyDictProxy_Type) {
+        // The proxied dict is not accessible, but a copy of it is the same
+        // size.
+        PyObject *dict = PyObject_CallMethod(obj, "copy", NULL);
+        if (NULL == dict) {
+            return -1;
+        }
+        Py_ssize_t dict_size = object_sizeof(getsizeof, dict);
+        PyObject *key, *value;
+        Py_ssize_t pos = 0;
+        while (dict_size != -1 && PyDict_Next(dict, &pos, &key, &value)) {
+            Py_ssize_t key_size = object_sizeof(getsizeof, key);
+            Py_ssize_t value_size = deep_sizeof(getsizeof, value);
+            if (key_size == -1 || value_size == -1) {
+                dict_size = -1;
+                break;
+            }
+            dict_size += key_size + value_size;
+        }
+        Py_DECREF(dict);
+        if (dict_size == -1) {
+            return -1;
+        }
+        size += dict_size;
+    }
+    return size;
+}
+
+// Makes room for size more bytes. It does not set an exception, so that it
+// can be used without the GIL.
+static int buffer_grow(byte_buffer_s *buf, size_t size) {
+    if (buf->size + size <= buf->capacity) {
+        return 0;
+    }
+    size_t capacity = buf->capacity ? buf->capacity : 256;
+    while (capacity < buf->size + size) {
+        capacity *= 2;
+    }
+    char *data = realloc(buf->data, capacity);
+    if (NULL == data) {
+        return -1;
+    }
+    buf->data = data;
+    buf->capacity = capacity;
+    return 0;
+}
+
+static int buffer_reserve(byte_buffer_s *buf, size_t size) {
+    if (buffer_grow(buf, size) == -1) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    return 0;
+}
+
+static int buffer_write(byte_buffer_s *buf, const char *data, size_t size) {
+    if (buffer_reserve(buf, size) == -1) {
+        return -1;
+    }
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+    return 0;
+}
+
+// Writes a JSON string, escaping it the same way as json.dumps with
+// ensure_ascii=False. Non-ASCII characters are written as UTF-8.
+static int json_write_string(byte_buffer_s *buf, const char *str, size_t size) {
+    static const char hex[] = "0123456789abcdef";
+
+    // Each byte expands to at most six, plus the quotes.
+    if (buffer_reserve(buf, size * 6 + 2) == -1) {
+        return -1;
+    }
+    char *out = buf->data + buf->size;
+    *out++ = '"';
+    size_t i;
+    for (i = 0; i < size; i++) {
+        unsigned char c = (unsigned char)str[i];
+        switch (c) {
+            case '"':
+                *out++ = '\\';
+                *out++ = '"';
+                break;
+            case '\\':
+                *out++ = '\\';
+                *out++ = '\\';
+                break;
+            case '\n':
+                *out++ = '\\';
+                *out++ = 'n';
+                break;
+            case '\r':
+                *out++ = '\\';
+                *out++ = 'r';
+                break;
+            case '\t':
+                *out++ = '\\';
+                *out++ = 't';
+                break;
+            case '\b':
+                *out++ = '\\';
+                *out++ = 'b';
+                break;
+            case '\f':
+                *out++ = '\\';
+                *out++ = 'f';
+                break;
+            default:
+                if (c < 0x20) {
+                    memcpy(out, "\\u00", 4);
+                    out += 4;
+                    *out++ = hex[c >> 4];
+                    *out++ = hex[c & 0xf];
+                } else {
+                    *out++ = (char)c;
+                }
+        }
+    }
+    *out++ = '"';
+    buf->size = (size_t)(out - buf->data);
+    return 0;
+}
+
+// Binary data has no JSON representation, so it is written as a base64
+// string.
+static int
+json_write_bytes(byte_buffer_s *buf, const uint8_t *data, size_t size) {
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    if (buffer_reserve(buf, (size + 2) / 3 * 4 + 2) == -1) {
+        return -1;
+    }
+    char *out = buf->data + buf->size;
+    *out++ = '"';
+    size_t i;
+    for (i = 0; i + 2 < size; i += 3) {
+        uint32_t n = (uint32_t)data[i] << 16 | (uint32_t)data[i + 1] << 8 |
+                     data[i + 2];
+        *out++ = alphabet[n >> 18 & 0x3f];
+        *out++ = alphabet[n >> 12 & 0x3f];
+        *out++ = alphabet[n >> 6 & 0x3f];
+        *out++ = alphabet[n & 0x3f];
+    }
+    if (i < size) {
+        uint32_t n = (uint32_t)data[i] << 16;
+        if (i + 1 < size) {
+            n |= (uint32_t)data[i + 1] << 8;
+        }
+        *out++ = alphabet[n >> 18 & 0x3f];
+        *out++ = alphabet[n >> 12 & 0x3f];
+        *out++ = i + 1 < size ? alphabet[n >> 6 & 0x3f] : '=';
+        *out++ = '=';
+    }
+    *out++ = '"';
+    buf->size = (size_t)(out - buf->data);
+    return 0;
+}
+
+// Writes the number the same way as float.__repr__, which is what json.dumps
+// uses.
+static int json_write_double(byte_buffer_s *buf, double value) {
+    if (isnan(value)) {
+        return buffer_write(buf, "NaN", 3);
+    }
+    if (isinf(value)) {
+        return value > 0 ? buffer_write(buf, "Infinity", 8)
+                         : buffer_write(buf, "-Infinity", 9);
+    }
+
+    char *str = PyOS_double_to_string(value, 'r', 0, Py_DTSF_ADD_DOT_0, NULL);
+    if (NULL == str) {
+        return -1;
+    }
+    int status = buffer_write(buf, str, strlen(str));
+    PyMem_Free(str);
+    return status;
+}
+
+static int json_write_uint128(byte_buffer_s *buf,
+                              const MMDB_entry_data_s *entry_data) {
+    uint64_t high, low;
+    split_uint128(entry_data, &high, &low);
+
+    // Repeatedly divide the number, held as four 32-bit limbs, by ten.
+    uint32_t limbs[4] = {(uint32_t)(high >> 32),
+                         (uint32_t)high,
+                         (uint32_t)(low >> 32),
+                         (uint32_t)low};
+    char digits[40];
+    int count = 0;
+    do {
+        uint64_t remainder = 0;
+        int i;
+        for (i = 0; i < 4; i++) {
+            uint64_t current = remainder << 32 | limbs[i];
+            limbs[i] = (uint32_t)(current / 10);
+            remainder = current % 10;
+        }
+        digits[sizeof(digits) - 1 - count++] = (char)('0' + remainder);
+    } while (limbs[0] || limbs[1] || limbs[2] || limbs[3]);
+
+    return buffer_write(buf, digits + sizeof(digits) - count, (size_t)count);
+}
+
+// Writes the value at entry_data_list, leaving entry_data_list at its last
+// entry as from_entry_data_list does.
+static int json_write_value(byte_buffer_s *buf,
+                            MMDB_entry_data_list_s **entry_data_list,
+                            PyObject *error) {
+    if (NULL == entry_data_list || NULL == *entry_data_list) {
+        PyErr_SetString(error,
+                        "Error while looking up data. Your database may be "
+                        "corrupt or you have found a bug in libmaxminddb.");
+        return -1;
+    }
+
+    MMDB_entry_data_s *entry_data = &(*entry_data_list)->entry_data;
+    char num[32];
+    int len;
+    uint32_t i;
+    switch (entry_data->type) {
+        case MMDB_DATA_TYPE_MAP: {
+            const uint32_t map_size = entry_data->data_size;
+            if (buffer_write(buf, "{", 1) == -1) {
+                return -1;
+            }
+            for (i = 0; i < map_size; i++) {
+                *entry_data_list = (*entry_data_list)->next;
+                if (NULL == *entry_data_list) {
+                    return json_write_value(buf, entry_data_list, error);
+                }
+                MMDB_entry_data_s *key = &(*entry_data_list)->entry_data;
+                if ((i > 0 && buffer_write(buf, ",", 1) == -1) ||
+                    json_write_string(buf, key->utf8_string, key->data_size) ==
+                        -1 ||
+                    buffer_write(buf, ":", 1) == -1) {
+                    return -1;
+                }
+                *entry_data_list = (*entry_data_list)->next;
+                if (json_write_value(buf, entry_data_list, error) == -1) {
+                    return -1;
+                }
+            }
+            return buffer_write(buf, "}", 1);
+        }
+        case MMDB_DATA_TYPE_ARRAY: {
+            const uint32_t size = entry_data->data_size;
+            if (buffer_write(buf, "[", 1) == -1) {
+                return -1;
+            }
+            for (i = 0; i < size; i++) {
+                *entry_data_list = (*entry_data_list)->next;
+                if ((i > 0 && buffer_write(buf, ",", 1) == -1) ||
+                    json_write_value(buf, entry_data_list, error) == -1) {
+                    return -1;
+                }
+            }
+            return buffer_write(buf, "]", 1);
+        }
+        case MMDB_DATA_TYPE_UTF8_STRING:
+            return json_write_string(
+                buf, entry_data->utf8_string, entry_data->data_size);
+        case MMDB_DATA_TYPE_BYTES:
+            return json_write_bytes(
+                buf, entry_data->bytes, entry_data->data_size);
+        case MMDB_DATA_TYPE_DOUBLE:
+            return json_write_double(buf, entry_data->double_value);
+        case MMDB_DATA_TYPE_FLOAT:
+            return json_write_double(buf, entry_data->float_value);
+        case MMDB_DATA_TYPE_UINT16:
+            len = snprintf(num, sizeof(num), "%" PRIu16, entry_data->uint16);
+            return buffer_write(buf, num, (size_t)len);
+        case MMDB_DATA_TYPE_UINT32:
+            len = snprintf(num, sizeof(num), "%" PRIu32, entry_data->uint32);
+            return buffer_write(buf, num, (size_t)len);
+        case MMDB_DATA_TYPE_BOOLEAN:
+            return entry_data->boolean ? buffer_write(buf, "true", 4)
+                                       : buffer_write(buf, "false", 5);
+        case MMDB_DATA_TYPE_UINT64:
+            len = snprintf(num, sizeof(num), "%" PRIu64, entry_data->uint64);
+            return buffer_write(buf, num, (size_t)len);
+        case MMDB_DATA_TYPE_UINT128:
+            return json_write_uint128(buf, entry_data);
+        case MMDB_DATA_TYPE_INT32:
+            len = snprintf(num, sizeof(num), "%" PRId32, entry_data->int32);
+            return buffer_write(buf, num, (size_t)len);
+        default:
+            PyErr_Format(error,
+                         "Invalid data type arguments: %d",
+                         entry_data->type);
+            return -1;
+    }
+}
+
+static bool json_field_selected(PyObject *fields,
+                                const MMDB_entry_data_s *key) {
+    Py_ssize_t i;
+    for (i = 0; i < PySequence_Fast_GET_SIZE(fields); i++) {
+        Py_ssize_t size;
+        const char *field =
+            PyUnicode_AsUTF8AndSize(PySequence_Fast_GET_ITEM(fields, i), &size);
+        if (NULL == field) {
+            // Field names that cannot be encoded never match a key.
+            PyErr_Clear();
+            continue;
+        }
+        if ((size_t)size == key->data_size &&
+            0 == memcmp(field, key->utf8_string, key->data_size)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Writes a record map with only the keys in fields.
+static int json_write_fields(byte_buffer_s *buf,
+                             MMDB_entry_data_list_s *entry_data_list,
+                             PyObject *fields,
+                             PyObject *error) {
+    const uint32_t map_size = entry_data_list->entry_data.data_size;
+    if (buffer_write(buf, "{", 1) == -1) {
+        return -1;
+    }
+
+    bool first = true;
+    uint32_t i;
+    for (i = 0; i < map_size; i++) {
+        MMDB_entry_data_list_s *key = entry_data_list->next;
+        if (NULL == key || NULL == key->next) {
+            return json_write_value(buf, NULL, error);
+        }
+        entry_data_list = key->next;
+        if (!json_field_selected(fields, &key->entry_data)) {
+            entry_data_list = last_entry_of_value(entry_data_list);
+            if (NULL == entry_data_list) {
+                return json_write_value(buf, NULL, error);
+            }
+            continue;
+        }
+        if ((!first && buffer_write(buf, ",", 1) == -1) ||
+            json_write_string(buf,
+                              key->entry_data.utf8_string,
+                              key->entry_data.data_size) == -1 ||
+            buffer_write(buf, ":", 1) == -1 ||
+            json_write_value(buf, &entry_data_list, error) == -1) {
+            return -1;
+        }
+        first = false;
+    }
+    return buffer_write(buf, "}", 1);
+}
+
+// Looks up ip and writes its record to buf. Returns 1 if a record was
+// written, 0 if there is no record for the address and -1 on errors.
+static int json_write_address(Reader_obj *reader,
+                              byte_buffer_s *buf,
+                              PyObject *ip,
+                              PyObject *fields) {
+    mmdb_handle_s *handle = reader_open_handle(reader);
+    if (NULL == handle) {
+        return -1;
+    }
+    int status = json_write_entry(handle, buf, ip, fields);
+    handle_decref(handle);
+    return status;
+}
+
+static int json_write_entry(mmdb_handle_s *handle,
+                            byte_buffer_s *buf,
+                            PyObject *ip,
+                            PyObject *fields) {
+    struct sockaddr_storage ip_address_ss = {0};
+    MMDB_lookup_result_s result;
+    if (lookup_address(handle, ip, &ip_address_ss, &result) == -1) {
+        return -1;
+    }
+
+    if (!result.found_entry) {
+        return 0;
+    }
+
+    MMDB_entry_data_list_s *entry_data_list = NULL;
+    int status = MMDB_get_entry_data_list(&result.entry, &entry_data_list);
+    if (MMDB_SUCCESS != status) {
+        char ipstr[INET6_ADDRSTRLEN] = {0};
+        if (format_sockaddr((struct sockaddr *)&ip_address_ss, ipstr)) {
+            PyErr_Format(handle->error,
+                         "Error while looking up data for %s. %s",
+                         ipstr,
+                         MMDB_strerror(status));
+        }
+        MMDB_free_entry_data_list(entry_data_list);
+        return -1;
+    }
 
-    if (mmdb_obj->closed == Py_True) {
-        PyErr_SetString(PyExc_ValueError,
-                        "Attempt to reopen a closed MaxMind DB.");
-        return NULL;
+    MMDB_entry_data_list_s *original_entry_data_list = entry_data_list;
+    if (Py_None != fields && NULL != entry_data_list &&
+        MMDB_DATA_TYPE_MAP == entry_data_list->entry_data.type) {
+        status = json_write_fields(buf, entry_data_list, fields, handle->error);
+    } else {
+        status = json_write_value(buf, &entry_data_list, handle->error);
     }
+    MMDB_free_entry_data_list(original_entry_data_list);
 
-    Py_INCREF(self);
-    return (PyObject *)self;
+    return status == -1 ? -1 : 1;
 }
 
-static PyObject *Reader__exit__(PyObject *self, PyObject *UNUSED(args)) {
-    Reader_close(self, NULL);
-    Py_RETURN_NONE;
+// Sets the exception for a status returned by raw_value and returns -1.
+static int raw_raise(PyObject *error, int status) {
+    if (RAW_NO_MEMORY == status) {
+        PyErr_NoMemory();
+    } else if (RAW_TOO_DEEP == status) {
+        PyErr_SetString(error,
+                        "Exceeded maximum data structure depth; database is "
+                        "likely corrupt.");
+    } else {
+        PyErr_SetString(error,
+                        "The MaxMind DB file's data section contains bad data "
+                        "(unknown data type or corrupt data)");
+    }
+    return -1;
 }
 
-static void Reader_dealloc(PyObject *self) {
-    Reader_obj *obj = (Reader_obj *)self;
-    if (NULL != obj->mmdb) {
-        Reader_close(self, NULL);
+static int raw_write(byte_buffer_s *out, const uint8_t *data, size_t size) {
+    if (buffer_grow(out, size) == -1) {
+        return RAW_NO_MEMORY;
     }
-
-    PyObject_Del(self);
+    memcpy(out->data + out->size, data, size);
+    out->size += size;
+    return 0;
 }
 
-static int Metadata_init(PyObject *self, PyObject *args, PyObject *kwds) {
+// Reads the control byte(s) of the value at offset, setting type, size and
+// the offset of the payload.
+static int raw_header(const MMDB_s *mmdb,
+                      uint32_t offset,
+                      int *type,
+                      uint32_t *size,
+                      uint32_t *payload) {
+    const uint8_t *data = mmdb->data_section;
+    const uint32_t data_size = mmdb->data_section_size;
 
-    PyObject *binary_format_major_version, *binary_format_minor_version,
-        *build_epoch, *database_type, *description, *ip_version, *languages,
-        *node_count, *record_size;
+    if (offset >= data_size) {
+        return RAW_BAD_DATA;
+    }
+    uint8_t ctrl = data[offset++];
+    *type = ctrl >> 5;
+    if (0 == *type) {
+        if (offset >= data_size) {
+            return RAW_BAD_DATA;
+        }
+        *type = 7 + data[offset++];
+        if (*type < 8 || *type > MMDB_DATA_TYPE_FLOAT) {
+            return RAW_BAD_DATA;
+        }
+    }
 
-    static char *kwlist[] = {"binary_format_major_version",
-                             "binary_format_minor_version",
-                             "build_epoch",
-                             "database_type",
-                             "description",
-                             "ip_version",
-                             "languages",
-                             "node_count",
-                             "record_size",
-                             NULL};
+    *size = ctrl & 0x1f;
+    if (MMDB_DATA_TYPE_POINTER == *type || *size < 29) {
+        *payload = offset;
+        return 0;
+    }
 
-    if (!PyArg_ParseTupleAndKeywords(args,
-                                     kwds,
-                                     "|OOOOOOOOO",
-                                     kwlist,
-                                     &binary_format_major_version,
-                                     &binary_format_minor_version,
-                                     &build_epoch,
-                                     &database_type,
-                                     &description,
-                                     &ip_version,
-                                     &languages,
-                                     &node_count,
-                                     &record_size)) {
-        return -1;
+    int bytes = *size - 28;
+    if (offset + bytes > data_size) {
+        return RAW_BAD_DATA;
+    }
+    uint32_t extra = 0;
+    int i;
+    for (i = 0; i < bytes; i++) {
+        extra = (extra << 8) | data[offset++];
     }
+    if (29 == *size) {
+        *size = 29 + extra;
+    } else if (30 == *size) {
+        *size = 285 + extra;
+    } else {
+        *size = 65821 + extra;
+    }
+    *payload = offset;
+    return 0;
+}
 
-    Metadata_obj *obj = (Metadata_obj *)self;
+// Finds the end of the value at offset, setting next to the offset after it
+// and has_pointers if it contains pointers. If out is not NULL, the value is
+// also written to it with every pointer replaced by the value it points to,
+// making the output self-contained. Returns 0 or one of the RAW_ errors.
+static int raw_value(const MMDB_s *mmdb,
+                     uint32_t offset,
+                     byte_buffer_s *out,
+                     uint32_t *next,
+                     bool *has_pointers,
+                     int depth) {
+    if (depth > RAW_MAXIMUM_DATA_STRUCTURE_DEPTH) {
+        return RAW_TOO_DEEP;
+    }
 
-    obj->binary_format_major_version = binary_format_major_version;
-    obj->binary_format_minor_version = binary_format_minor_version;
-    obj->build_epoch = build_epoch;
-    obj->database_type = database_type;
-    obj->description = description;
-    obj->ip_version = ip_version;
-    obj->languages = languages;
-    obj->node_count = node_count;
-    obj->record_size = record_size;
+    int type;
+    uint32_t size, payload;
+    int status = raw_header(mmdb, offset, &type, &size, &payload);
+    if (0 != status) {
+        return status;
+    }
 
-    Py_INCREF(obj->binary_format_major_version);
-    Py_INCREF(obj->binary_format_minor_version);
-    Py_INCREF(obj->build_epoch);
-    Py_INCREF(obj->database_type);
-    Py_INCREF(obj->description);
-    Py_INCREF(obj->ip_version);
-    Py_INCREF(obj->languages);
-    Py_INCREF(obj->node_count);
-    Py_INCREF(obj->record_size);
+    uint32_t count = 0;
+    switch (type) {
+        case MMDB_DATA_TYPE_POINTER: {
+            const uint8_t *data = mmdb->data_section;
+            int pointer_size = (size >> 3) + 1;
+            if (payload + pointer_size > mmdb->data_section_size) {
+                return RAW_BAD_DATA;
+            }
+            uint32_t pointer = pointer_size == 4 ? 0 : size & 0x7;
+            int i;
+            for (i = 0; i < pointer_size; i++) {
+                pointer = (pointer << 8) | data[payload + i];
+            }
+            if (2 == pointer_size) {
+                pointer += 2048;
+            } else if (3 == pointer_size) {
+                pointer += 526336;
+            }
+            *has_pointers = true;
+            *next = payload + pointer_size;
+            if (NULL == out) {
+                return 0;
+            }
+            uint32_t ignored;
+            return raw_value(
+                mmdb, pointer, out, &ignored, has_pointers, depth + 1);
+        }
+        case MMDB_DATA_TYPE_MAP:
+            count = 2 * size;
+            break;
+        case MMDB_DATA_TYPE_ARRAY:
+            count = size;
+            break;
+        case MMDB_DATA_TYPE_BOOLEAN:
+            // Booleans store their value in the size and have no payload.
+            *next = payload;
+            return NULL == out ? 0
+                               : raw_write(out,
+                                           mmdb->data_section + offset,
+                                           payload - offset);
+        default:
+            if ((uint64_t)payload + size > mmdb->data_section_size) {
+                return RAW_BAD_DATA;
+            }
+            *next = payload + size;
+            return NULL == out ? 0
+                               : raw_write(out,
+                                           mmdb->data_section + offset,
+                                           *next - offset);
+    }
 
+    if (NULL != out && (status = raw_write(out,
+                                           mmdb->data_section + offset,
+                                           payload - offset)) != 0) {
+        return status;
+    }
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        status =
+            raw_value(mmdb, payload, out, &payload, has_pointers, depth + 1);
+        if (0 != status) {
+            return status;
+        }
+    }
+    *next = payload;
     return 0;
 }
 
-static void Metadata_dealloc(PyObject *self) {
-    Metadata_obj *obj = (Metadata_obj *)self;
-    Py_DECREF(obj->binary_format_major_version);
-    Py_DECREF(obj->binary_format_minor_version);
-    Py_DECREF(obj->build_epoch);
-    Py_DECREF(obj->database_type);
-    Py_DECREF(obj->description);
-    Py_DECREF(obj->ip_version);
-    Py_DECREF(obj->languages);
-    Py_DECREF(obj->node_count);
-    Py_DECREF(obj->record_size);
-    PyObject_Del(self);
+static PyObject *decode_raw(PyObject *self, PyObject *args) {
+    Py_buffer buffer;
+    if (!PyArg_ParseTuple(args, "y*", &buffer)) {
+        return NULL;
+    }
+    if ((size_t)buffer.len > UINT32_MAX) {
+        PyBuffer_Release(&buffer);
+        PyErr_SetString(PyExc_ValueError, "buffer is too large");
+        return NULL;
+    }
+
+    // libmaxminddb only needs the data section to decode data, so a raw
+    // record can be decoded by treating it as the data section of an
+    // otherwise empty database.
+    MMDB_s mmdb = {0};
+    mmdb.data_section = buffer.buf;
+    mmdb.data_section_size = (uint32_t)buffer.len;
+
+    MMDB_entry_s entry = {.mmdb = &mmdb, .offset = 0};
+    MMDB_entry_data_list_s *entry_data_list = NULL;
+    int status = MMDB_get_entry_data_list(&entry, &entry_data_list);
+    PyObject *record = NULL;
+    if (MMDB_SUCCESS != status) {
+        PyErr_Format(module_state(self)->error,
+                     "Error while decoding raw record. %s",
+                     MMDB_strerror(status));
+    } else {
+        MMDB_entry_data_list_s *original_entry_data_list = entry_data_list;
+        record = from_entry_data_list(
+            &entry_data_list, false, NULL, module_state(self)->error);
+        entry_data_list = original_entry_data_list;
+    }
+    MMDB_free_entry_data_list(entry_data_list);
+    PyBuffer_Release(&buffer);
+    return record;
 }
 
-static PyObject *
-from_entry_data_list(MMDB_entry_data_list_s **entry_data_list) {
+static PyObject *from_entry_data_list(MMDB_entry_data_list_s **entry_data_list,
+                                      bool immutable,
+                                      const schema_node_s *schema,
+                                      PyObject *error) {
     if (NULL == entry_data_list || NULL == *entry_data_list) {
-        PyErr_SetString(MaxMindDB_error,
+        PyErr_SetString(error,
                         "Error while looking up data. Your database may be "
                         "corrupt or you have found a bug in libmaxminddb.");
         return NULL;
@@ -470,14 +5564,19 @@ from_entry_data_list(MMDB_entry_data_list_s **entry_data_list) {
 
     switch ((*entry_data_list)->entry_data.type) {
         case MMDB_DATA_TYPE_MAP:
-            return from_map(entry_data_list);
+            return from_map(entry_data_list, immutable, schema, error);
         case MMDB_DATA_TYPE_ARRAY:
-            return from_array(entry_data_list);
+            return from_array(entry_data_list, immutable, schema, error);
         case MMDB_DATA_TYPE_UTF8_STRING:
             return PyUnicode_FromStringAndSize(
                 (*entry_data_list)->entry_data.utf8_string,
                 (*entry_data_list)->entry_data.data_size);
         case MMDB_DATA_TYPE_BYTES:
+            if (immutable) {
+                return PyBytes_FromStringAndSize(
+                    (const char *)(*entry_data_list)->entry_data.bytes,
+                    (Py_ssize_t)(*entry_data_list)->entry_data.data_size);
+            }
             return PyByteArray_FromStringAndSize(
                 (const char *)(*entry_data_list)->entry_data.bytes,
                 (Py_ssize_t)(*entry_data_list)->entry_data.data_size);
@@ -501,7 +5600,7 @@ from_entry_data_list(MMDB_entry_data_list_s **entry_data_list) {
         case MMDB_DATA_TYPE_INT32:
             return PyLong_FromLong((*entry_data_list)->entry_data.int32);
         default:
-            PyErr_Format(MaxMindDB_error,
+            PyErr_Format(error,
                          "Invalid data type arguments: %d",
                          (*entry_data_list)->entry_data.type);
             return NULL;
@@ -509,7 +5608,65 @@ from_entry_data_list(MMDB_entry_data_list_s **entry_data_list) {
     return NULL;
 }
 
-static PyObject *from_map(MMDB_entry_data_list_s **entry_data_list) {
+// Decodes a map into an instance of the record class of schema. The schema
+// holds the keys of every record in the database, so a key missing from it
+// means the data is invalid.
+static PyObject *from_typed_map(MMDB_entry_data_list_s **entry_data_list,
+                                bool immutable,
+                                const schema_node_s *schema,
+                                PyObject *error) {
+    PyTypeObject *type = (PyTypeObject *)schema->cls;
+    PyObject *record = type->tp_alloc(type, 0);
+    if (NULL == record) {
+        return NULL;
+    }
+
+    const uint32_t map_size = (*entry_data_list)->entry_data.data_size;
+    uint32_t i;
+    for (i = 0; i < map_size; i++) {
+        *entry_data_list = (*entry_data_list)->next;
+        const schema_field_s *field =
+            NULL == *entry_data_list
+                ? NULL
+                : schema_find(schema, i, &(*entry_data_list)->entry_data);
+        if (NULL == field || NULL == (*entry_data_list)->next) {
+            Py_DECREF(record);
+            PyErr_SetString(error, "Invalid map key for a typed record");
+            return NULL;
+        }
+        *entry_data_list = (*entry_data_list)->next;
+
+        PyObject *value = from_entry_data_list(
+            entry_data_list, immutable, field->child, error);
+        if (NULL == value) {
+            Py_DECREF(record);
+            return NULL;
+        }
+        PyObject **slot =
+            (PyObject **)((char *)record +
+                          schema->offsets[field - schema->fields]);
+        Py_XSETREF(*slot, value);
+    }
+
+    // Keys missing from this record are None.
+    for (i = 0; i < schema->count; i++) {
+        PyObject **slot = (PyObject **)((char *)record + schema->offsets[i]);
+        if (NULL == *slot) {
+            Py_INCREF(Py_None);
+            *slot = Py_None;
+        }
+    }
+    return record;
+}
+
+static PyObject *from_map(MMDB_entry_data_list_s **entry_data_list,
+                          bool immutable,
+                          const schema_node_s *schema,
+                          PyObject *error) {
+    if (NULL != schema && NULL != schema->cls) {
+        return from_typed_map(entry_data_list, immutable, schema, error);
+    }
+
     PyObject *py_obj = PyDict_New();
     if (NULL == py_obj) {
         PyErr_NoMemory();
@@ -525,18 +5682,34 @@ static PyObject *from_map(MMDB_entry_data_list_s **entry_data_list) {
     for (i = 0; i < map_size && entry_data_list; i++) {
         *entry_data_list = (*entry_data_list)->next;
 
-        PyObject *key = PyUnicode_FromStringAndSize(
-            (*entry_data_list)->entry_data.utf8_string,
-            (*entry_data_list)->entry_data.data_size);
-        if (!key) {
-            // PyUnicode_FromStringAndSize will set an appropriate exception
-            // in this case.
-            return NULL;
+        // Keys found in the schema reuse its key objects, which also have
+        // their hashes cached. Anything else is decoded as usual.
+        const schema_field_s *field =
+            NULL == schema
+                ? NULL
+                : schema_find(schema, i, &(*entry_data_list)->entry_data);
+        PyObject *key;
+        if (NULL != field) {
+            key = field->key;
+            Py_INCREF(key);
+        } else {
+            key = PyUnicode_FromStringAndSize(
+                (*entry_data_list)->entry_data.utf8_string,
+                (*entry_data_list)->entry_data.data_size);
+            if (!key) {
+                // PyUnicode_FromStringAndSize will set an appropriate
+                // exception in this case.
+                return NULL;
+            }
         }
 
         *entry_data_list = (*entry_data_list)->next;
 
-        PyObject *value = from_entry_data_list(entry_data_list);
+        PyObject *value =
+            from_entry_data_list(entry_data_list,
+                                 immutable,
+                                 NULL == field ? NULL : field->child,
+                                 error);
         if (NULL == value) {
             Py_DECREF(key);
             Py_DECREF(py_obj);
@@ -547,13 +5720,24 @@ static PyObject *from_map(MMDB_entry_data_list_s **entry_data_list) {
         Py_DECREF(key);
     }
 
+    if (immutable) {
+        // Nothing else holds a reference to the dict, so the proxy makes the
+        // map read-only.
+        PyObject *proxy = PyDictProxy_New(py_obj);
+        Py_DECREF(py_obj);
+        return proxy;
+    }
+
     return py_obj;
 }
 
-static PyObject *from_array(MMDB_entry_data_list_s **entry_data_list) {
+static PyObject *from_array(MMDB_entry_data_list_s **entry_data_list,
+                            bool immutable,
+                            const schema_node_s *schema,
+                            PyObject *error) {
     const uint32_t size = (*entry_data_list)->entry_data.data_size;
 
-    PyObject *py_obj = PyList_New(size);
+    PyObject *py_obj = immutable ? PyTuple_New(size) : PyList_New(size);
     if (NULL == py_obj) {
         PyErr_NoMemory();
         return NULL;
@@ -565,33 +5749,46 @@ static PyObject *from_array(MMDB_entry_data_list_s **entry_data_list) {
     // coverity[check_after_deref]
     for (i = 0; i < size && entry_data_list; i++) {
         *entry_data_list = (*entry_data_list)->next;
-        PyObject *value = from_entry_data_list(entry_data_list);
+        PyObject *value =
+            from_entry_data_list(entry_data_list, immutable, schema, error);
         if (NULL == value) {
             Py_DECREF(py_obj);
             return NULL;
         }
-        // PyList_SetItem 'steals' the reference
-        PyList_SetItem(py_obj, i, value);
+        // PyList_SetItem and PyTuple_SET_ITEM 'steal' the reference
+        if (immutable) {
+            PyTuple_SET_ITEM(py_obj, i, value);
+        } else {
+            PyList_SetItem(py_obj, i, value);
+        }
     }
     return py_obj;
 }
 
-static PyObject *from_uint128(const MMDB_entry_data_list_s *entry_data_list) {
-    uint64_t high = 0;
-    uint64_t low = 0;
+static void split_uint128(const MMDB_entry_data_s *entry_data,
+                          uint64_t *high,
+                          uint64_t *low) {
 #if MMDB_UINT128_IS_BYTE_ARRAY
+    *high = 0;
+    *low = 0;
     int i;
     for (i = 0; i < 8; i++) {
-        high = (high << 8) | entry_data_list->entry_data.uint128[i];
+        *high = (*high << 8) | entry_data->uint128[i];
     }
 
     for (i = 8; i < 16; i++) {
-        low = (low << 8) | entry_data_list->entry_data.uint128[i];
+        *low = (*low << 8) | entry_data->uint128[i];
     }
 #else
-    high = entry_data_list->entry_data.uint128 >> 64;
-    low = (uint64_t)entry_data_list->entry_data.uint128;
+    *high = entry_data->uint128 >> 64;
+    *low = (uint64_t)entry_data->uint128;
 #endif
+}
+
+static PyObject *from_uint128(const MMDB_entry_data_list_s *entry_data_list) {
+    uint64_t high = 0;
+    uint64_t low = 0;
+    split_uint128(&entry_data_list->entry_data, &high, &low);
 
     char *num_str = malloc(33);
     if (NULL == num_str) {
@@ -616,10 +5813,82 @@ static PyMethodDef Reader_methods[] = {
      Reader_get_with_prefix_len,
      METH_VARARGS,
      "Return a tuple with the record and the associated prefix length"},
+    {"aget",
+     Reader_aget,
+     METH_VARARGS,
+     "Return the record for the ip_address without blocking the event loop"},
+    {"aget_many",
+     Reader_aget_many,
+     METH_VARARGS,
+     "Return the records for the ip_addresses without blocking the event "
+     "loop"},
+    {"get_lazy",
+     Reader_get_lazy,
+     METH_VARARGS,
+     "Return the record for the ip_address as a lazily decoded mapping"},
+    {"get_raw",
+     Reader_get_raw,
+     METH_VARARGS,
+     "Return the MaxMind DB encoding of the record for the ip_address"},
+    {"get_columns",
+     Reader_get_columns,
+     METH_VARARGS,
+     "Return the given fields of the records for the ip_addresses as "
+     "typed columns"},
+    {"get_many_text",
+     (PyCFunction)(void (*)(void))Reader_get_many_text,
+     METH_VARARGS | METH_KEYWORDS,
+     "Return the records for the addresses in a buffer of delimited text"},
+    {"lookup_buffer",
+     (PyCFunction)(void (*)(void))Reader_lookup_buffer,
+     METH_VARARGS | METH_KEYWORDS,
+     "Look up a buffer of packed addresses, writing the data offsets and "
+     "prefix lengths to the given buffers"},
+    {"decode_offset",
+     Reader_decode_offset,
+     METH_VARARGS,
+     "Return the record at the given data section offset"},
+    {"get_json",
+     (PyCFunction)(void (*)(void))Reader_get_json,
+     METH_VARARGS | METH_KEYWORDS,
+     "Return the record for the ip_address serialized as JSON bytes"},
+    {"get_many_json",
+     (PyCFunction)(void (*)(void))Reader_get_many_json,
+     METH_VARARGS | METH_KEYWORDS,
+     "Return the records for the ip_addresses serialized as a JSON array"},
     {"metadata",
      Reader_metadata,
      METH_NOARGS,
      "Return metadata object for database"},
+    {"materialize_stats",
+     Reader_materialize_stats,
+     METH_NOARGS,
+     "Return statistics about the records materialized at open, if any"},
+    {"cache_stats",
+     Reader_cache_stats,
+     METH_NOARGS,
+     "Return statistics about the record cache, if any"},
+    {"reload",
+     (PyCFunction)(void (*)(void))Reader_reload,
+     METH_VARARGS | METH_KEYWORDS,
+     "Open the database again, or another in its place, and swap it in"},
+    {"reload_stats",
+     Reader_reload_stats,
+     METH_NOARGS,
+     "Return the number of reloads and when the last one was"},
+    {"share",
+     Reader_share,
+     METH_NOARGS,
+     "Return another reader of the same database that may be closed on its "
+     "own"},
+    {"warm",
+     (PyCFunction)(void (*)(void))Reader_warm,
+     METH_VARARGS | METH_KEYWORDS,
+     "Read the search tree and data section into memory"},
+    {"residency",
+     Reader_residency,
+     METH_NOARGS,
+     "Return the fraction of the search tree and data section in memory"},
     {"close", Reader_close, METH_NOARGS, "Closes database"},
     {"__exit__",
      Reader__exit__,
@@ -631,27 +5900,49 @@ static PyMethodDef Reader_methods[] = {
      "Called when entering a with-context."},
     {NULL, NULL, 0, NULL}};
 
+// The specs give the names shown in error messages, which, as with the static
+// types these replace and the pure Python classes, do not include the module.
+// Without a dotted name, creating a type warns that it has no __module__
+// unless its dict already has one, so each type has this placeholder, which
+// type_from_spec replaces with the module's name.
+#define MODULE_PLACEHOLDER(type, member)                                       \
+    {"__module__", T_OBJECT, offsetof(type, member), READONLY, NULL}
+
 static PyMemberDef Reader_members[] = {
+    MODULE_PLACEHOLDER(Reader_obj, module),
     {"closed", T_OBJECT, offsetof(Reader_obj, closed), READONLY, NULL},
+#if PY_VERSION_HEX >= 0x03090000
+    {"__weaklistoffset__",
+     T_PYSSIZET,
+     offsetof(Reader_obj, weakreflist),
+     READONLY,
+     NULL},
+#endif
     {NULL, 0, 0, 0, NULL}};
 
-// clang-format off
-static PyTypeObject Reader_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_basicsize = sizeof(Reader_obj),
-    .tp_dealloc = Reader_dealloc,
-    .tp_doc = "Reader object",
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_methods = Reader_methods,
-    .tp_members = Reader_members,
-    .tp_name = "Reader",
-    .tp_init = Reader_init,
+static PyType_Slot Reader_slots[] = {
+    {Py_tp_dealloc, Reader_dealloc},
+    {Py_tp_doc,
+     "Reader object\n\n"
+     "threads, the number of native threads that may split a large batch, "
+     "is limited to the number of CPUs."},
+    {Py_tp_init, Reader_init},
+    {Py_tp_members, Reader_members},
+    {Py_tp_methods, Reader_methods},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}};
+
+static PyType_Spec Reader_spec = {
+    .name = "Reader",
+    .basicsize = sizeof(Reader_obj),
+    .flags = Py_TPFLAGS_DEFAULT,
+    .slots = Reader_slots,
 };
-// clang-format on
 
 static PyMethodDef Metadata_methods[] = {{NULL, NULL, 0, NULL}};
 
 static PyMemberDef Metadata_members[] = {
+    MODULE_PLACEHOLDER(Metadata_obj, database_type),
     {"binary_format_major_version",
      T_OBJECT,
      offsetof(Metadata_obj, binary_format_major_version),
@@ -695,66 +5986,314 @@ static PyMemberDef Metadata_members[] = {
      NULL},
     {NULL, 0, 0, 0, NULL}};
 
-// clang-format off
-static PyTypeObject Metadata_Type = {
-    PyVarObject_HEAD_INIT(NULL, 0)
-    .tp_basicsize = sizeof(Metadata_obj),
-    .tp_dealloc = Metadata_dealloc,
-    .tp_doc = "Metadata object",
-    .tp_flags = Py_TPFLAGS_DEFAULT,
-    .tp_members = Metadata_members,
-    .tp_methods = Metadata_methods,
-    .tp_name = "Metadata",
-    .tp_init = Metadata_init};
-// clang-format on
+static PyType_Slot Metadata_slots[] = {
+    {Py_tp_dealloc, Metadata_dealloc},
+    {Py_tp_doc, "Metadata object"},
+    {Py_tp_init, Metadata_init},
+    {Py_tp_members, Metadata_members},
+    {Py_tp_methods, Metadata_methods},
+    {Py_tp_new, PyType_GenericNew},
+    {0, NULL}};
 
-static PyMethodDef MaxMindDB_methods[] = {{NULL, NULL, 0, NULL}};
+static PyType_Spec Metadata_spec = {
+    .name = "Metadata",
+    .basicsize = sizeof(Metadata_obj),
+    .flags = Py_TPFLAGS_DEFAULT,
+    .slots = Metadata_slots,
+};
 
-static struct PyModuleDef MaxMindDB_module = {
-    PyModuleDef_HEAD_INIT,
-    .m_name = "extension",
-    .m_doc = "This is a C extension to read MaxMind DB file format",
-    .m_methods = MaxMindDB_methods,
+static PyMethodDef LazyRecord_methods[] = {
+    {"get",
+     LazyRecord_get,
+     METH_VARARGS,
+     "Return the value for key if key is in the map, else default"},
+    {"items",
+     LazyRecord_items,
+     METH_NOARGS,
+     "Return a list of the (key, value) pairs in the map"},
+    {"keys", LazyRecord_keys, METH_NOARGS, "Return a list of the map's keys"},
+    {"values",
+     LazyRecord_values,
+     METH_NOARGS,
+     "Return a list of the map's values"},
+    {NULL, NULL, 0, NULL}};
+
+static PyMemberDef LazyRecord_members[] = {
+    MODULE_PLACEHOLDER(LazyRecord_obj, values),
+    {NULL, 0, 0, 0, NULL}};
+
+static PyType_Slot LazyRecord_slots[] = {
+    {Py_mp_length, LazyRecord_length},
+    {Py_mp_subscript, LazyRecord_subscript},
+    {Py_sq_contains, LazyRecord_contains},
+    {Py_tp_clear, LazyRecord_clear},
+    {Py_tp_dealloc, LazyRecord_dealloc},
+    {Py_tp_doc, "Map from a MaxMind DB record that is decoded on access"},
+    {Py_tp_hash, PyObject_HashNotImplemented},
+    {Py_tp_iter, LazyRecord_iter},
+    {Py_tp_members, LazyRecord_members},
+    {Py_tp_methods, LazyRecord_methods},
+    {Py_tp_repr, LazyRecord_repr},
+    {Py_tp_richcompare, LazyRecord_richcompare},
+    {Py_tp_traverse, LazyRecord_traverse},
+    {0, NULL}};
+
+// Lazy records are only created by readers.
+#ifdef Py_TPFLAGS_DISALLOW_INSTANTIATION
+#define LAZY_RECORD_FLAGS                                                      \
+    (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC |                                 \
+     Py_TPFLAGS_DISALLOW_INSTANTIATION)
+#define DATA_SECTION_FLAGS                                                     \
+    (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION)
+#else
+#define LAZY_RECORD_FLAGS (Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC)
+#define DATA_SECTION_FLAGS Py_TPFLAGS_DEFAULT
+#endif
+
+static PyType_Spec LazyRecord_spec = {
+    .name = "LazyRecord",
+    .basicsize = sizeof(LazyRecord_obj),
+    .flags = LAZY_RECORD_FLAGS,
+    .slots = LazyRecord_slots,
 };
 
-PyMODINIT_FUNC PyInit_extension(void) {
-    PyObject *m;
+static PyMemberDef DataSection_members[] = {
+    MODULE_PLACEHOLDER(DataSection_obj, handle),
+    {NULL, 0, 0, 0, NULL}};
 
-    m = PyModule_Create(&MaxMindDB_module);
+static PyType_Slot DataSection_slots[] = {
+#if PY_VERSION_HEX >= 0x03090000
+    {Py_bf_getbuffer, DataSection_getbuffer},
+    {Py_bf_releasebuffer, DataSection_releasebuffer},
+#endif
+    {Py_tp_dealloc, DataSection_dealloc},
+    {Py_tp_doc, "The data section of a MaxMind DB, for get_raw views"},
+    {Py_tp_members, DataSection_members},
+    {0, NULL}};
+
+// Only databases create these.
+static PyType_Spec DataSection_spec = {
+    .name = "DataSection",
+    .basicsize = sizeof(DataSection_obj),
+    .flags = DATA_SECTION_FLAGS,
+    .slots = DataSection_slots,
+};
+
+static PyMethodDef MaxMindDB_methods[] = {
+    {"decode_raw",
+     decode_raw,
+     METH_VARARGS,
+     "Decode a record in the MaxMind DB encoding, as returned by get_raw"},
+    {NULL, NULL, 0, NULL}};
 
-    if (!m) {
+// Returns a borrowed reference to the module that created type, or the
+// extension type it derives from.
+static PyObject *type_module(PyTypeObject *type) {
+#if PY_VERSION_HEX >= 0x030B0000
+    return PyType_GetModuleByDef(type, &MaxMindDB_module);
+#elif PY_VERSION_HEX >= 0x03090000
+    // The extension's types cannot be subclassed.
+    return PyType_GetModule(type);
+#else
+    // Types cannot be associated with a module before Python 3.9, so the
+    // module is looked up in sys.modules, which keeps it alive, instead.
+    (void)type;
+    PyObject *name = PyUnicode_FromString("maxminddb.extension");
+    if (NULL == name) {
         return NULL;
     }
-
-    Reader_Type.tp_new = PyType_GenericNew;
-    if (PyType_Ready(&Reader_Type)) {
+    PyObject *module = PyImport_GetModule(name);
+    Py_DECREF(name);
+    if (NULL == module) {
+        if (!PyErr_Occurred()) {
+            PyErr_SetString(PyExc_ImportError,
+                            "maxminddb.extension has not been imported");
+        }
+        return NULL;
+    }
+    Py_DECREF(module);
+    if (!PyModule_Check(module) ||
+        PyModule_GetDef(module) != &MaxMindDB_module) {
+        PyErr_SetString(PyExc_ImportError,
+                        "maxminddb.extension is not the extension module");
         return NULL;
     }
-    Py_INCREF(&Reader_Type);
-    PyModule_AddObject(m, "Reader", (PyObject *)&Reader_Type);
+    return module;
+#endif
+}
+
+static module_state_s *module_state(PyObject *module) {
+    return (module_state_s *)PyModule_GetState(module);
+}
+
+// Returns a borrowed reference to InvalidDatabaseError from the reader's
+// module. If the module cannot be found, its base class, RuntimeError, is
+// used instead.
+static PyObject *reader_error(const Reader_obj *reader) {
+    PyObject *module = reader->module;
+    if (NULL == module && NULL == (module = type_module(Py_TYPE(reader)))) {
+        PyErr_Clear();
+        return PyExc_RuntimeError;
+    }
+    return module_state(module)->error;
+}
+
+// Adds a new reference to obj to the module.
+static int module_add(PyObject *module, const char *name, PyObject *obj) {
+    Py_INCREF(obj);
+    if (PyModule_AddObject(module, name, obj) == -1) {
+        Py_DECREF(obj);
+        return -1;
+    }
+    return 0;
+}
 
-    Metadata_Type.tp_new = PyType_GenericNew;
-    if (PyType_Ready(&Metadata_Type)) {
+static PyTypeObject *type_from_spec(PyObject *module, PyType_Spec *spec) {
+#if PY_VERSION_HEX >= 0x03090000
+    PyTypeObject *type =
+        (PyTypeObject *)PyType_FromModuleAndSpec(module, spec, NULL);
+#else
+    // Before Python 3.9, only a dotted name keeps PyType_FromSpec from
+    // warning, so the type is created with its qualified name and then
+    // given the spec's.
+    char name[64];
+    PyOS_snprintf(name, sizeof(name), "maxminddb.extension.%s", spec->name);
+    PyType_Spec qualified = *spec;
+    qualified.name = name;
+    PyTypeObject *type = (PyTypeObject *)PyType_FromSpec(&qualified);
+    if (NULL != type) {
+        type->tp_name = spec->name;
+    }
+#endif
+    if (NULL == type) {
+        return NULL;
+    }
+    PyObject *module_name = PyModule_GetNameObject(module);
+    if (NULL == module_name ||
+        PyObject_SetAttrString((PyObject *)type, "__module__", module_name) ==
+            -1) {
+        Py_XDECREF(module_name);
+        Py_DECREF(type);
         return NULL;
     }
-    PyModule_AddObject(m, "Metadata", (PyObject *)&Metadata_Type);
+    Py_DECREF(module_name);
+#if PY_VERSION_HEX < 0x03090000
+    // Buffer slots and the weak reference offset cannot be given in a spec
+    // before Python 3.9.
+    if (spec == &Reader_spec) {
+        type->tp_weaklistoffset = offsetof(Reader_obj, weakreflist);
+    }
+    if (spec == &DataSection_spec) {
+        type->tp_as_buffer->bf_getbuffer = DataSection_getbuffer;
+        type->tp_as_buffer->bf_releasebuffer = DataSection_releasebuffer;
+    }
+#endif
+#ifndef Py_TPFLAGS_DISALLOW_INSTANTIATION
+    if (spec == &LazyRecord_spec || spec == &DataSection_spec) {
+        type->tp_new = NULL;
+    }
+#endif
+    return type;
+}
 
-    PyObject *error_mod = PyImport_ImportModule("maxminddb.errors");
-    if (error_mod == NULL) {
+// Returns a new reference to the attribute of the named module.
+static PyObject *module_attr(const char *module_name, const char *name) {
+    PyObject *module = PyImport_ImportModule(module_name);
+    if (NULL == module) {
         return NULL;
     }
+    PyObject *attr = PyObject_GetAttrString(module, name);
+    Py_DECREF(module);
+    return attr;
+}
 
-    MaxMindDB_error = PyObject_GetAttrString(error_mod, "InvalidDatabaseError");
-    Py_DECREF(error_mod);
+static int extension_exec(PyObject *m) {
+    module_state_s *state = module_state(m);
 
-    if (MaxMindDB_error == NULL) {
-        return NULL;
+    state->reader_type = type_from_spec(m, &Reader_spec);
+    state->metadata_type = type_from_spec(m, &Metadata_spec);
+    state->lazy_record_type = type_from_spec(m, &LazyRecord_spec);
+    state->data_section_type = type_from_spec(m, &DataSection_spec);
+    if (NULL == state->reader_type || NULL == state->metadata_type ||
+        NULL == state->lazy_record_type || NULL == state->data_section_type) {
+        return -1;
+    }
+    if (module_add(m, "Reader", (PyObject *)state->reader_type) == -1 ||
+        module_add(m, "Metadata", (PyObject *)state->metadata_type) == -1 ||
+        module_add(m, "LazyRecord", (PyObject *)state->lazy_record_type) ==
+            -1) {
+        return -1;
     }
 
-    Py_INCREF(MaxMindDB_error);
+    state->error = module_attr("maxminddb.errors", "InvalidDatabaseError");
+    state->column_type = module_attr("maxminddb.types", "Column");
+    // This is imported here rather than when a compressed database is first
+    // opened, as the module state may be shared by threads without the GIL.
+    state->compression = PyImport_ImportModule("maxminddb.compression");
+    if (state->error == NULL || state->column_type == NULL ||
+        state->compression == NULL) {
+        return -1;
+    }
+    if (NULL == (state->pool = worker_pool_new())) {
+        PyErr_NoMemory();
+        return -1;
+    }
 
     /* We primarily add it to the module for backwards compatibility */
-    PyModule_AddObject(m, "InvalidDatabaseError", MaxMindDB_error);
+    return module_add(m, "InvalidDatabaseError", state->error);
+}
+
+static int extension_traverse(PyObject *m, visitproc visit, void *arg) {
+    module_state_s *state = module_state(m);
+    Py_VISIT(state->reader_type);
+    Py_VISIT(state->metadata_type);
+    Py_VISIT(state->lazy_record_type);
+    Py_VISIT(state->data_section_type);
+    Py_VISIT(state->error);
+    Py_VISIT(state->column_type);
+    Py_VISIT(state->compression);
+    return 0;
+}
 
-    return m;
+static int extension_clear(PyObject *m) {
+    module_state_s *state = module_state(m);
+    Py_CLEAR(state->reader_type);
+    Py_CLEAR(state->metadata_type);
+    Py_CLEAR(state->lazy_record_type);
+    Py_CLEAR(state->data_section_type);
+    Py_CLEAR(state->error);
+    Py_CLEAR(state->column_type);
+    Py_CLEAR(state->compression);
+    return 0;
+}
+
+static void extension_free(void *m) {
+    extension_clear((PyObject *)m);
+    worker_pool_free(module_state((PyObject *)m)->pool);
+}
+
+static PyModuleDef_Slot MaxMindDB_slots[] = {
+    {Py_mod_exec, extension_exec},
+#ifdef Py_mod_multiple_interpreters
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#ifdef Py_mod_gil
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}};
+
+static struct PyModuleDef MaxMindDB_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "extension",
+    .m_doc = "This is a C extension to read MaxMind DB file format",
+    .m_size = sizeof(module_state_s),
+    .m_methods = MaxMindDB_methods,
+    .m_slots = MaxMindDB_slots,
+    .m_traverse = extension_traverse,
+    .m_clear = extension_clear,
+    .m_free = extension_free,
+};
+
+PyMODINIT_FUNC PyInit_extension(void) {
+    return PyModuleDef_Init(&MaxMindDB_module);
 }
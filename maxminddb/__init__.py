@@ -1,17 +1,24 @@
 # pylint:disable=C0111
 import os
-from typing import IO, AnyStr, Union, cast
+import threading
+import weakref
+from collections.abc import Mapping
+from typing import IO, Any, AnyStr, Dict, Iterable, Optional, Tuple, Union, cast
 
+from . import compression
 from .const import (
     MODE_AUTO,
     MODE_FD,
     MODE_FILE,
+    MODE_HYBRID,
     MODE_MEMORY,
     MODE_MMAP,
     MODE_MMAP_EXT,
 )
-from .decoder import InvalidDatabaseError
+from .decoder import InvalidDatabaseError, decode_raw as _decode_raw
 from .reader import Reader
+from .shared import SharedDatabase, shared_path
+from .types import Record
 
 try:
     # pylint: disable=import-self
@@ -19,65 +26,292 @@ try:
 except ImportError:
     _extension = None  # type: ignore[assignment]
 
+if _extension and hasattr(_extension, "LazyRecord"):
+    Mapping.register(_extension.LazyRecord)
+
 
 __all__ = [
     "InvalidDatabaseError",
     "MODE_AUTO",
     "MODE_FD",
     "MODE_FILE",
+    "MODE_HYBRID",
     "MODE_MEMORY",
     "MODE_MMAP",
     "MODE_MMAP_EXT",
     "Reader",
+    "SharedDatabase",
+    "decode_raw",
     "open_database",
+    "open_shared",
 ]
 
 
 def open_database(
-    database: Union[AnyStr, int, os.PathLike, IO],
+    database: Union[AnyStr, int, os.PathLike, IO, bytearray, memoryview],
     mode: int = MODE_AUTO,
+    *,
+    immutable: bool = False,
+    materialize: Union[bool, str] = False,
+    specialize: bool = False,
+    typed: bool = False,
+    threads: int = 1,
+    cache: int = 0,
+    watch: bool = False,
+    prefault: bool = False,
+    advice: Union[None, str, Iterable[str]] = None,
+    mlock_tree: bool = False,
+    share: bool = False,
 ) -> Reader:
     """Open a MaxMind DB database
 
     Arguments:
         database -- A path to a valid MaxMind DB file such as a GeoIP2 database
-                    file, or a file descriptor in the case of MODE_FD.
+                    file, or a file descriptor in the case of MODE_FD. With
+                    MODE_AUTO and MODE_MEMORY, this may also be a buffer,
+                    such as a bytearray, memoryview or mmap, holding the
+                    database. bytes are a path unless they contain a NUL
+                    byte, as every database does. The C extension reads a
+                    buffer in place, so it must not be changed while the
+                    reader is open. A path, descriptor or buffer may be
+                    compressed with gzip or zstd, in which case the database
+                    is decompressed into an anonymous file in memory. A
+                    descriptor is then read from the start of its file.
+                    Anything following the compressed data is an error.
         mode -- mode to open the database with. Valid mode are:
             * MODE_MMAP_EXT - use the C extension with memory map.
             * MODE_MMAP - read from memory map. Pure Python.
             * MODE_FILE - read database as standard file. Pure Python.
-            * MODE_MEMORY - load database into memory. Pure Python.
-            * MODE_FD - the param passed via database is a file descriptor, not
-                        a path. This mode implies MODE_MEMORY.
+            * MODE_MEMORY - load database into memory. Uses the C extension
+                            if available.
+            * MODE_FD - the param passed via database is a file descriptor or
+                        a file object, not a path. The C extension maps the
+                        file directly if it is a regular file. Otherwise,
+                        this mode implies MODE_MEMORY.
+            * MODE_HYBRID - use the C extension with memory map, but with
+                            the search tree copied into anonymous memory
+                            backed by transparent huge pages where the
+                            platform allows it. Linux only.
             * MODE_AUTO - tries MODE_MMAP_EXT, MODE_MMAP, MODE_FILE in that
                           order. Default mode.
+        immutable -- if true, records are returned as deeply immutable
+                     objects that may be safely shared: maps are read-only
+                     mappings, arrays are tuples and binary data is bytes.
+        materialize -- if true, every record is decoded when the database is
+                       opened and lookups return the same shared immutable
+                       record object. If "auto", this is only done for
+                       databases with a small data section. Implies
+                       immutable.
+        specialize -- if true, records are decoded with a decoder specialized
+                      to the structure observed in a sample of the records.
+                      Records that do not match it are decoded as usual.
+        typed -- if true, maps are returned as read-only instances of record
+                 classes generated from the structure of every record in
+                 the database, e.g., record.country.iso_code. Maps whose
+                 keys are not valid attribute names remain dicts.
+        threads -- the number of native threads the C extension may use for
+                   large lookup_buffer and get_many_text batches, at most
+                   the number of CPUs. The pure Python reader always uses
+                   the calling thread.
+        cache -- the number of decoded records to keep and return again
+                 when another lookup resolves to the same record. Cached
+                 records are shared, so this implies immutable. The C
+                 extension's cache is sharded and set associative, with
+                 clock eviction, and may round the number up. The pure
+                 Python reader's cache has a single lock and evicts the
+                 oldest record first.
+        watch -- if true, the database is reloaded in a background thread
+                 when its file is replaced or rewritten, as seen with
+                 inotify on Linux and by polling elsewhere. Requires a path.
+        prefault -- if true, the whole file is read into memory when it is
+                    opened, so that the first lookups do not wait for page
+                    faults.
+        advice -- a madvise hint, or hints, for the memory map: "normal",
+                  "random", "sequential", "willneed" or, on Linux,
+                  "hugepage". Advice that the kernel rejects is ignored
+                  with a RuntimeWarning.
+        mlock_tree -- if true, the C extension locks the search tree in
+                      memory with mlock. This may need a higher
+                      RLIMIT_MEMLOCK; if the lock fails, the tree is left
+                      unlocked with a RuntimeWarning. The pure Python reader
+                      ignores it.
+        share -- if true, and another reader opened with share=True from
+                 the same file, unchanged since, with the same mode and
+                 options is still open, the database is shared with it, as
+                 with Reader.share, rather than opened again. Each reader is
+                 still closed on its own. Requires a path and may not be
+                 combined with watch.
     """
     if mode not in (
         MODE_AUTO,
         MODE_FD,
         MODE_FILE,
+        MODE_HYBRID,
         MODE_MEMORY,
         MODE_MMAP,
         MODE_MMAP_EXT,
     ):
         raise ValueError(f"Unsupported open mode: {mode}")
 
+    if advice is not None and not isinstance(advice, str):
+        advice = tuple(advice)
+    if share:
+        return _open_shared_reader(
+            database,
+            mode,
+            immutable=immutable,
+            materialize=materialize,
+            specialize=specialize,
+            typed=typed,
+            threads=threads,
+            cache=cache,
+            watch=watch,
+            prefault=prefault,
+            advice=advice,
+            mlock_tree=mlock_tree,
+        )
+
     has_extension = _extension and hasattr(_extension, "Reader")
-    use_extension = has_extension if mode == MODE_AUTO else mode == MODE_MMAP_EXT
+    if mode in (MODE_AUTO, MODE_MEMORY, MODE_FD):
+        use_extension = has_extension
+    else:
+        use_extension = mode in (MODE_MMAP_EXT, MODE_HYBRID)
 
     if not use_extension:
-        return Reader(database, mode)
+        return Reader(
+            database,
+            mode,
+            immutable=immutable,
+            materialize=materialize,
+            specialize=specialize,
+            typed=typed,
+            threads=threads,
+            cache=cache,
+            watch=watch,
+            prefault=prefault,
+            advice=advice,
+            mlock_tree=mlock_tree,
+        )
 
     if not has_extension:
+        name = "MODE_HYBRID" if mode == MODE_HYBRID else "MODE_MMAP_EXT"
         raise ValueError(
-            "MODE_MMAP_EXT requires the maxminddb.extension module to be available"
+            f"{name} requires the maxminddb.extension module to be available"
         )
 
     # The C type exposes the same API as the Python Reader, so for type
     # checking purposes, pretend it is one. (Ideally this would be a subclass
     # of, or share a common parent class with, the Python Reader
     # implementation.)
-    return cast(Reader, _extension.Reader(database, mode))
+    return cast(
+        Reader,
+        _extension.Reader(
+            database,
+            mode,
+            immutable=immutable,
+            materialize=materialize,
+            specialize=specialize,
+            typed=typed,
+            threads=threads,
+            cache=cache,
+            watch=watch,
+            prefault=prefault,
+            advice=advice,
+            mlock_tree=mlock_tree,
+        ),
+    )
+
+
+# The readers opened with share=True, by the identity of their file, its
+# modification time and the mode and options they were opened with.
+_shared_readers: Dict[Tuple[Any, ...], "weakref.WeakSet[Reader]"] = {}
+_shared_readers_lock = threading.Lock()
+
+
+def _open_shared_reader(database: Any, mode: int, **options: Any) -> Reader:
+    if not compression.is_path(database):
+        raise ValueError("share requires a database path")
+    if options["watch"]:
+        raise ValueError("share may not be combined with watch")
+
+    st = os.stat(database)
+    key = (
+        st.st_dev,
+        st.st_ino,
+        st.st_mtime_ns,
+        st.st_size,
+        mode,
+        tuple(sorted(options.items())),
+    )
+    with _shared_readers_lock:
+        shared = _share_reader(key)
+    if shared is not None:
+        return shared
+
+    # Opening the database may take a while, so it is done without the lock,
+    # and another thread may open the same database in the meantime. The
+    # first reader to be added is then shared and the others closed.
+    reader = open_database(database, mode, **options)
+    # The file may have been replaced while it was being opened.
+    st = os.stat(database)
+    if key[:4] != (st.st_dev, st.st_ino, st.st_mtime_ns, st.st_size):
+        return reader
+    with _shared_readers_lock:
+        shared = _share_reader(key)
+        if shared is None:
+            _shared_readers.setdefault(key, weakref.WeakSet()).add(reader)
+    if shared is None:
+        return reader
+    reader.close()
+    return shared
+
+
+def _share_reader(key: Tuple[Any, ...]) -> Optional[Reader]:
+    # Returns a reader sharing the database of an open reader with the key,
+    # if there is one. It is called with _shared_readers_lock held.
+    for stale in [k for k, readers in _shared_readers.items() if not readers]:
+        del _shared_readers[stale]
+    readers = _shared_readers.get(key, weakref.WeakSet())
+    for reader in list(readers):
+        # A reloaded reader no longer holds the database it was opened with.
+        if reader.closed or reader.reload_stats()["reloads"] > 0:
+            continue
+        try:
+            shared = reader.share()
+        except ValueError:
+            # The reader was closed by another thread.
+            continue
+        readers.add(shared)
+        return shared
+    return None
+
+
+def open_shared(name: str, mode: int = MODE_AUTO, **kwargs: Any) -> Reader:
+    """Open a database that a SharedDatabase copied into shared memory
+
+    The reader maps the pages of the shared copy, so it is not copied again.
+    The keyword arguments are as for open_database.
+
+    Arguments:
+        name -- the name that was given to the SharedDatabase
+        mode -- MODE_AUTO, MODE_MMAP_EXT, MODE_MMAP or MODE_HYBRID
+    """
+    if mode not in (MODE_AUTO, MODE_MMAP_EXT, MODE_MMAP, MODE_HYBRID):
+        raise ValueError(f"Unsupported open mode for a shared database: {mode}")
+    return open_database(shared_path(name), mode, **kwargs)
+
+
+def decode_raw(buf: Union[bytes, bytearray, memoryview]) -> Record:
+    """Decode a record in the MaxMind DB encoding, as returned by get_raw
+
+    The C extension is used if it is available.
+
+    Arguments:
+        buf -- the encoded record
+    """
+    if _extension and hasattr(_extension, "decode_raw"):
+        return _extension.decode_raw(buf)
+    return _decode_raw(buf)
 
 
 __title__ = "maxminddb"
@@ -0,0 +1,132 @@
+"""
+maxminddb.aio
+~~~~~~~~~~~~~
+
+This module contains the asyncio support shared by the C extension and
+pure Python readers.
+
+"""
+import asyncio
+from ipaddress import IPv4Address, IPv6Address
+from typing import Any, Dict, Iterable, List, Optional, Tuple, Union
+
+from maxminddb.types import Record
+
+IPAddress = Union[str, IPv4Address, IPv6Address]
+_Result = Tuple[Optional[Record], Optional[Exception]]
+
+
+class _Batch:
+    """The single lookups made on a reader before the event loop next runs"""
+
+    def __init__(self, reader: Any) -> None:
+        self.reader = reader
+        self.addresses: List[IPAddress] = []
+        self.futures: List["asyncio.Future[Optional[Record]]"] = []
+
+
+# The pending batch for each event loop and reader. A batch is removed when
+# it is handed to the executor, so entries only live until the loop next
+# runs.
+_batches: Dict[Tuple[int, int], _Batch] = {}
+
+
+async def aget(reader: Any, ip_address: IPAddress) -> Optional[Record]:
+    """Return the record for the ip_address without blocking the event loop
+
+    Lookups made on the reader before the event loop next runs are looked up
+    together on the loop's default executor.
+
+    Arguments:
+    reader -- the reader to look the address up in
+    ip_address -- an IP address in the standard string notation
+    """
+    loop = asyncio.get_running_loop()
+    key = (id(loop), id(reader))
+    batch = _batches.get(key)
+    if batch is None:
+        batch = _batches[key] = _Batch(reader)
+        loop.call_soon(_run_batch, loop, key, batch)
+    future = loop.create_future()
+    batch.addresses.append(ip_address)
+    batch.futures.append(future)
+    return await future
+
+
+async def aget_many(
+    reader: Any, ip_addresses: Iterable[IPAddress]
+) -> List[Optional[Record]]:
+    """Return the records for the ip_addresses without blocking the event
+    loop
+
+    The addresses are looked up on the loop's default executor. The first
+    error for any of the addresses is raised.
+
+    Arguments:
+    reader -- the reader to look the addresses up in
+    ip_addresses -- IP addresses in the standard string notation
+    """
+    loop = asyncio.get_running_loop()
+    results = await loop.run_in_executor(
+        None, _lookup_many, reader, list(ip_addresses)
+    )
+    records = []
+    for record, error in results:
+        if error is not None:
+            raise error
+        records.append(record)
+    return records
+
+
+def _run_batch(
+    loop: asyncio.AbstractEventLoop, key: Tuple[int, int], batch: _Batch
+) -> None:
+    del _batches[key]
+    done = loop.run_in_executor(None, _lookup_many, batch.reader, batch.addresses)
+    done.add_done_callback(lambda done: _resolve(batch.futures, done))
+
+
+def _resolve(
+    futures: List["asyncio.Future[Optional[Record]]"],
+    done: "asyncio.Future[List[_Result]]",
+) -> None:
+    if done.cancelled():
+        for future in futures:
+            future.cancel()
+        return
+    error = done.exception()
+    results: List[_Result]
+    if error is None:
+        results = done.result()
+    else:
+        results = [(None, error)] * len(futures)  # type: ignore
+    for future, (record, record_error) in zip(futures, results):
+        if future.done():
+            # The awaiting task was cancelled.
+            continue
+        if record_error is None:
+            future.set_result(record)
+        else:
+            future.set_exception(record_error)
+
+
+def _lookup_many(reader: Any, addresses: List[IPAddress]) -> List[_Result]:
+    # get_many_text looks the addresses up without holding the GIL in the C
+    # extension, so the whole batch is tried with it first.
+    try:
+        records = reader.get_many_text(
+            "\n".join(str(address) for address in addresses).encode()
+        )
+        if len(records) == len(addresses):
+            return [(record, None) for record in records]
+    except Exception:  # pylint: disable=broad-except
+        pass
+
+    # Look the addresses up one at a time so that each gets its own error.
+    results: List[_Result] = []
+    for address in addresses:
+        try:
+            results.append((reader.get(address), None))
+        except Exception as ex:  # pylint: disable=broad-except
+            results.append((None, ex))
+    return results
@@ -0,0 +1,206 @@
+"""
+maxminddb.compression
+~~~~~~~~~~~~~~~~~~~~~
+
+This module decompresses gzip and zstd compressed databases into anonymous
+files for the readers to map. It is shared by the C extension and pure
+Python readers.
+
+"""
+import os
+import zlib
+from typing import IO, Any, Callable, Iterator, Optional, Tuple, Type
+
+from maxminddb.errors import InvalidDatabaseError
+from maxminddb.file import anonymous_file
+
+_GZIP_MAGIC = b"\x1f\x8b"
+_ZSTD_MAGIC = b"\x28\xb5\x2f\xfd"
+
+_CHUNK_SIZE = 1024 * 1024
+
+
+def compression(head: bytes) -> Optional[str]:
+    """Return "gzip" or "zstd" if head starts a compressed stream, else None"""
+    if head.startswith(_GZIP_MAGIC):
+        return "gzip"
+    if head.startswith(_ZSTD_MAGIC):
+        return "zstd"
+    return None
+
+
+def is_path(database: Any) -> bool:
+    """Return whether the database argument names a file rather than holding it
+
+    bytes are a path, as they are for open(), unless they contain a NUL byte,
+    which no path does and every MaxMind DB does.
+    """
+    return isinstance(database, (str, os.PathLike)) or (
+        isinstance(database, bytes) and b"\0" not in database
+    )
+
+
+def is_compressed(database: Any) -> bool:
+    """Return whether the database, a path, a descriptor or a buffer, is compressed
+
+    A descriptor is checked from the start of its file. Anything else, or a
+    file that cannot be read, is reported as not compressed, so that the
+    reader reports the error as usual.
+    """
+    if is_path(database):
+        try:
+            with open(database, "rb") as db_file:
+                head = db_file.read(len(_ZSTD_MAGIC))
+        except OSError:
+            return False
+    elif isinstance(database, int):
+        try:
+            head = os.pread(database, len(_ZSTD_MAGIC), 0)
+        except OSError:
+            return False
+    else:
+        try:
+            head = bytes(memoryview(database).cast("B")[: len(_ZSTD_MAGIC)])
+        except (TypeError, ValueError):
+            return False
+    return compression(head) is not None
+
+
+def decompress_to_file(database: Any) -> int:
+    """Decompress the database into a new anonymous file
+
+    The database is read and written in chunks, so neither it nor the
+    result is held in memory as a whole. The caller owns the returned
+    descriptor.
+
+    Arguments:
+        database -- a path to a gzip or zstd compressed MaxMind DB file, a
+                    descriptor of such a file, which is read from its start
+                    without moving its offset, a binary file object to read
+                    it from, or a buffer holding it.
+    """
+    fd, _ = anonymous_file()
+    try:
+        with open(fd, "wb", closefd=False) as destination:
+            write_decompressed(database, destination)
+    except BaseException:
+        os.close(fd)
+        raise
+    return fd
+
+
+def write_decompressed(database: Any, destination: IO[bytes]) -> None:
+    """Write the database, decompressed if it is compressed, to destination
+
+    Arguments:
+        database -- a path, a descriptor, a binary file object or a buffer,
+                    as for decompress_to_file
+        destination -- a binary file object to write to
+    """
+    if is_path(database):
+        with open(database, "rb") as source:
+            _decompress(_read_chunks(source), destination.write)
+    elif isinstance(database, int):
+        _decompress(_pread_chunks(database), destination.write)
+    elif hasattr(database, "read"):
+        _decompress(_read_chunks(database), destination.write)
+    else:
+        view = memoryview(database).cast("B")
+        _decompress(
+            (
+                bytes(view[i : i + _CHUNK_SIZE])
+                for i in range(0, len(view), _CHUNK_SIZE)
+            ),
+            destination.write,
+        )
+
+
+def _read_chunks(source: IO[bytes]) -> Iterator[bytes]:
+    while True:
+        chunk = source.read(_CHUNK_SIZE)
+        if not chunk:
+            return
+        yield chunk
+
+
+def _pread_chunks(fd: int) -> Iterator[bytes]:
+    offset = 0
+    while True:
+        chunk = os.pread(fd, _CHUNK_SIZE, offset)
+        if not chunk:
+            return
+        offset += len(chunk)
+        yield chunk
+
+
+def _decompress(chunks: Iterator[bytes], write: Callable[[bytes], Any]) -> None:
+    # Input that is not compressed is written as it is. Compressed input
+    # may be several concatenated streams, as gzip and zstd allow, but
+    # nothing else may follow them.
+    first = next(chunks, b"")
+    if compression(first) is None:
+        write(first)
+        for chunk in chunks:
+            write(chunk)
+        return
+
+    decompressor: Any = None
+    error: Any = None
+    rest = b""
+    for chunk in _prepend(first, chunks):
+        chunk = rest + chunk
+        rest = b""
+        while chunk:
+            if decompressor is None:
+                if len(chunk) < len(_ZSTD_MAGIC):
+                    # Too short to tell whether another stream starts here.
+                    rest = chunk
+                    break
+                kind = compression(chunk)
+                if kind is None:
+                    raise InvalidDatabaseError(
+                        "The compressed database has trailing data"
+                    )
+                decompressor, error = _decompressor(kind)
+            try:
+                write(decompressor.decompress(chunk))
+            except error as ex:
+                raise InvalidDatabaseError(
+                    f"The compressed database is corrupt ({ex})"
+                ) from ex
+            if not decompressor.eof:
+                break
+            chunk = decompressor.unused_data
+            decompressor = None
+    if decompressor is not None:
+        raise InvalidDatabaseError("The compressed database is truncated")
+    if rest:
+        raise InvalidDatabaseError("The compressed database has trailing data")
+
+
+def _prepend(first: bytes, chunks: Iterator[bytes]) -> Iterator[bytes]:
+    yield first
+    yield from chunks
+
+
+def _decompressor(kind: str) -> Tuple[Any, Type[Exception]]:
+    # Returns a decompressor for the stream and the exception it raises for
+    # corrupt input.
+    if kind == "gzip":
+        return zlib.decompressobj(16 + zlib.MAX_WBITS), zlib.error
+    try:
+        # pylint: disable=import-outside-toplevel
+        from compression import zstd  # type: ignore
+
+        return zstd.ZstdDecompressor(), zstd.ZstdError
+    except ImportError:
+        pass
+    try:
+        # pylint: disable=import-outside-toplevel
+        import zstandard  # type: ignore
+    except ImportError as ex:
+        raise ValueError(
+            "Opening a zstd compressed database requires Python 3.14 or the "
+            "zstandard package"
+        ) from ex
+    return zstandard.ZstdDecompressor().decompressobj(), zstandard.ZstdError
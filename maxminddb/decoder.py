@@ -6,7 +6,9 @@ This package contains code for decoding the MaxMind DB data section.
 
 """
 import struct
-from typing import cast, Dict, List, Tuple, Union
+from collections.abc import Mapping
+from types import MappingProxyType
+from typing import cast, Any, Dict, Iterator, List, Optional, Sequence, Tuple, Union
 
 try:
     # pylint: disable=unused-import
@@ -29,6 +31,8 @@ class Decoder:  # pylint: disable=too-few-public-methods
         database_buffer: Union[FileBuffer, "mmap.mmap", bytes],
         pointer_base: int = 0,
         pointer_test: bool = False,
+        immutable: bool = False,
+        specialize: bool = False,
     ) -> None:
         """Created a Decoder for a MaxMind DB
 
@@ -36,8 +40,14 @@ class Decoder:  # pylint: disable=too-few-public-methods
         database_buffer -- an mmap'd MaxMind DB file.
         pointer_base -- the base number to use when decoding a pointer
         pointer_test -- used for internal unit testing of pointer code
+        immutable -- decode maps as read-only mappings and arrays as tuples
+        specialize -- reuse the key objects of maps whose keys are stored at
+                      the same location, as is the case for keys shared
+                      through pointers
         """
         self._pointer_test = pointer_test
+        self._immutable = immutable
+        self._keys: Optional[Dict[int, Tuple[str, int]]] = {} if specialize else None
         self._buffer = database_buffer
         self._pointer_base = pointer_base
 
@@ -46,6 +56,8 @@ class Decoder:  # pylint: disable=too-few-public-methods
         for _ in range(size):
             (value, offset) = self.decode(offset)
             array.append(value)
+        if self._immutable:
+            return tuple(array), offset  # type: ignore[return-value]
         return array, offset
 
     def _decode_boolean(self, size: int, offset: int) -> Tuple[bool, int]:
@@ -83,12 +95,41 @@ class Decoder:  # pylint: disable=too-few-public-methods
     def _decode_map(self, size: int, offset: int) -> Tuple[Dict[str, Record], int]:
         container: Dict[str, Record] = {}
         for _ in range(size):
-            (key, offset) = self.decode(offset)
+            (key, offset) = self._decode_key(offset)
             (value, offset) = self.decode(offset)
             container[cast(str, key)] = value
+        if self._immutable:
+            return MappingProxyType(container), offset  # type: ignore[return-value]
         return container, offset
 
+    def _decode_key(self, offset: int) -> Tuple[Record, int]:
+        keys = self._keys
+        if keys is None:
+            return self.decode(offset)
+
+        (type_num, size, new_offset) = self._read_header(offset)
+        if type_num == 1:
+            (pointer, new_offset) = self._read_pointer(size, new_offset)
+            (key, _) = self._decode_key(pointer)
+            return key, new_offset
+
+        try:
+            return keys[offset]
+        except KeyError:
+            pass
+        (key, new_offset) = self.decode(offset)
+        if isinstance(key, str):
+            keys[offset] = (key, new_offset)
+        return key, new_offset
+
     def _decode_pointer(self, size: int, offset: int) -> Tuple[Record, int]:
+        (pointer, new_offset) = self._read_pointer(size, offset)
+        if self._pointer_test:
+            return pointer, new_offset
+        (value, _) = self.decode(pointer)
+        return value, new_offset
+
+    def _read_pointer(self, size: int, offset: int) -> Tuple[int, int]:
         pointer_size = (size >> 3) + 1
 
         buf = self._buffer[offset : offset + pointer_size]
@@ -106,10 +147,7 @@ class Decoder:  # pylint: disable=too-few-public-methods
         else:
             pointer = struct.unpack(b"!I", buf)[0] + self._pointer_base
 
-        if self._pointer_test:
-            return pointer, new_offset
-        (value, _) = self.decode(pointer)
-        return value, new_offset
+        return pointer, new_offset
 
     def _decode_uint(self, size: int, offset: int) -> Tuple[int, int]:
         new_offset = offset + size
@@ -159,6 +197,160 @@ class Decoder:  # pylint: disable=too-few-public-methods
         (size, new_offset) = self._size_from_ctrl_byte(ctrl_byte, new_offset, type_num)
         return decoder(self, size, new_offset)
 
+    def decode_lazy(self, offset: int) -> Union["LazyRecord", Record]:
+        """Decode the value at offset, returning maps as LazyRecord objects
+
+        Unlike decode, this only returns the value and not the offset of the
+        next data structure.
+
+        Arguments:
+        offset -- the location of the data structure to decode
+        """
+        (type_num, size, new_offset) = self._read_header(offset)
+        if type_num == 1:
+            (pointer, _) = self._read_pointer(size, new_offset)
+            return self.decode_lazy(pointer)
+        if type_num == 7:
+            return LazyRecord(self, offset)
+        (value, _) = self.decode(offset)
+        return value
+
+    def map_value_offsets(self, offset: int) -> Dict[str, int]:
+        """Return a dict of the keys of the map at offset to the offsets of
+        their values. The values themselves are not decoded.
+
+        Arguments:
+        offset -- the location of the map
+        """
+        (type_num, size, new_offset) = self._read_header(offset)
+        if type_num == 1:
+            (pointer, _) = self._read_pointer(size, new_offset)
+            return self.map_value_offsets(pointer)
+        if type_num != 7:
+            raise InvalidDatabaseError(
+                f"Expected a map but found type number {type_num}"
+            )
+
+        offsets: Dict[str, int] = {}
+        for _ in range(size):
+            (key, new_offset) = self.decode(new_offset)
+            offsets[cast(str, key)] = new_offset
+            new_offset = self.skip(new_offset)
+        return offsets
+
+    def decode_path(
+        self, offset: int, path: Sequence[Union[str, int]]
+    ) -> Optional[Tuple[int, Record]]:
+        """Return the type number and value found by following path from the
+        data structure at offset, or None if the path does not exist
+
+        Arguments:
+        offset -- the location of the data structure
+        path -- the map keys and array indexes to follow
+        """
+        for key in path:
+            (type_num, size, new_offset) = self._read_header(offset)
+            if type_num == 1:
+                (offset, _) = self._read_pointer(size, new_offset)
+                (type_num, size, new_offset) = self._read_header(offset)
+            if type_num == 7:
+                value_offset = self.map_value_offsets(offset).get(str(key))
+                if value_offset is None:
+                    return None
+                offset = value_offset
+            elif type_num == 11:
+                try:
+                    index = int(key)
+                except ValueError:
+                    return None
+                if index < 0:
+                    index += size
+                if not 0 <= index < size:
+                    return None
+                offset = new_offset
+                for _ in range(index):
+                    offset = self.skip(offset)
+            else:
+                return None
+
+        (type_num, size, new_offset) = self._read_header(offset)
+        if type_num == 1:
+            (offset, _) = self._read_pointer(size, new_offset)
+            (type_num, _, _) = self._read_header(offset)
+        (value, _) = self.decode(offset)
+        return type_num, value
+
+    def skip(self, offset: int) -> int:
+        """Return the offset of the data structure following the one at
+        offset without decoding it. Pointers are not followed.
+
+        Arguments:
+        offset -- the location of the data structure to skip
+        """
+        (type_num, size, new_offset) = self._read_header(offset)
+        if type_num == 1:
+            return new_offset + (size >> 3) + 1
+        if type_num == 7:
+            size *= 2
+        elif type_num != 11:
+            # Booleans store their value in the size and have no payload.
+            return new_offset if type_num == 14 else new_offset + size
+        for _ in range(size):
+            new_offset = self.skip(new_offset)
+        return new_offset
+
+    def raw(self, offset: int) -> Union[bytes, memoryview]:
+        """Return the MaxMind DB encoding of the data structure at offset
+
+        If the data structure contains no pointers, a view of it is returned
+        when the buffer is bytes, which closing the reader does not affect.
+        Otherwise, it is
+        returned as bytes with every pointer replaced by the data it points
+        to, so that it may be decoded on its own with decode_raw.
+
+        Arguments:
+        offset -- the location of the data structure
+        """
+        (end, has_pointers) = self._raw(offset, None)
+        if not has_pointers:
+            # A memory map cannot be closed while views of it exist, so it
+            # is copied, as is a file.
+            if isinstance(self._buffer, bytes):
+                return memoryview(self._buffer)[offset:end]
+            return bytes(self._buffer[offset:end])
+        out = bytearray()
+        self._raw(offset, out)
+        return bytes(out)
+
+    def _raw(self, offset: int, out: Optional[bytearray]) -> Tuple[int, bool]:
+        (type_num, size, new_offset) = self._read_header(offset)
+        if type_num == 1:
+            (pointer, end) = self._read_pointer(size, new_offset)
+            if out is not None:
+                self._raw(pointer, out)
+            return end, True
+        if type_num in (7, 11):
+            if out is not None:
+                out += self._buffer[offset:new_offset]
+            has_pointers = False
+            for _ in range(size * 2 if type_num == 7 else size):
+                (new_offset, child_has_pointers) = self._raw(new_offset, out)
+                has_pointers = has_pointers or child_has_pointers
+            return new_offset, has_pointers
+        end = self.skip(offset)
+        if out is not None:
+            out += self._buffer[offset:end]
+        return end, False
+
+    def _read_header(self, offset: int) -> Tuple[int, int, int]:
+        new_offset = offset + 1
+        ctrl_byte = self._buffer[offset]
+        type_num = ctrl_byte >> 5
+        if not type_num:
+            (type_num, new_offset) = self._read_extended(new_offset)
+        (size, new_offset) = self._size_from_ctrl_byte(ctrl_byte, new_offset, type_num)
+        return type_num, size, new_offset
+
     def _read_extended(self, offset: int) -> Tuple[int, int]:
         next_byte = self._buffer[offset]
         type_num = next_byte + 7
@@ -200,3 +392,54 @@ class Decoder:  # pylint: disable=too-few-public-methods
         size_bytes = self._buffer[offset:new_offset]
         size = struct.unpack(b"!I", b"\x00" + size_bytes)[0] + 65821
         return size, new_offset
+
+
+def decode_raw(buf: Union[bytes, bytearray, memoryview]) -> Record:
+    """Decode a record in the MaxMind DB encoding, as returned by get_raw
+
+    Arguments:
+    buf -- the encoded record
+    """
+    if not buf:
+        raise InvalidDatabaseError("Unable to decode an empty raw record")
+    (record, _) = Decoder(bytes(buf)).decode(0)
+    return record
+
+
+class LazyRecord(Mapping):
+    """A map from the data section that is decoded as its keys are accessed
+
+    Each value is decoded on first access and memoized. Nested maps are also
+    returned as LazyRecord objects.
+    """
+
+    __slots__ = ("_decoder", "_offset", "_offsets", "_values")
+
+    def __init__(self, decoder: Decoder, offset: int) -> None:
+        self._decoder = decoder
+        self._offset = offset
+        self._offsets: Optional[Dict[str, int]] = None
+        self._values: Dict[str, Any] = {}
+
+    def _value_offsets(self) -> Dict[str, int]:
+        if self._offsets is None:
+            self._offsets = self._decoder.map_value_offsets(self._offset)
+        return self._offsets
+
+    def __getitem__(self, key: str) -> Any:
+        try:
+            return self._values[key]
+        except KeyError:
+            pass
+        value = self._decoder.decode_lazy(self._value_offsets()[key])
+        self._values[key] = value
+        return value
+
+    def __iter__(self) -> Iterator[str]:
+        return iter(self._value_offsets())
+
+    def __len__(self) -> int:
+        return len(self._value_offsets())
+
+    def __repr__(self) -> str:
+        return f"{self.__class__.__name__}({dict(self)!r})"
@@ -1,27 +1,102 @@
 from ipaddress import IPv4Address, IPv6Address
 from os import PathLike
-from typing import Any, AnyStr, IO, Mapping, Optional, Sequence, Text, Tuple, Union
+from typing import (
+    Any,
+    AnyStr,
+    Dict,
+    IO,
+    Iterable,
+    Iterator,
+    List,
+    Mapping,
+    Optional,
+    Sequence,
+    Text,
+    Tuple,
+    Union,
+)
 
 from maxminddb import MODE_AUTO
 from maxminddb.errors import InvalidDatabaseError as InvalidDatabaseError
-from maxminddb.types import Record
+from maxminddb.types import Column, Record
 
 class Reader:
     closed: bool = ...
     def __init__(
-        self, database: Union[AnyStr, int, PathLike, IO], mode: int = MODE_AUTO
+        self,
+        database: Union[AnyStr, int, PathLike, IO, bytearray, memoryview],
+        mode: int = MODE_AUTO,
+        *,
+        immutable: bool = False,
+        materialize: Union[bool, str] = False,
+        specialize: bool = False,
+        typed: bool = False,
+        threads: int = 1,
+        cache: int = 0,
+        watch: bool = False,
+        prefault: bool = False,
+        advice: Union[None, str, Iterable[str]] = None,
+        mlock_tree: bool = False,
     ) -> None: ...
     def close(self) -> None: ...
+    def reload(
+        self,
+        database: Union[
+            AnyStr, int, PathLike, IO, bytearray, memoryview, None
+        ] = ...,
+    ) -> None: ...
+    def reload_stats(self) -> Dict[str, Any]: ...
+    def share(self) -> "Reader": ...
+    def warm(self, *, tree: bool = True, data: bool = True) -> None: ...
+    def residency(self) -> Dict[str, float]: ...
     def get(
         self, ip_address: Union[str, IPv6Address, IPv4Address]
     ) -> Optional[Record]: ...
     def get_with_prefix_len(
         self, ip_address: Union[str, IPv6Address, IPv4Address]
     ) -> Tuple[Optional[Record], int]: ...
+    async def aget(
+        self, ip_address: Union[str, IPv6Address, IPv4Address]
+    ) -> Optional[Record]: ...
+    async def aget_many(
+        self, ip_addresses: Iterable[Union[str, IPv6Address, IPv4Address]]
+    ) -> List[Optional[Record]]: ...
+    def get_lazy(
+        self, ip_address: Union[str, IPv6Address, IPv4Address]
+    ) -> Optional[Union["LazyRecord", Record]]: ...
+    def get_raw(
+        self, ip_address: Union[str, IPv6Address, IPv4Address]
+    ) -> Optional[Union[bytes, memoryview]]: ...
+    def get_columns(
+        self,
+        ip_addresses: Sequence[Union[str, IPv6Address, IPv4Address]],
+        fields: Sequence[Union[str, Sequence[Union[str, int]]]],
+    ) -> Dict[Any, Column]: ...
+    def get_many_text(
+        self, buf: Union[bytes, bytearray, memoryview], delimiter: bytes = ...
+    ) -> List[Optional[Record]]: ...
+    def lookup_buffer(
+        self, addresses: Any, offsets: Any, prefix_lens: Any = None
+    ) -> int: ...
+    def decode_offset(self, offset: int) -> Record: ...
+    def get_json(
+        self,
+        ip_address: Union[str, IPv6Address, IPv4Address],
+        fields: Optional[Sequence[str]] = None,
+    ) -> Optional[bytes]: ...
+    def get_many_json(
+        self,
+        ip_addresses: Iterable[Union[str, IPv6Address, IPv4Address]],
+        fields: Optional[Sequence[str]] = None,
+    ) -> bytes: ...
     def metadata(self) -> "Metadata": ...
+    def materialize_stats(self) -> Optional[Dict[str, Union[int, float]]]: ...
+    def cache_stats(self) -> Optional[Dict[str, int]]: ...
     def __enter__(self) -> "Reader": ...
     def __exit__(self, *args) -> None: ...
 
+def decode_raw(buf: Union[bytes, bytearray, memoryview]) -> Record: ...
+
 class Metadata:
     @property
     def node_count(self) -> int: ...
@@ -42,3 +117,11 @@ class Metadata:
     @property
     def description(self) -> Mapping[Text, Text]: ...
     def __init__(self, **kwargs: Any) -> None: ...
+
+class LazyRecord(Mapping[str, Any]):
+    def __getitem__(self, key: str) -> Any: ...
+    def __iter__(self) -> Iterator[str]: ...
+    def __len__(self) -> int: ...
+    def keys(self) -> List[str]: ...  # type: ignore[override]
+    def values(self) -> List[Any]: ...  # type: ignore[override]
+    def items(self) -> List[Tuple[str, Any]]: ...  # type: ignore[override]
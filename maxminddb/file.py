@@ -1,7 +1,9 @@
-"""For internal use only. It provides a slice-like file reader."""
+"""For internal use only. It provides a slice-like file reader and anonymous
+files."""
 
 import os
-from typing import Union
+import tempfile
+from typing import Tuple, Union
 
 try:
     # pylint: disable=no-name-in-module
@@ -64,3 +66,20 @@ class FileBuffer:
             with self._lock:
                 self._handle.seek(offset)
                 return self._handle.read(buffersize)
+
+
+def anonymous_file() -> Tuple[int, bool]:
+    """Return a descriptor for a new file that has no name
+
+    The file is a memfd where possible, in which case it may be sealed, as
+    the second element of the returned tuple says.
+    """
+    if hasattr(os, "memfd_create"):
+        try:
+            flags = os.MFD_CLOEXEC | getattr(os, "MFD_ALLOW_SEALING", 0x0002)
+            return os.memfd_create("maxminddb", flags), True
+        except OSError:
+            pass
+    # The file is removed once the last descriptor for it is closed.
+    with tempfile.TemporaryFile() as file:
+        return os.dup(file.fileno()), False
@@ -11,17 +11,44 @@ except ImportError:
     # pylint: disable=invalid-name
     mmap = None  # type: ignore
 
+import array
+import base64
 import ipaddress
+import json
+import os
+import stat
 import struct
+import sys
+import threading
+import time
+import warnings
 from ipaddress import IPv4Address, IPv6Address
 from os import PathLike
-from typing import Any, AnyStr, IO, Optional, Tuple, Union
-
+from types import MappingProxyType
+from typing import (
+    Any,
+    AnyStr,
+    Dict,
+    IO,
+    Iterable,
+    Iterator,
+    List,
+    Mapping,
+    NamedTuple,
+    Optional,
+    Sequence,
+    Tuple,
+    Type,
+    Union,
+)
+
+from maxminddb import aio, compression
 from maxminddb.const import MODE_AUTO, MODE_MMAP, MODE_FILE, MODE_MEMORY, MODE_FD
-from maxminddb.decoder import Decoder
+from maxminddb.decoder import Decoder, LazyRecord
 from maxminddb.errors import InvalidDatabaseError
 from maxminddb.file import FileBuffer
-from maxminddb.types import Record
+from maxminddb.types import Column, Record, TypedRecord, typed_record_class
+from maxminddb.watch import Watcher
 
 
 class Reader:
@@ -32,28 +59,127 @@ class Reader:
 
     _DATA_SECTION_SEPARATOR_SIZE = 16
     _METADATA_START_MARKER = b"\xAB\xCD\xEFMaxMind.com"
+    # With materialize="auto", records are materialized when the data section
+    # is at most this many bytes.
+    _MATERIALIZE_AUTO_MAX_DATA_SECTION_SIZE = 4 * 1024 * 1024
 
     _buffer: Union[bytes, FileBuffer, "mmap.mmap"]
-    _ipv4_start: Optional[int] = None
+    _state: Optional["_State"] = None
+    _materialize_stats: Optional[Dict[str, Union[int, float]]] = None
+    _watcher: Optional[Watcher] = None
+    _reloads = 0
+    _last_reload: Optional[float] = None
+    _cache_carried_over = 0
+    _users: Optional["_Users"] = None
 
     def __init__(
-        self, database: Union[AnyStr, int, PathLike, IO], mode: int = MODE_AUTO
+        self,
+        database: Union[AnyStr, int, PathLike, IO, bytearray, memoryview],
+        mode: int = MODE_AUTO,
+        *,
+        immutable: bool = False,
+        materialize: Union[bool, str] = False,
+        specialize: bool = False,
+        typed: bool = False,
+        threads: int = 1,
+        cache: int = 0,
+        watch: bool = False,
+        prefault: bool = False,
+        advice: Union[None, str, Iterable[str]] = None,
+        mlock_tree: bool = False,
     ) -> None:
         """Reader for the MaxMind DB file format
 
         Arguments:
         database -- A path to a valid MaxMind DB file such as a GeoIP2 database
-                    file, or a file descriptor in the case of MODE_FD.
+                    file, or a file descriptor in the case of MODE_FD. With
+                    MODE_AUTO and MODE_MEMORY, this may also be a buffer,
+                    such as a bytearray, memoryview or mmap, holding the
+                    database, which this reader copies unless it is bytes.
+                    bytes are a path unless they contain a NUL byte, as
+                    every database does. A path or buffer may be compressed
+                    with gzip or zstd, in which case the database is
+                    decompressed into an anonymous file, which is memory
+                    mapped.
         mode -- mode to open the database with. Valid mode are:
             * MODE_MMAP - read from memory map.
             * MODE_FILE - read database as standard file.
             * MODE_MEMORY - load database into memory.
             * MODE_AUTO - tries MODE_MMAP and then MODE_FILE. Default.
-            * MODE_FD - the param passed via database is a file descriptor, not
-                        a path. This mode implies MODE_MEMORY.
+            * MODE_FD - the param passed via database is a file descriptor or
+                        a file object, not a path. A regular file is
+                        memory mapped. Otherwise, this mode implies
+                        MODE_MEMORY.
+        immutable -- if true, records are returned as deeply immutable
+                     objects: maps are read-only mappings, arrays are tuples
+                     and binary data is bytes.
+        materialize -- if true, every record is decoded when the database is
+                       opened and lookups return the same shared immutable
+                       record object. If "auto", this is only done for
+                       databases with a small data section. Implies
+                       immutable.
+        specialize -- if true, decoded map keys are reused between records.
+                      The C extension builds a decoder specialized to the
+                      structure of the records instead.
+        typed -- if true, maps are returned as instances of record classes
+                 generated from the structure of every record,
+                 e.g., record.country.iso_code.
+        threads -- the number of threads, at most the number of CPUs, the C
+                   extension may use for large batch lookups. This reader
+                   always uses the calling thread.
+        cache -- the number of decoded records to keep and share between
+                 lookups. Implies immutable. Unlike the C extension's
+                 sharded cache, this reader's cache has a single lock and
+                 evicts the record that was added first.
+        watch -- if true, the database is reloaded in a background thread
+                 when its file is replaced or rewritten. Requires a path.
+        prefault -- if true, the whole file is read into memory when it is
+                    opened.
+        advice -- a madvise hint, or hints, for the memory map, such as
+                  "random". Only used with MODE_MMAP. Advice that the kernel
+                  rejects is ignored with a RuntimeWarning.
+        mlock_tree -- if true, the C extension locks the search tree in
+                      memory. This reader ignores it.
         """
+        # Serializes reload, which swaps the database in, with close and
+        # share.
+        self._lock = threading.Lock()
+        if isinstance(materialize, str) and materialize != "auto":
+            raise ValueError('materialize must be a bool or "auto"')
+        self._path = (
+            database
+            if mode != MODE_FD and compression.is_path(database)
+            else None
+        )
+        self._mode = mode
+        self._options = {
+            "immutable": immutable,
+            "materialize": materialize,
+            "specialize": specialize,
+            "typed": typed,
+            "threads": threads,
+            "cache": cache,
+            "prefault": prefault,
+            "advice": advice,
+            "mlock_tree": mlock_tree,
+        }
+        if threads < 1:
+            raise ValueError("threads must be at least 1")
+        if cache < 0:
+            raise ValueError("cache must not be negative")
+
         filename: Any
-        if (mode == MODE_AUTO and mmap) or mode == MODE_MMAP:
+        if mode != MODE_FD and compression.is_compressed(database):
+            # Whatever the mode, a compressed database is decompressed into
+            # an anonymous file, which is then mapped.
+            self._buffer = _map_decompressed(database)
+            self._buffer_size = len(self._buffer)
+            filename = "<buffer>" if _is_buffer(database) else database
+        elif mode in (MODE_AUTO, MODE_MEMORY) and _is_buffer(database):
+            self._buffer = bytes(database)  # type: ignore
+            self._buffer_size = len(self._buffer)
+            filename = "<buffer>"
+        elif (mode == MODE_AUTO and mmap) or mode == MODE_MMAP:
             with open(database, "rb") as db_file:  # type: ignore
                 self._buffer = mmap.mmap(db_file.fileno(), 0, access=mmap.ACCESS_READ)
                 self._buffer_size = self._buffer.size()
@@ -68,6 +194,26 @@ class Reader:
                 self._buffer = buf
                 self._buffer_size = len(buf)
             filename = database
+        elif mode == MODE_FD and mmap and _is_regular_file(database):
+            # As in the C extension, a regular file is mapped rather than
+            # read, so that readers in other processes share its pages.
+            fd = database if isinstance(database, int) else database.fileno()
+            if compression.is_compressed(fd):
+                # A compressed file is decompressed from its start, as the
+                # whole of an uncompressed one is mapped.
+                self._buffer = _map_decompressed(fd)
+                self._buffer_size = len(self._buffer)
+            else:
+                self._buffer = mmap.mmap(fd, 0, access=mmap.ACCESS_READ)
+                self._buffer_size = self._buffer.size()
+            filename = (
+                f"<fd {database}>" if isinstance(database, int) else database.name
+            )
+        elif mode == MODE_FD and isinstance(database, int):
+            with open(database, "rb", closefd=False) as db_file:
+                self._buffer = db_file.read()
+                self._buffer_size = len(self._buffer)
+            filename = f"<fd {database}>"
         elif mode == MODE_FD:
             self._buffer = database.read()  # type: ignore
             self._buffer_size = len(self._buffer)  # type: ignore
@@ -78,6 +224,15 @@ class Reader:
                 "MODE_MEMORY and MODE_FD are supported by the pure Python "
                 "Reader"
             )
+        if (
+            mode == MODE_FD
+            and isinstance(self._buffer, bytes)
+            and compression.compression(self._buffer[:4]) is not None
+        ):
+            # What was read from a descriptor that could not be mapped is
+            # decompressed in turn.
+            self._buffer = _map_decompressed(memoryview(self._buffer))
+            self._buffer_size = len(self._buffer)
 
         metadata_start = self._buffer.rfind(
             self._METADATA_START_MARKER, max(0, self._buffer_size - 128 * 1024)
@@ -101,12 +256,122 @@ class Reader:
 
         self._metadata = Metadata(**metadata)  # pylint: disable=bad-option-value
 
-        self._decoder = Decoder(
+        # Materialized and cached records are shared between lookups, so they
+        # must not be modifiable.
+        decoder = Decoder(
             self._buffer,
             self._metadata.search_tree_size + self._DATA_SECTION_SEPARATOR_SIZE,
+            immutable=immutable or bool(materialize) or cache > 0,
+            specialize=specialize,
+        )
+        data_section_size = (
+            metadata_start
+            - len(self._METADATA_START_MARKER)
+            - self._metadata.search_tree_size
+            - self._DATA_SECTION_SEPARATOR_SIZE
         )
+        state = _State(
+            buffer=self._buffer,
+            buffer_size=self._buffer_size,
+            metadata=self._metadata,
+            decoder=decoder,
+            data_section_size=data_section_size,
+        )
+        state = state._replace(ipv4_start=self._ipv4_start_node(state))
+
+        if typed:
+            state = state._replace(schema=self._build_schema(state))
+        if materialize is True or (
+            materialize == "auto"
+            and state.data_section_size <= self._MATERIALIZE_AUTO_MAX_DATA_SECTION_SIZE
+        ):
+            state = state._replace(records=self._materialize_records(state))
+        elif cache:
+            state = state._replace(cache=_RecordCache(cache))
+        self._state = state
         self.closed = False
 
+        self._advise(advice)
+        if prefault:
+            self.warm()
+
+        if watch:
+            if self._path is None:
+                raise ValueError("watch requires a database path")
+            self._watcher = Watcher(self, self._path)
+
+    def _record_offsets(self, state: "_State") -> Iterator[int]:
+        # Yields the distinct data offsets in the search tree, in node order.
+        seen = set()
+        node_count = state.metadata.node_count
+        for node_number in range(node_count):
+            for index in (0, 1):
+                pointer = self._read_node(state, node_number, index)
+                if pointer <= node_count:
+                    continue
+                offset = self._data_offset(state, pointer)
+                if offset not in seen:
+                    seen.add(offset)
+                    yield offset
+
+    def _build_schema(self, state: "_State") -> "_RecordSchema":
+        schema = _RecordSchema()
+        for offset in self._record_offsets(state):
+            (record, _) = state.decoder.decode(offset)
+            schema.observe(record)
+        schema.build(state.metadata.database_type)
+        return schema
+
+    @staticmethod
+    def _decode_record(state: "_State", offset: int) -> Record:
+        (record, _) = state.decoder.decode(offset)
+        if state.schema is not None:
+            return state.schema.convert(record)
+        return record
+
+    def _materialize_records(self, state: "_State") -> Dict[int, Record]:
+        start = time.monotonic()
+        records = {
+            offset: self._decode_record(state, offset)
+            for offset in self._record_offsets(state)
+        }
+        self._materialize_stats = {
+            "records": len(records),
+            "seconds": time.monotonic() - start,
+        }
+        return records
+
+    def materialize_stats(self) -> Optional[Dict[str, Union[int, float]]]:
+        """Return statistics about the records materialized at open
+
+        The returned dict contains the number of distinct ``records``, the
+        ``seconds`` taken to decode them and their approximate ``memory``
+        use in bytes. None is returned if the records were not materialized.
+        """
+        state = self._state
+        if state is None or state.records is None or self._materialize_stats is None:
+            return None
+        if "memory" not in self._materialize_stats:
+            self._materialize_stats["memory"] = sum(
+                _deep_sizeof(record) for record in state.records.values()
+            )
+        return dict(self._materialize_stats)
+
+    def cache_stats(self) -> Optional[Dict[str, int]]:
+        """Return statistics about the record cache
+
+        The returned dict contains the ``capacity`` of the cache, the
+        number of lookups that were cache ``hits`` and ``misses``, the
+        number of records evicted as ``evictions`` and the number of times
+        a lookup had to wait for another thread as ``contended``. None is
+        returned if there is no cache. The C extension returns the same
+        statistics, but for its sharded cache.
+        """
+        state = self._state
+        if state is None or state.cache is None:
+            return None
+        return state.cache.stats()
+
     def metadata(self) -> "Metadata":
         """Return the metadata associated with the MaxMind DB file"""
         return self._metadata
@@ -130,6 +395,307 @@ class Reader:
         Arguments:
         ip_address -- an IP address in the standard string notation
         """
+        return self._lookup(self._lookup_state(), ip_address)
+
+    async def aget(
+        self, ip_address: Union[str, IPv6Address, IPv4Address]
+    ) -> Optional[Record]:
+        """Return the record for the ip_address without blocking the event
+        loop
+
+        Lookups made before the event loop next runs are batched and looked
+        up on the loop's default executor.
+
+        Arguments:
+        ip_address -- an IP address in the standard string notation
+        """
+        return await aio.aget(self, ip_address)
+
+    async def aget_many(
+        self, ip_addresses: Iterable[Union[str, IPv6Address, IPv4Address]]
+    ) -> List[Optional[Record]]:
+        """Return the records for the ip_addresses without blocking the event
+        loop
+
+        Arguments:
+        ip_addresses -- IP addresses in the standard string notation
+        """
+        return await aio.aget_many(self, ip_addresses)
+
+    def get_lazy(
+        self, ip_address: Union[str, IPv6Address, IPv4Address]
+    ) -> Optional[Union[LazyRecord, Record]]:
+        """Return the record for the ip_address as a LazyRecord
+
+        The values of the returned map are only decoded when they are
+        accessed. Records that are not maps are decoded immediately.
+
+        Arguments:
+        ip_address -- an IP address in the standard string notation
+        """
+        state = self._lookup_state()
+        (pointer, _) = self._find_record_pointer(state, ip_address)
+
+        if pointer:
+            offset = self._data_offset(state, pointer)
+            if state.records is not None and offset in state.records:
+                # The record has already been decoded in full, so there is
+                # nothing to gain from decoding it lazily.
+                return state.records[offset]
+            return state.decoder.decode_lazy(offset)
+        return None
+
+    def get_raw(
+        self, ip_address: Union[str, IPv6Address, IPv4Address]
+    ) -> Optional[Union[bytes, memoryview]]:
+        """Return the MaxMind DB encoding of the record for the ip_address
+
+        The returned data is self-contained and may be decoded with
+        ``maxminddb.decode_raw``. If the record contains no pointers, a
+        ``memoryview`` of the database is returned rather than a copy when
+        the database is in memory. The view remains valid after the reader
+        is closed.
+
+        Arguments:
+        ip_address -- an IP address in the standard string notation
+        """
+        state = self._lookup_state()
+        (pointer, _) = self._find_record_pointer(state, ip_address)
+
+        if pointer:
+            return state.decoder.raw(self._data_offset(state, pointer))
+        return None
+
+    def get_columns(
+        self,
+        ip_addresses: Sequence[Union[str, IPv6Address, IPv4Address]],
+        fields: Sequence[Union[str, Sequence[Union[str, int]]]],
+    ) -> Dict[Any, Column]:
+        """Return the given fields of the records for the ip_addresses as
+        columns
+
+        Each field is either a dotted path such as "location.latitude" or a
+        sequence of map keys and array indexes. The returned dict maps each
+        field to a Column with one row per address. Floating point values
+        are stored as doubles ("d"), uint16 and uint32 values as "I", int32
+        values as "i", uint64 values as "Q" and booleans as "?". Missing
+        floating point values are NaN and other missing values are zero.
+
+        Arguments:
+        ip_addresses -- a sequence of IP addresses in the standard string
+                        notation
+        fields -- the paths of the values to return
+        """
+        paths = [
+            field.split(".") if isinstance(field, str) else list(field)
+            for field in fields
+        ]
+        columns = [_ColumnBuilder(field, len(ip_addresses)) for field in fields]
+
+        state = self._lookup_state()
+        for row, ip_address in enumerate(ip_addresses):
+            (pointer, _) = self._find_record_pointer(state, ip_address)
+            if not pointer:
+                continue
+            offset = self._data_offset(state, pointer)
+            for path, column in zip(paths, columns):
+                found = state.decoder.decode_path(offset, path)
+                if found is not None:
+                    column.store(row, *found)
+
+        return {field: column.result() for field, column in zip(fields, columns)}
+
+    def get_many_text(
+        self, buf: Union[bytes, bytearray, memoryview], delimiter: bytes = b"\n"
+    ) -> List[Optional[Record]]:
+        """Return the records for the addresses in a buffer of text, such as
+        a chunk of a log file
+
+        The text is split on the delimiter, and whitespace around each
+        address is ignored, as are empty lines. None is returned for
+        addresses without a record.
+
+        Arguments:
+        buf -- a bytes-like object with one address per line
+        delimiter -- the single byte separating the addresses
+        """
+        if not isinstance(delimiter, bytes) or len(delimiter) != 1:
+            raise TypeError("delimiter must be a byte string of length 1")
+
+        state = self._lookup_state()
+        records = []
+        for line_number, line in enumerate(bytes(buf).split(delimiter), 1):
+            line = line.strip()
+            if not line:
+                continue
+            text = line.decode("utf-8", "replace")
+            try:
+                address = ipaddress.ip_address(text)
+            except ValueError as ex:
+                raise ValueError(
+                    f"'{text}' on line {line_number} does not appear to be an "
+                    "IPv4 or IPv6 address."
+                ) from ex
+            (record, _) = self._lookup(state, address)
+            records.append(record)
+        return records
+
+    def lookup_buffer(
+        self,
+        addresses: Any,
+        offsets: Any,
+        prefix_lens: Any = None,
+    ) -> int:
+        """Look up a buffer of packed addresses without creating an object
+        per address
+
+        The data section offset of the record for each address is written to
+        offsets, or -1 if there is no record. These may be passed to
+        decode_offset. If prefix_lens is given, the prefix length of the
+        network of each address is written to it. The number of addresses
+        with a record is returned.
+
+        Arguments:
+        addresses -- a contiguous buffer of native uint32 IPv4 addresses or
+                     an (N, 4) or (N, 16) uint8 buffer of packed addresses
+        offsets -- a writable int64 buffer with room for N values
+        prefix_lens -- an optional writable uint8 buffer with room for N
+                       values
+        """
+        state = self._lookup_state()
+        view = memoryview(addresses)
+        if view.ndim == 1 and view.itemsize == 4 and view.format in ("I", "L"):
+            packed = [value.to_bytes(4, "big") for value in view.tolist()]
+        elif (
+            view.ndim == 2
+            and view.format == "B"
+            and view.shape is not None
+            and view.shape[1] in (4, 16)
+        ):
+            data = view.tobytes()
+            width = view.shape[1]
+            packed = [data[i : i + width] for i in range(0, len(data), width)]
+        else:
+            raise TypeError(
+                "addresses must be a contiguous buffer of uint32 IPv4 addresses "
+                "or an (N, 4) or (N, 16) buffer of packed addresses"
+            )
+
+        offsets_view = _output_view(offsets, "offsets", ("q", "l"), 8, len(packed))
+        prefix_lens_view = None
+        if prefix_lens is not None:
+            prefix_lens_view = _output_view(
+                prefix_lens, "prefix_lens", ("B",), 1, len(packed)
+            )
+
+        found = 0
+        data_section_start = (
+            state.metadata.search_tree_size + self._DATA_SECTION_SEPARATOR_SIZE
+        )
+        for i, address in enumerate(packed):
+            if len(address) == 16 and state.metadata.ip_version == 4:
+                raise ValueError(
+                    f"Error looking up address {i}. You attempted to look up "
+                    "an IPv6 address in an IPv4-only database."
+                )
+            (pointer, prefix_len) = self._find_address_in_tree(
+                state, bytearray(address)
+            )
+            if pointer:
+                offsets_view[i] = self._data_offset(state, pointer) - data_section_start
+                found += 1
+            else:
+                offsets_view[i] = -1
+            if prefix_lens_view is not None:
+                prefix_lens_view[i] = prefix_len
+        return found
+
+    def decode_offset(self, offset: int) -> Record:
+        """Return the record at the given data section offset, as written by
+        lookup_buffer
+
+        Arguments:
+        offset -- the offset of the record in the data section
+        """
+        state = self._lookup_state()
+        if not 0 <= offset < state.data_section_size:
+            raise ValueError(f"{offset} is not an offset in the data section")
+        return self._resolve_data_pointer(
+            state,
+            offset + state.metadata.node_count + self._DATA_SECTION_SEPARATOR_SIZE,
+        )
+
+    def get_json(
+        self,
+        ip_address: Union[str, IPv6Address, IPv4Address],
+        fields: Optional[Sequence[str]] = None,
+    ) -> Optional[bytes]:
+        """Return the record for the ip_address serialized as JSON
+
+        The JSON is returned as UTF-8 encoded bytes in the compact form of
+        ``json.dumps(record, ensure_ascii=False, separators=(",", ":"))``.
+        Binary data is written as a base64 string. None is returned if there
+        is no record for the address.
+
+        Arguments:
+        ip_address -- an IP address in the standard string notation
+        fields -- if set, only these top-level keys of the record are
+                  included
+        """
+        (record, _) = self._lookup(self._lookup_state(), ip_address)
+        if record is None:
+            return None
+        return _to_json(record, fields)
+
+    def get_many_json(
+        self,
+        ip_addresses: Iterable[Union[str, IPv6Address, IPv4Address]],
+        fields: Optional[Sequence[str]] = None,
+    ) -> bytes:
+        """Return the records for the ip_addresses as a JSON array
+
+        Each record is serialized as by ``get_json``, with ``null`` for
+        addresses that have no record.
+
+        Arguments:
+        ip_addresses -- an iterable of IP addresses in the standard string
+                        notation
+        fields -- if set, only these top-level keys of the records are
+                  included
+        """
+        _check_json_fields(fields)
+        state = self._lookup_state()
+        records = (self._lookup(state, ip)[0] for ip in ip_addresses)
+        return (
+            b"["
+            + b",".join(
+                b"null" if record is None else _to_json(record, fields)
+                for record in records
+            )
+            + b"]"
+        )
+
+    def _lookup_state(self) -> "_State":
+        # Each lookup reads the database through the state it starts with, so
+        # that a concurrent reload, which replaces the state as a whole, does
+        # not mix the old database with the new one.
+        state = self._state
+        if state is None:
+            raise ValueError("Attempt to read from a closed MaxMind DB.")
+        return state
+
+    def _lookup(
+        self, state: "_State", ip_address: Union[str, IPv6Address, IPv4Address]
+    ) -> Tuple[Optional[Record], int]:
+        (pointer, prefix_len) = self._find_record_pointer(state, ip_address)
+
+        if pointer:
+            return self._resolve_data_pointer(state, pointer), prefix_len
+        return None, prefix_len
+
+    def _find_record_pointer(
+        self, state: "_State", ip_address: Union[str, IPv6Address, IPv4Address]
+    ) -> Tuple[int, int]:
         if isinstance(ip_address, str):
             address = ipaddress.ip_address(ip_address)
         else:
@@ -140,27 +706,25 @@ class Reader:
         except AttributeError as ex:
             raise TypeError("argument 1 must be a string or ipaddress object") from ex
 
-        if address.version == 6 and self._metadata.ip_version == 4:
+        if address.version == 6 and state.metadata.ip_version == 4:
             raise ValueError(
                 f"Error looking up {ip_address}. You attempted to look up "
                 "an IPv6 address in an IPv4-only database."
             )
 
-        (pointer, prefix_len) = self._find_address_in_tree(packed_address)
+        return self._find_address_in_tree(state, packed_address)
 
-        if pointer:
-            return self._resolve_data_pointer(pointer), prefix_len
-        return None, prefix_len
-
-    def _find_address_in_tree(self, packed: bytearray) -> Tuple[int, int]:
+    def _find_address_in_tree(
+        self, state: "_State", packed: bytearray
+    ) -> Tuple[int, int]:
         bit_count = len(packed) * 8
-        node = self._start_node(bit_count)
-        node_count = self._metadata.node_count
+        node = self._start_node(state, bit_count)
+        node_count = state.metadata.node_count
 
         i = 0
         while i < bit_count and node < node_count:
             bit = 1 & (packed[i >> 3] >> 7 - (i % 8))
-            node = self._read_node(node, bit)
+            node = self._read_node(state, node, bit)
             i = i + 1
 
         if node == node_count:
@@ -171,33 +735,36 @@ class Reader:
 
         raise InvalidDatabaseError("Invalid node in search tree")
 
-    def _start_node(self, length: int) -> int:
-        if self._metadata.ip_version != 6 or length == 128:
+    @staticmethod
+    def _start_node(state: "_State", length: int) -> int:
+        if state.metadata.ip_version != 6 or length == 128:
             return 0
 
-        # We are looking up an IPv4 address in an IPv6 tree. Skip over the
-        # first 96 nodes.
-        if self._ipv4_start:
-            return self._ipv4_start
+        # We are looking up an IPv4 address in an IPv6 tree, so the first 96
+        # nodes are skipped.
+        return state.ipv4_start
 
+    def _ipv4_start_node(self, state: "_State") -> int:
+        if state.metadata.ip_version != 6:
+            return 0
         node = 0
         for _ in range(96):
-            if node >= self._metadata.node_count:
+            if node >= state.metadata.node_count:
                 break
-            node = self._read_node(node, 0)
-        self._ipv4_start = node
+            node = self._read_node(state, node, 0)
         return node
 
-    def _read_node(self, node_number: int, index: int) -> int:
-        base_offset = node_number * self._metadata.node_byte_size
+    @staticmethod
+    def _read_node(state: "_State", node_number: int, index: int) -> int:
+        base_offset = node_number * state.metadata.node_byte_size
 
-        record_size = self._metadata.record_size
+        record_size = state.metadata.record_size
         if record_size == 24:
             offset = base_offset + index * 3
-            node_bytes = b"\x00" + self._buffer[offset : offset + 3]
+            node_bytes = b"\x00" + state.buffer[offset : offset + 3]
         elif record_size == 28:
             offset = base_offset + 3 * index
-            node_bytes = bytearray(self._buffer[offset : offset + 4])
+            node_bytes = bytearray(state.buffer[offset : offset + 4])
             if index:
                 node_bytes[0] = 0x0F & node_bytes[0]
             else:
@@ -205,27 +772,222 @@ class Reader:
                 node_bytes.insert(0, middle)
         elif record_size == 32:
             offset = base_offset + index * 4
-            node_bytes = self._buffer[offset : offset + 4]
+            node_bytes = state.buffer[offset : offset + 4]
         else:
             raise InvalidDatabaseError(f"Unknown record size: {record_size}")
         return struct.unpack(b"!I", node_bytes)[0]
 
-    def _resolve_data_pointer(self, pointer: int) -> Record:
-        resolved = pointer - self._metadata.node_count + self._metadata.search_tree_size
-
-        if resolved >= self._buffer_size:
+    def _resolve_data_pointer(self, state: "_State", pointer: int) -> Record:
+        offset = self._data_offset(state, pointer)
+        if state.records is not None and offset in state.records:
+            return state.records[offset]
+        if state.cache is not None:
+            record = state.cache.get(offset)
+            if record is None:
+                record = state.cache.put(offset, self._decode_record(state, offset))
+            return record
+        return self._decode_record(state, offset)
+
+    @staticmethod
+    def _data_offset(state: "_State", pointer: int) -> int:
+        resolved = pointer - state.metadata.node_count + state.metadata.search_tree_size
+
+        if resolved >= state.buffer_size:
             raise InvalidDatabaseError("The MaxMind DB file's search tree is corrupt")
 
-        (data, _) = self._decoder.decode(resolved)
-        return data
+        return resolved
+
+    def reload(self, database: Any = None) -> None:
+        """Open the database again, or another in its place, and swap it in
+
+        The database is opened with the options the reader was opened with.
+        If it cannot be opened, the reader keeps the current database.
+        Lookups that are already running finish with the database they
+        started with.
+
+        Arguments:
+        database -- the database to open in place of the current one. By
+                    default, the path the reader was opened from is opened
+                    again.
+        """
+        if self.closed:
+            raise ValueError("Attempt to reload a closed MaxMind DB")
+        if database is None:
+            if self._path is None:
+                raise ValueError(
+                    "reload requires a database when the reader was not "
+                    "opened from a path"
+                )
+            database = self._path
+        replacement = Reader(database, self._mode, **self._options)
+        # Typed records are instances of classes built for each database, so
+        # they are not carried over.
+        state = self._state
+        carried = 0
+        if (
+            state is not None
+            and state.cache is not None
+            and replacement._state is not None
+            and replacement._state.cache is not None
+            and not self._options["typed"]
+        ):
+            carried = replacement._carry_over_cache(
+                state.cache.items(), state.decoder
+            )
+        with self._lock:
+            # The reader may have been closed while the database was opening.
+            if self.closed:
+                replacement.close()
+                return
+            users = self._users
+            # Lookups read the database through _state alone, so assigning it
+            # swaps the database in one step. Running lookups hold the state
+            # they started with, so the old buffer is released once they are
+            # done with it.
+            self._path = replacement._path
+            self._buffer = replacement._buffer
+            self._buffer_size = replacement._buffer_size
+            self._metadata = replacement._metadata
+            self._materialize_stats = replacement._materialize_stats
+            self._users = None
+            self._state = replacement._state
+            self._reloads += 1
+            self._last_reload = time.time()
+            self._cache_carried_over = carried
+        if users is not None:
+            users.release()
+
+    def _carry_over_cache(
+        self, records: List[Tuple[int, Record]], decoder: Decoder
+    ) -> int:
+        # Adds the records cached for the previous database, which decoder
+        # reads, when their encoding is the same in this one. Unchanged
+        # records usually move between builds, so they are found by their
+        # encoding rather than their offset.
+        by_raw = {bytes(decoder.raw(offset)): record for offset, record in records}
+        state = self._state
+        carried = 0
+        for offset in self._record_offsets(state):  # type: ignore
+            if not by_raw:
+                break
+            record = by_raw.pop(bytes(state.decoder.raw(offset)), None)  # type: ignore
+            if record is not None:
+                state.cache.put(offset, record)  # type: ignore
+                carried += 1
+        return carried
+
+    def _advise(self, advice: Union[None, str, Iterable[str]]) -> None:
+        if advice is None:
+            return
+        for name in [advice] if isinstance(advice, str) else advice:
+            flag = _ADVICE.get(name)
+            if flag is None:
+                raise ValueError(
+                    f"Unsupported advice ({name!r}). This platform supports "
+                    f"{', '.join(_ADVICE) or 'none'}."
+                )
+            if isinstance(self._buffer, mmap.mmap):
+                # Advice is only a hint, so the database stays usable if the
+                # kernel does not support it.
+                try:
+                    self._buffer.madvise(flag)
+                except OSError as ex:
+                    warnings.warn(
+                        f"Ignoring the {name} advice, which failed ({ex.strerror})",
+                        RuntimeWarning,
+                    )
+
+    def warm(self, *, tree: bool = True, data: bool = True) -> None:
+        """Read the search tree and data section into memory
+
+        This avoids page faults on the first lookups after the database is
+        opened.
+
+        Arguments:
+        tree -- whether to read the search tree
+        data -- whether to read the data section
+        """
+        if self.closed:
+            raise ValueError("Attempt to read from a closed MaxMind DB.")
+        if not isinstance(self._buffer, mmap.mmap if mmap else ()):
+            return
+        page = mmap.PAGESIZE
+        tree_size = self._metadata.search_tree_size
+        start = 0 if tree else tree_size + self._DATA_SECTION_SEPARATOR_SIZE
+        end = self._buffer_size if data else tree_size
+        for offset in range(start - start % page, end, page):
+            self._buffer[offset]  # pylint: disable=pointless-statement
+
+    def residency(self) -> Optional[Dict[str, float]]:
+        """Return the fraction of the search tree and data section that is
+        in memory
+
+        The returned dict contains the fraction of the pages of the
+        ``tree`` and of the ``data`` section that are resident. This reader
+        cannot tell, so None is returned; the C extension uses mincore.
+        """
+        return None
+
+    def reload_stats(self) -> Dict[str, Any]:
+        """Return statistics about reloads of the database
+
+        The returned dict contains the number of successful ``reloads``,
+        the time of the last one as ``last_reload``, the number of cached
+        records the last reload kept because they were unchanged as
+        ``cache_carried_over`` and, for a reader opened with watch=True,
+        the number of automatic reloads that failed as ``errors`` and the
+        most recent such exception as ``last_error``.
+        """
+        watcher = self._watcher
+        return {
+            "reloads": self._reloads,
+            "last_reload": self._last_reload,
+            "cache_carried_over": self._cache_carried_over,
+            "errors": 0 if watcher is None else watcher.errors,
+            "last_error": None if watcher is None else watcher.last_error,
+        }
+
+    def share(self) -> "Reader":
+        """Return another reader of the same database
+
+        The database, including its caches and materialized records, is
+        shared rather than opened again, but each reader is closed on its
+        own, and the database is closed with the last of them. A later reload
+        only replaces the database of the reader it is called on.
+        """
+        reader = Reader.__new__(Reader)
+        with self._lock:
+            if self.closed:
+                raise ValueError("Attempt to share a closed MaxMind DB")
+            with _users_lock:
+                if self._users is None:
+                    self._users = _Users()
+                self._users.add()
+            reader.__dict__.update(self.__dict__)
+        reader._lock = threading.Lock()
+        reader._watcher = None
+        reader._reloads = 0
+        reader._last_reload = None
+        reader._cache_carried_over = 0
+        return reader
 
     def close(self) -> None:
         """Closes the MaxMind DB file and returns the resources to the system"""
-        try:
-            self._buffer.close()  # type: ignore
-        except AttributeError:
-            pass
-        self.closed = True
+        with self._lock:
+            # The reader is not yet marked open if its database failed to
+            # open.
+            if getattr(self, "closed", False):
+                return
+            if self._users is None or self._users.release():
+                try:
+                    self._buffer.close()  # type: ignore
+                except AttributeError:
+                    pass
+            self._state = None
+            self.closed = True
+            watcher, self._watcher = self._watcher, None
+        if watcher is not None:
+            watcher.stop()
 
     def __exit__(self, *args) -> None:
         self.close()
@@ -236,6 +998,335 @@ class Reader:
         return self
 
 
+class _State(NamedTuple):
+    """What lookups read of one database
+
+    A reload replaces the reader's state as a whole, and each lookup reads
+    through the state it started with.
+    """
+
+    buffer: Union[bytes, FileBuffer, "mmap.mmap"]
+    buffer_size: int
+    metadata: "Metadata"
+    decoder: Decoder
+    data_section_size: int
+    ipv4_start: int = 0
+    schema: Optional["_RecordSchema"] = None
+    records: Optional[Dict[int, Record]] = None
+    cache: Optional["_RecordCache"] = None
+
+
+class _Users:
+    """The number of readers sharing a database through share()"""
+
+    def __init__(self) -> None:
+        self._count = 1
+        self._lock = threading.Lock()
+
+    def add(self) -> None:
+        """Count another reader"""
+        with self._lock:
+            self._count += 1
+
+    def release(self) -> bool:
+        """Stop counting a reader and return whether it was the last one"""
+        with self._lock:
+            self._count -= 1
+            return self._count == 0
+
+
+_users_lock = threading.Lock()
+
+
+class _RecordCache:
+    """A bounded cache of decoded records, keyed by data offset
+
+    When the cache is full, the record that was added first is evicted.
+    """
+
+    def __init__(self, capacity: int) -> None:
+        self._capacity = capacity
+        self._records: Dict[int, Record] = {}
+        self._lock = threading.Lock()
+        self._hits = 0
+        self._misses = 0
+        self._evictions = 0
+        self._contended = 0
+
+    def _acquire(self) -> None:
+        if not self._lock.acquire(blocking=False):
+            self._lock.acquire()
+            self._contended += 1
+
+    def get(self, offset: int) -> Optional[Record]:
+        self._acquire()
+        try:
+            record = self._records.get(offset)
+            if record is None:
+                self._misses += 1
+            else:
+                self._hits += 1
+            return record
+        finally:
+            self._lock.release()
+
+    def put(self, offset: int, record: Record) -> Record:
+        # Returns the cached record, which is another thread's if it decoded
+        # the same record first.
+        self._acquire()
+        try:
+            cached = self._records.get(offset)
+            if cached is not None:
+                return cached
+            if len(self._records) >= self._capacity:
+                del self._records[next(iter(self._records))]
+                self._evictions += 1
+            self._records[offset] = record
+            return record
+        finally:
+            self._lock.release()
+
+    def items(self) -> List[Tuple[int, Record]]:
+        self._acquire()
+        try:
+            return list(self._records.items())
+        finally:
+            self._lock.release()
+
+    def stats(self) -> Dict[str, int]:
+        self._acquire()
+        try:
+            return {
+                "capacity": self._capacity,
+                "hits": self._hits,
+                "misses": self._misses,
+                "evictions": self._evictions,
+                "contended": self._contended,
+            }
+        finally:
+            self._lock.release()
+
+
+class _RecordSchema:
+    """The observed structure of the maps at one position in the records
+
+    Maps in arrays share the schema of the array.
+    """
+
+    __slots__ = ("children", "cls", "setters")
+
+    def __init__(self) -> None:
+        self.children: Dict[str, _RecordSchema] = {}
+        self.cls: Optional[Type[TypedRecord]] = None
+        self.setters: List[Any] = []
+
+    def observe(self, value: Record) -> None:
+        """Add the keys of the maps in value to the schema"""
+        if isinstance(value, Mapping):
+            for key, item in value.items():
+                self.children.setdefault(key, _RecordSchema()).observe(item)
+        elif isinstance(value, (list, tuple)):
+            for item in value:
+                self.observe(item)
+
+    def build(self, name: str) -> None:
+        """Create the record classes for the schema"""
+        for key, child in self.children.items():
+            child.build(key)
+        self.cls = typed_record_class(name, list(self.children))
+        if self.cls is not None:
+            # The values are stored directly in the slots of the class,
+            # bypassing the read-only __setattr__.
+            self.setters = [getattr(self.cls, key).__set__ for key in self.children]
+
+    def convert(self, value: Any) -> Any:
+        """Convert the maps in a decoded value to typed records"""
+        if isinstance(value, Mapping):
+            children = self.children
+            if self.cls is not None:
+                # The schema holds the keys of every record in the database.
+                if not all(key in children for key in value):
+                    raise InvalidDatabaseError("Invalid map key for a typed record")
+                record = self.cls.__new__(self.cls)
+                for (key, child), setter in zip(children.items(), self.setters):
+                    setter(record, child.convert(value[key]) if key in value else None)
+                return record
+            converted = {
+                key: children[key].convert(item) if key in children else item
+                for key, item in value.items()
+            }
+            if isinstance(value, MappingProxyType):
+                return MappingProxyType(converted)
+            return converted
+        if isinstance(value, list):
+            return [self.convert(item) for item in value]
+        if isinstance(value, tuple):
+            return tuple(self.convert(item) for item in value)
+        return value
+
+
+class _ColumnBuilder:
+    # The array module type codes for each data type. Strings are stored in
+    # a bytearray instead.
+    _TYPE_CODES = {2: "s", 3: "d", 5: "I", 6: "I", 8: "i", 9: "Q", 14: "?", 15: "d"}
+
+    __slots__ = ("field", "rows", "kind", "values", "valid", "offsets")
+
+    def __init__(self, field: Any, rows: int) -> None:
+        self.field = field
+        self.rows = rows
+        self.kind = ""
+        self.values: Any = None
+        self.valid = bytearray(rows)
+        self.offsets: List[int] = []
+
+    def _init(self, kind: str) -> None:
+        self.kind = kind
+        if kind == "s":
+            self.values = bytearray()
+            self.offsets = [0]
+        elif kind == "?":
+            self.values = bytearray(self.rows)
+        elif kind == "d":
+            self.values = array.array("d", [float("nan")]) * self.rows
+        else:
+            self.values = array.array(kind, [0]) * self.rows
+
+    def store(self, row: int, type_num: int, value: Any) -> None:
+        kind = self._TYPE_CODES.get(type_num)
+        if kind is None:
+            raise TypeError(
+                f"The values of {self.field!r} cannot be stored in a column"
+            )
+        if not self.kind:
+            self._init(kind)
+        elif kind != self.kind:
+            raise ValueError(f"The values of {self.field!r} have more than one type")
+
+        if kind == "s":
+            self._fill_offsets(row)
+            self.values += value.encode("utf-8")
+            self.offsets.append(len(self.values))
+        else:
+            self.values[row] = value
+        self.valid[row] = 1
+
+    def _fill_offsets(self, row: int) -> None:
+        # Rows without a string are empty.
+        while len(self.offsets) <= row:
+            self.offsets.append(self.offsets[-1])
+
+    def result(self) -> Column:
+        if not self.kind:
+            self._init("d")
+        valid = memoryview(self.valid).cast("?")
+        if self.kind == "s":
+            self._fill_offsets(self.rows)
+            offsets = memoryview(array.array("q", self.offsets)).cast("B").cast("q")
+            return Column(memoryview(self.values), valid, offsets)
+        if self.kind == "?":
+            return Column(memoryview(self.values).cast("?"), valid)
+        return Column(memoryview(self.values), valid)
+
+
+def _output_view(
+    obj: Any, name: str, formats: Tuple[str, ...], itemsize: int, count: int
+) -> memoryview:
+    view = memoryview(obj)
+    if (
+        view.readonly
+        or view.ndim != 1
+        or view.itemsize != itemsize
+        or view.format not in formats
+    ):
+        raise TypeError(
+            f"{name} must be a contiguous buffer of "
+            + ("int64" if itemsize == 8 else "uint8")
+        )
+    if len(view) < count:
+        raise ValueError(f"{name} must have room for {count} values")
+    return view
+
+
+# The madvise hints that the advice option may name, where mmap supports
+# them.
+_ADVICE = {
+    name: getattr(mmap, f"MADV_{name.upper()}")
+    for name in ("normal", "random", "sequential", "willneed", "hugepage")
+    if hasattr(mmap, f"MADV_{name.upper()}")
+}
+
+
+def _map_decompressed(database: Any) -> Union[bytes, "mmap.mmap"]:
+    fd = compression.decompress_to_file(database)
+    with open(fd, "rb") as db_file:
+        if mmap and os.fstat(fd).st_size > 0:
+            return mmap.mmap(fd, 0, access=mmap.ACCESS_READ)
+        db_file.seek(0)
+        return db_file.read()
+
+
+def _is_regular_file(database: Any) -> bool:
+    # Returns whether the descriptor or file object is a non-empty regular
+    # file, which can be memory mapped.
+    try:
+        fd = database if isinstance(database, int) else database.fileno()
+        st = os.fstat(fd)
+    except (AttributeError, OSError, ValueError):
+        return False
+    return stat.S_ISREG(st.st_mode) and st.st_size > 0
+
+
+def _is_buffer(database: Any) -> bool:
+    if compression.is_path(database):
+        return False
+    try:
+        memoryview(database)
+    except TypeError:
+        return False
+    return True
+
+
+def _check_json_fields(fields: Optional[Sequence[str]]) -> None:
+    if isinstance(fields, str):
+        raise TypeError("fields must be a sequence of strings, not a string")
+    if fields is not None and not all(isinstance(field, str) for field in fields):
+        raise TypeError("fields must be strings")
+
+
+def _json_default(obj: Any) -> Any:
+    if isinstance(obj, (bytes, bytearray)):
+        return base64.b64encode(obj).decode("ascii")
+    if isinstance(obj, Mapping):
+        # Immutable records use read-only mappings, which json cannot
+        # serialize directly.
+        return dict(obj)
+    raise TypeError(f"Object of type {type(obj).__name__} is not JSON serializable")
+
+
+def _to_json(record: Record, fields: Optional[Sequence[str]]) -> bytes:
+    _check_json_fields(fields)
+    if fields is not None and isinstance(record, Mapping):
+        record = {key: value for key, value in record.items() if key in fields}
+    return json.dumps(
+        record, ensure_ascii=False, separators=(",", ":"), default=_json_default
+    ).encode("utf-8")
+
+
+def _deep_sizeof(obj: Any) -> int:
+    size = sys.getsizeof(obj)
+    if isinstance(obj, tuple):
+        size += sum(_deep_sizeof(item) for item in obj)
+    elif isinstance(obj, MappingProxyType):
+        # The proxied dict is not accessible, but a copy of it is the same
+        # size.
+        size += sys.getsizeof(obj.copy())
+        size += sum(
+            sys.getsizeof(key) + _deep_sizeof(value) for key, value in obj.items()
+        )
+    return size
+
+
 class Metadata:
     """Metadata for the MaxMind DB reader
 
@@ -0,0 +1,139 @@
+"""
+maxminddb.shared
+~~~~~~~~~~~~~~~~
+
+This module contains SharedDatabase, which holds a single read-only copy of
+a database in memory for readers in any number of processes to map.
+
+"""
+import os
+from typing import IO, Any, AnyStr, Optional, Union
+
+try:
+    import fcntl
+except ImportError:
+    # pylint: disable=invalid-name
+    fcntl = None  # type: ignore
+
+from maxminddb.compression import write_decompressed
+from maxminddb.file import anonymous_file
+
+# From <linux/fcntl.h>, for Pythons whose fcntl module lacks them.
+_F_ADD_SEALS = getattr(fcntl, "F_ADD_SEALS", 1033)
+_F_SEAL_SEAL = 0x0001
+_F_SEAL_SHRINK = 0x0002
+_F_SEAL_GROW = 0x0004
+_F_SEAL_WRITE = 0x0008
+
+# Where Linux exposes POSIX shared memory objects as files.
+_SHM_DIRECTORY = "/dev/shm"
+
+
+class SharedDatabase:
+    """A read-only copy of a database in shared memory
+
+    Without a name, the database is copied into a memfd, which is sealed so
+    that it can no longer be changed. Readers open it with MODE_FD from fd,
+    which forked workers inherit and which may be passed to other processes,
+    e.g., with subprocess's pass_fds, or with open_database from path.
+
+    With a name, the database is copied into the POSIX shared memory object
+    of that name, replacing any previous one. Processes that are not related
+    to the loader open it with open_shared(name). The object is read-only
+    and remains until unlink() is called.
+
+    Either way, the readers map the same pages, so the database is in memory
+    once however many processes use it. The pages are freed once the last
+    reader and descriptor for them are closed.
+    """
+
+    fd: int
+    name: Optional[str]
+    path: Optional[str]
+    sealed: bool
+
+    def __init__(
+        self,
+        database: Union[AnyStr, "os.PathLike[Any]", IO, bytearray, memoryview],
+        name: Optional[str] = None,
+    ) -> None:
+        """Copy the database into shared memory
+
+        Arguments:
+            database -- a path to a MaxMind DB file, a binary file object to
+                        read it from, or a buffer, such as a bytearray,
+                        memoryview or mmap, holding it. It is decompressed
+                        if it is compressed with gzip or zstd.
+            name -- the name of a POSIX shared memory object to copy the
+                    database to. By default, it is copied to a memfd.
+        """
+        self.name = name
+        if name is None:
+            self.fd, sealable = anonymous_file()
+            self.sealed = sealable and fcntl is not None
+            self.path = (
+                f"/proc/{os.getpid()}/fd/{self.fd}"
+                if os.path.isdir("/proc/self/fd")
+                else None
+            )
+        else:
+            self.path = shared_path(name)
+            self.sealed = False
+            # The object is written under a temporary name and renamed, so
+            # that readers never see a partial copy.
+            temporary = f"{self.path}.{os.getpid()}.tmp"
+            self.fd = os.open(
+                temporary, os.O_RDWR | os.O_CREAT | os.O_EXCL | os.O_CLOEXEC, 0o444
+            )
+        try:
+            with open(self.fd, "wb", closefd=False) as destination:
+                write_decompressed(database, destination)
+            if self.sealed:
+                fcntl.fcntl(
+                    self.fd,
+                    _F_ADD_SEALS,
+                    _F_SEAL_SEAL | _F_SEAL_SHRINK | _F_SEAL_GROW | _F_SEAL_WRITE,
+                )
+            if name is not None:
+                os.rename(temporary, self.path)
+        except BaseException:
+            os.close(self.fd)
+            if name is not None:
+                os.unlink(temporary)
+            raise
+
+    def close(self) -> None:
+        """Close the descriptor
+
+        Readers that are already open, and a named object, are not affected.
+        """
+        if self.fd != -1:
+            os.close(self.fd)
+            self.fd = -1
+
+    def unlink(self) -> None:
+        """Remove the named shared memory object
+
+        Readers that are already open are not affected.
+        """
+        if self.path is not None and self.name is not None:
+            os.unlink(self.path)
+
+    def __enter__(self) -> "SharedDatabase":
+        return self
+
+    def __exit__(self, *args) -> None:
+        self.close()
+
+
+def shared_path(name: str) -> str:
+    """Return the path of the POSIX shared memory object with the name"""
+    name = name.lstrip("/")
+    if not name or "/" in name:
+        raise ValueError(f"Invalid shared memory name ({name!r})")
+    if not os.path.isdir(_SHM_DIRECTORY):
+        raise ValueError(
+            "Named shared databases require POSIX shared memory in "
+            f"{_SHM_DIRECTORY}"
+        )
+    return os.path.join(_SHM_DIRECTORY, name)
@@ -4,10 +4,24 @@ maxminddb.types
 
 This module provides a Record type that represents a database record.
 """
-from typing import AnyStr, Dict, List, Union
+import keyword
+import re
+from collections.abc import Mapping
+from typing import (
+    Any,
+    AnyStr,
+    Dict,
+    List,
+    NamedTuple,
+    Optional,
+    Sequence,
+    Tuple,
+    Type,
+    Union,
+)
 
 Primitive = Union[AnyStr, bool, float, int]
-Record = Union[Primitive, "RecordList", "RecordDict"]
+Record = Union[Primitive, "RecordList", "RecordDict", "TypedRecord"]
 
 
 class RecordList(List[Record]):  # pylint: disable=too-few-public-methods
@@ -20,3 +34,102 @@ class RecordDict(Dict[str, Record]):  # pylint: disable=too-few-public-methods
     """
     RecordDict is a type for dicts in a database record.
     """
+
+
+class Column(NamedTuple):
+    """
+    Column holds the values of one field for each address passed to
+    ``get_columns``. ``values`` is a memoryview of the values in a native
+    format, e.g., ``"d"`` for floating point numbers, and ``valid`` holds
+    whether each address had a value. For strings, ``values`` holds the
+    UTF-8 data and the string for row ``i`` is
+    ``values[offsets[i]:offsets[i + 1]]``.
+    """
+
+    values: memoryview
+    valid: memoryview
+    offsets: Optional[memoryview] = None
+
+
+class TypedRecord:
+    """
+    TypedRecord is the base class for the record classes generated when a
+    database is opened with ``typed=True``. Each map key is an attribute,
+    e.g., ``record.country.iso_code``. Keys missing from a particular record
+    are None. Typed records cannot be modified.
+    """
+
+    __slots__ = ()
+    _fields: Tuple[str, ...] = ()
+
+    def __setattr__(self, name: str, value: Any) -> None:
+        raise AttributeError(f"{self.__class__.__name__} objects are read-only")
+
+    def __delattr__(self, name: str) -> None:
+        raise AttributeError(f"{self.__class__.__name__} objects are read-only")
+
+    def _items(self) -> List[Tuple[str, Any]]:
+        return [(field, getattr(self, field)) for field in self._fields]
+
+    def __eq__(self, other: object) -> bool:
+        if type(self) is not type(other):
+            return NotImplemented
+        return self._items() == other._items()  # type: ignore[attr-defined]
+
+    __hash__ = None  # type: ignore[assignment]
+
+    def __repr__(self) -> str:
+        args = ", ".join(f"{field}={value!r}" for field, value in self._items())
+        return f"{self.__class__.__name__}({args})"
+
+    def _asdict(self) -> Dict[str, Any]:
+        """Return the record as a dict, with nested typed records converted
+        as well. Keys missing from the record are left out."""
+        return {
+            field: _asdict(value)
+            for field, value in self._items()
+            if value is not None
+        }
+
+
+def _asdict(value: Any) -> Any:
+    if isinstance(value, TypedRecord):
+        return value._asdict()  # pylint: disable=protected-access
+    if isinstance(value, Mapping):
+        return {key: _asdict(item) for key, item in value.items()}
+    if isinstance(value, (list, tuple)):
+        return type(value)(_asdict(item) for item in value)
+    return value
+
+
+def typed_record_class(
+    name: str, fields: Sequence[str]
+) -> Optional[Type[TypedRecord]]:
+    """Return a new TypedRecord subclass with a slot for each field
+
+    None is returned if the fields cannot all be used as attribute names, in
+    which case maps with these keys are kept as dicts.
+
+    Arguments:
+    name -- the database type or the key the maps were found under. This is
+            used to name the class, e.g., "country" gives "CountryRecord".
+    fields -- the keys of the maps
+    """
+    if not fields or not all(
+        field.isidentifier()
+        and not keyword.iskeyword(field)
+        and not field.startswith("_")
+        for field in fields
+    ):
+        return None
+    class_name = (
+        "".join(part[:1].upper() + part[1:] for part in re.split(r"[\W_]+", name))
+        + "Record"
+    )
+    if not class_name.isidentifier():
+        class_name = "Record"
+    return type(
+        class_name,
+        (TypedRecord,),
+        {"__slots__": tuple(fields), "_fields": tuple(fields), "__module__": __name__},
+    )
@@ -0,0 +1,165 @@
+"""
+maxminddb.watch
+~~~~~~~~~~~~~~~
+
+This module contains the file watcher used by readers opened with
+``watch=True``. It is shared by the C extension and pure Python readers.
+
+"""
+import ctypes
+import os
+import select
+import struct
+import sys
+import threading
+import weakref
+from typing import Any, Optional, Tuple
+
+# From <sys/inotify.h>.
+_IN_CLOSE_WRITE = 0x00000008
+_IN_MOVED_TO = 0x00000080
+_IN_Q_OVERFLOW = 0x00004000
+_EVENT = struct.Struct("iIII")
+
+# How long to wait for further changes to the file before reloading it.
+_SETTLE_SECONDS = 0.1
+
+
+class Watcher:
+    """Reloads a reader in a background thread when its file is replaced
+
+    On Linux, the file's directory is watched with inotify, so that both a
+    file renamed over the database and a rewrite of it in place are seen.
+    Elsewhere, the file is checked with stat() every poll_interval seconds.
+    The thread stops when stop() is called or the reader is garbage
+    collected.
+    """
+
+    def __init__(
+        self, reader: Any, path: Any, poll_interval: float = 1.0
+    ) -> None:
+        self.path = os.fsencode(path)
+        self.errors = 0
+        self.last_error: Optional[Exception] = None
+        self._poll_interval = poll_interval
+        self._signature = _signature(self.path)
+        self._lock = threading.Lock()
+        self._stopped = False
+        self._stop_read, self._stop_write = os.pipe()
+        try:
+            self._inotify = _inotify(os.path.dirname(self.path) or b".")
+        except BaseException:
+            os.close(self._stop_read)
+            os.close(self._stop_write)
+            raise
+        # The thread only holds a weak reference, so a reader that is never
+        # closed can still be collected, which stops the thread.
+        self._reader = weakref.ref(reader, lambda _: self.stop())
+        self._thread = threading.Thread(
+            target=self._run, name="maxminddb-watch", daemon=True
+        )
+        self._thread.start()
+
+    def stop(self) -> None:
+        """Stop watching the file"""
+        with self._lock:
+            if self._stopped:
+                return
+            self._stopped = True
+            os.write(self._stop_write, b"\0")
+        if threading.current_thread() is not self._thread:
+            self._thread.join()
+
+    def _run(self) -> None:
+        try:
+            while self._wait():
+                reader = self._reader()
+                if reader is None:
+                    return
+                try:
+                    reader.reload(self.path)
+                except Exception as ex:  # pylint: disable=broad-except
+                    self.errors += 1
+                    self.last_error = ex
+                del reader
+        finally:
+            with self._lock:
+                self._stopped = True
+                if self._inotify is not None:
+                    os.close(self._inotify)
+                os.close(self._stop_read)
+                os.close(self._stop_write)
+
+    def _wait(self) -> bool:
+        # Returns True once the file has changed, or False once stopped.
+        if self._inotify is None:
+            return self._poll()
+        name = os.path.basename(self.path)
+        while True:
+            ready, _, _ = select.select([self._inotify, self._stop_read], [], [])
+            if self._stop_read in ready:
+                return False
+            if _changed(os.read(self._inotify, 64 * 1024), name):
+                break
+        # Writers often make several changes in a row, so wait for them to
+        # finish.
+        while True:
+            ready, _, _ = select.select(
+                [self._inotify, self._stop_read], [], [], _SETTLE_SECONDS
+            )
+            if self._stop_read in ready:
+                return False
+            if not ready:
+                return True
+            os.read(self._inotify, 64 * 1024)
+
+    def _poll(self) -> bool:
+        while True:
+            ready, _, _ = select.select(
+                [self._stop_read], [], [], self._poll_interval
+            )
+            if ready:
+                return False
+            signature = _signature(self.path)
+            if signature is not None and signature != self._signature:
+                self._signature = signature
+                return True
+
+
+def _signature(path: bytes) -> Optional[Tuple[int, int, int, int]]:
+    try:
+        st = os.stat(path)
+    except OSError:
+        # The file is being replaced.
+        return None
+    return (st.st_dev, st.st_ino, st.st_size, st.st_mtime_ns)
+
+
+def _inotify(directory: bytes) -> Optional[int]:
+    # Returns an inotify descriptor watching the directory, or None if
+    # inotify is not available.
+    if not sys.platform.startswith("linux"):
+        return None
+    libc = ctypes.CDLL(None, use_errno=True)
+    if not hasattr(libc, "inotify_init1"):
+        return None
+    fd = libc.inotify_init1(os.O_NONBLOCK | os.O_CLOEXEC)
+    if fd == -1:
+        return None
+    if libc.inotify_add_watch(fd, directory, _IN_CLOSE_WRITE | _IN_MOVED_TO) == -1:
+        errno = ctypes.get_errno()
+        os.close(fd)
+        raise OSError(errno, os.strerror(errno), os.fsdecode(directory))
+    return fd
+
+
+def _changed(events: bytes, name: bytes) -> bool:
+    offset = 0
+    while offset < len(events):
+        _, mask, _, length = _EVENT.unpack_from(events, offset)
+        offset += _EVENT.size
+        event_name = events[offset : offset + length].rstrip(b"\0")
+        offset += length
+        if mask & _IN_Q_OVERFLOW or event_name == name:
+            return True
+    return False
@@ -122,6 +122,7 @@ def run_setup(with_cext):
         python_requires=">=3.7",
         include_package_data=True,
         install_requires=requirements,
+        extras_require={"zstd": ["zstandard"]},
         license=LICENSE,
         cmdclass=cmdclass,
         classifiers=[
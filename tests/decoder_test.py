@@ -3,7 +3,7 @@
 
 import mmap
 
-from maxminddb.decoder import Decoder
+from maxminddb.decoder import Decoder, decode_raw
 
 import unittest
 
@@ -207,6 +207,37 @@ class TestDecoder(unittest.TestCase):
         else:
             self.assertEqual(expected, actual, type)
 
+    def test_decode_lazy(self):
+        buf = (
+            b"\xe2\x44\x6e\x61\x6d\x65\xe2\x42\x65\x6e\x43\x46\x6f\x6f"
+            b"\x42\x7a\x68\x43\xe4\xba\xba\x43\x61\x72\x72\x02\x04\x43"
+            b"\x46\x6f\x6f\x43\xe4\xba\xba"
+        )
+        decoder = Decoder(buf)
+
+        record = decoder.decode_lazy(0)
+        self.assertEqual(len(record), 2)
+        self.assertEqual(list(record), ["name", "arr"])
+        self.assertEqual(record["arr"], ["Foo", "人"])
+        self.assertEqual(record["name"]["zh"], "人")
+        self.assertIs(record["name"], record["name"])
+        self.assertEqual(record, decoder.decode(0)[0])
+        self.assertEqual(decoder.skip(0), len(buf))
+
+    def test_raw(self):
+        # {"a": "Foo", "b": <pointer to "Foo">}
+        buf = b"\xe2\x41a\x43Foo\x41b\x20\x03"
+        decoder = Decoder(buf)
+
+        raw = decoder.raw(0)
+        self.assertEqual(raw, b"\xe2\x41a\x43Foo\x41b\x43Foo")
+        self.assertEqual(decode_raw(raw), {"a": "Foo", "b": "Foo"})
+
+        raw = decoder.raw(3)
+        self.assertIsInstance(raw, memoryview)
+        self.assertEqual(raw, b"\x43Foo")
+        self.assertEqual(decode_raw(raw), "Foo")
+
     def test_real_pointers(self):
         with open("tests/data/test-data/maps-with-pointers.raw", "r+b") as db_file:
             mm = mmap.mmap(db_file.fileno(), 0)
@@ -1,10 +1,23 @@
 #!/usr/bin/env python
 # -*- coding: utf-8 -*-
 
+import array
+import asyncio
+import base64
+import collections.abc
+import gzip
 import ipaddress
+import json
+import math
+import mmap
 import os
 import pathlib
+import shutil
+import sys
+import tempfile
 import threading
+import time
+import types
 import unittest
 import unittest.mock as mock
 from multiprocessing import Process, Pipe
@@ -25,19 +38,20 @@ from maxminddb.const import (
     MODE_FILE,
     MODE_MEMORY,
     MODE_FD,
+    MODE_HYBRID,
 )
 
 
-def get_reader_from_file_descriptor(filepath, mode):
+def get_reader_from_file_descriptor(filepath, mode, **kwargs):
     """Patches open_database() for class TestFDReader()."""
     if mode == MODE_FD:
         with open(filepath, "rb") as mmdb_fh:
-            return maxminddb.open_database(mmdb_fh, mode)
+            return maxminddb.open_database(mmdb_fh, mode, **kwargs)
     else:
         # There are a few cases where mode is statically defined in
         # BaseTestReader(). In those cases just call an unpatched
         # open_database() with a string path.
-        return maxminddb.open_database(filepath, mode)
+        return maxminddb.open_database(filepath, mode, **kwargs)
 
 
 class BaseTestReader(object):
@@ -212,6 +226,712 @@ class BaseTestReader(object):
         self.assertEqual(1329227995784915872903807060280344576, record["uint128"])
         reader.close()
 
+    def test_buffer(self):
+        if self.mode not in (MODE_AUTO, MODE_MEMORY):
+            self.skipTest("Only MODE_AUTO and MODE_MEMORY open buffers")
+
+        with open("tests/data/test-data/GeoIP2-City-Test.mmdb", "rb") as db_file:
+            contents = db_file.read()
+            mapped = mmap.mmap(db_file.fileno(), 0, access=mmap.ACCESS_READ)
+        for database in [
+            contents,
+            bytearray(contents),
+            memoryview(contents),
+            mapped,
+        ]:
+            with open_database(database, self.mode) as reader:
+                self.assertEqual(type(reader), self.readerClass)
+                record = reader.get(self.ipf("81.2.69.160"))
+                self.assertEqual(record["city"]["names"]["en"], "London")
+        mapped.close()
+
+        if self.readerClass is not maxminddb.reader.Reader:
+            # The C extension reads the buffer in place and keeps it exported.
+            database = bytearray(contents)
+            reader = open_database(database, self.mode)
+            with self.assertRaises(BufferError):
+                database.extend(b"\0")
+            reader.close()
+            database.extend(b"\0")
+
+        with self.assertRaisesRegex(
+            InvalidDatabaseError, "Is this a valid MaxMind DB file"
+        ):
+            open_database(bytearray(b"not a database"), self.mode)
+
+    def test_reload(self):
+        if self.mode == MODE_FD:
+            self.skipTest("A reader opened from a descriptor has no path")
+
+        city = "tests/data/test-data/GeoIP2-City-Test.mmdb"
+        country = "tests/data/test-data/GeoIP2-Country-Test.mmdb"
+        reader = open_database(city, self.mode, cache=10)
+        record = reader.get(self.ipf("81.2.69.160"))
+        self.assertEqual(record["city"]["names"]["en"], "London")
+
+        reader.reload(country)
+        self.assertEqual(reader.metadata().database_type, "GeoIP2-Country")
+        record = reader.get(self.ipf("81.2.69.160"))
+        self.assertNotIn("city", record)
+        self.assertIsNotNone(reader.cache_stats())
+
+        # The last path is opened again by default.
+        reader.reload()
+        self.assertEqual(reader.metadata().database_type, "GeoIP2-Country")
+
+        # A database that cannot be opened leaves the current one in place.
+        with self.assertRaises(InvalidDatabaseError):
+            reader.reload("README.rst")
+        with self.assertRaises(FileNotFoundError):
+            reader.reload("does-not-exist.mmdb")
+        self.assertEqual(reader.metadata().database_type, "GeoIP2-Country")
+
+        reader.close()
+        with self.assertRaisesRegex(ValueError, "closed"):
+            reader.reload()
+
+    def test_reload_cache(self):
+        if self.mode == MODE_FD:
+            self.skipTest("A reader opened from a descriptor has no path")
+
+        addresses = ["81.2.69.160", "216.160.83.56", "89.160.20.112"]
+        reader = open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode, cache=100
+        )
+        records = [reader.get(self.ipf(ip)) for ip in addresses]
+
+        # Every record is unchanged, so each is kept even if its offset
+        # changes.
+        reader.reload()
+        self.assertEqual(reader.reload_stats()["cache_carried_over"], 3)
+        for ip, record in zip(addresses, records):
+            self.assertIs(reader.get(self.ipf(ip)), record)
+
+        reader.reload("tests/data/test-data/GeoIP2-Country-Test.mmdb")
+        self.assertNotIn("city", reader.get(self.ipf("81.2.69.160")))
+        reader.close()
+
+    def test_reload_during_lookups(self):
+        if self.mode == MODE_FD:
+            self.skipTest("A reader opened from a descriptor has no path")
+
+        paths = [
+            "tests/data/test-data/GeoIP2-City-Test.mmdb",
+            "tests/data/test-data/GeoIP2-Country-Test.mmdb",
+        ]
+        reader = open_database(paths[0], self.mode, cache=10)
+        done = threading.Event()
+        errors = []
+
+        def lookup():
+            try:
+                while not done.is_set():
+                    # Each lookup sees either database as a whole.
+                    record = reader.get(self.ipf("81.2.69.160"))
+                    self.assertEqual(record["country"]["iso_code"], "GB")
+                    if "city" in record:
+                        self.assertEqual(record["city"]["names"]["en"], "London")
+                    for record in reader.get_many_text(b"2.125.160.216\n89.160.20.112"):
+                        self.assertIn(record["country"]["iso_code"], ["GB", "SE"])
+            except Exception as ex:  # pylint: disable=broad-except
+                errors.append(ex)
+
+        threads = [threading.Thread(target=lookup) for _ in range(4)]
+        for thread in threads:
+            thread.start()
+        for i in range(50):
+            reader.reload(paths[i % 2])
+        done.set()
+        for thread in threads:
+            thread.join()
+        reader.close()
+        self.assertEqual(errors, [])
+
+    def test_close_during_reload(self):
+        if self.readerClass is not maxminddb.reader.Reader:
+            self.skipTest("The C extension cannot be closed at that point")
+        if self.mode == MODE_FD:
+            self.skipTest("A reader opened from a descriptor has no path")
+
+        reader = open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode, cache=10
+        )
+        reader.get(self.ipf("81.2.69.160"))
+
+        def close_first(replacement, records, decoder):
+            reader.close()
+            return 0
+
+        # The reader is closed after the database has opened but before it
+        # is swapped in, so it is dropped rather than reopening the reader.
+        with mock.patch.object(
+            maxminddb.reader.Reader, "_carry_over_cache", close_first
+        ):
+            reader.reload()
+        self.assertTrue(reader.closed)
+        self.assertEqual(reader.reload_stats()["reloads"], 0)
+        with self.assertRaisesRegex(ValueError, "closed"):
+            reader.get(self.ipf("81.2.69.160"))
+
+    def test_watch(self):
+        if self.mode == MODE_FD:
+            self.skipTest("A reader opened from a descriptor has no path")
+
+        def wait_for_reloads(reader, count):
+            deadline = time.monotonic() + 10
+            while reader.reload_stats()["reloads"] < count:
+                self.assertLess(time.monotonic(), deadline)
+                time.sleep(0.01)
+
+        city = "tests/data/test-data/GeoIP2-City-Test.mmdb"
+        country = "tests/data/test-data/GeoIP2-Country-Test.mmdb"
+        with tempfile.TemporaryDirectory() as directory:
+            path = os.path.join(directory, "GeoIP2.mmdb")
+            shutil.copy(city, path)
+            reader = open_database(path, self.mode, watch=True)
+            self.assertEqual(
+                reader.reload_stats(),
+                {
+                    "reloads": 0,
+                    "last_reload": None,
+                    "cache_carried_over": 0,
+                    "errors": 0,
+                    "last_error": None,
+                },
+            )
+
+            # A new file renamed over the database.
+            shutil.copy(country, path + ".tmp")
+            os.replace(path + ".tmp", path)
+            wait_for_reloads(reader, 1)
+            self.assertEqual(reader.metadata().database_type, "GeoIP2-Country")
+            self.assertIsInstance(reader.reload_stats()["last_reload"], float)
+
+            # The database rewritten in place.
+            shutil.copy(city, path)
+            wait_for_reloads(reader, 2)
+            self.assertEqual(reader.metadata().database_type, "GeoIP2-City")
+            reader.close()
+
+        with self.assertRaisesRegex(ValueError, "watch requires a database path"):
+            with open(city, "rb") as db_file:
+                open_database(bytearray(db_file.read()), MODE_AUTO, watch=True)
+
+    def test_compressed(self):
+        with open("tests/data/test-data/GeoIP2-City-Test.mmdb", "rb") as db_file:
+            contents = db_file.read()
+        compressed = gzip.compress(contents)
+        with tempfile.TemporaryDirectory() as directory:
+            path = os.path.join(directory, "GeoIP2-City-Test.mmdb.gz")
+            # gzip allows several concatenated streams.
+            with open(path, "wb") as db_file:
+                db_file.write(gzip.compress(contents[:1000]))
+                db_file.write(gzip.compress(contents[1000:]))
+            with open_database(path, self.mode) as reader:
+                record = reader.get(self.ipf("81.2.69.160"))
+                self.assertEqual(record["city"]["names"]["en"], "London")
+
+            with open(path, "wb") as db_file:
+                db_file.write(compressed[:-100])
+            with self.assertRaisesRegex(InvalidDatabaseError, "truncated"):
+                open_database(path, self.mode)
+
+            with open(path, "wb") as db_file:
+                db_file.write(compressed + b"\0\0\0\0")
+            with self.assertRaisesRegex(InvalidDatabaseError, "trailing data"):
+                open_database(path, self.mode)
+
+            with open(path, "wb") as db_file:
+                db_file.write(compressed[:1000] + bytes(100) + compressed[1100:])
+            with self.assertRaisesRegex(InvalidDatabaseError, "corrupt"):
+                open_database(path, self.mode)
+
+            # Errors from the zstd backend are reported in the same way.
+            class ZstdError(Exception):
+                pass
+
+            decompressor = mock.Mock()
+            decompressor.decompress.side_effect = ZstdError("bad frame")
+            with open(path, "wb") as db_file:
+                db_file.write(b"\x28\xb5\x2f\xfd" + bytes(100))
+            with mock.patch(
+                "maxminddb.compression._decompressor",
+                return_value=(decompressor, ZstdError),
+            ):
+                with self.assertRaisesRegex(InvalidDatabaseError, "bad frame"):
+                    open_database(path, self.mode)
+
+        if self.mode in [MODE_AUTO, MODE_MEMORY]:
+            with open_database(bytearray(compressed), self.mode) as reader:
+                record = reader.get(self.ipf("81.2.69.160"))
+                self.assertEqual(record["country"]["iso_code"], "GB")
+
+    def test_share(self):
+        if self.mode == MODE_FD:
+            return
+        path = "tests/data/test-data/GeoIP2-City-Test.mmdb"
+        first = open_database(path, self.mode, cache=16, share=True)
+        second = open_database(path, self.mode, cache=16, share=True)
+        other = open_database(path, self.mode, share=True)
+        record = first.get("81.2.69.160")
+        # Readers with the same options share the cache.
+        self.assertIs(second.get("81.2.69.160"), record)
+        self.assertIsNot(other.get("81.2.69.160"), record)
+
+        first.close()
+        self.assertTrue(first.closed)
+        self.assertIs(second.get("81.2.69.160"), record)
+        third = open_database(path, self.mode, cache=16, share=True)
+        self.assertIs(third.get("81.2.69.160"), record)
+        for reader in [second, third, other]:
+            reader.close()
+        with self.assertRaisesRegex(ValueError, "closed"):
+            second.share()
+
+        # The database is opened without holding the lock. If another thread
+        # adds a reader in the meantime, that one is shared instead.
+        real_open_database = maxminddb.open_database
+        racing = {}
+
+        def open_racing(*args, **kwargs):
+            if not racing:
+                racing["reader"] = None
+                racing["reader"] = real_open_database(
+                    path, self.mode, cache=8, share=True
+                )
+            return real_open_database(*args, **kwargs)
+
+        with mock.patch.object(maxminddb, "open_database", open_racing):
+            reader = real_open_database(path, self.mode, cache=8, share=True)
+        self.assertIs(
+            reader.get("81.2.69.160"), racing["reader"].get("81.2.69.160")
+        )
+        reader.close()
+        racing["reader"].close()
+
+        with self.assertRaisesRegex(ValueError, "watch"):
+            open_database(path, self.mode, share=True, watch=True)
+
+    def test_residency(self):
+        reader = open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb",
+            self.mode,
+            prefault=True,
+            advice=["random", "willneed"],
+            mlock_tree=True,
+        )
+        reader.warm()
+        reader.warm(data=False)
+        residency = reader.residency()
+        if isinstance(reader, maxminddb.reader.Reader):
+            self.assertIsNone(residency)
+        else:
+            self.assertEqual(residency, {"tree": 1.0, "data": 1.0})
+        record = reader.get(self.ipf("81.2.69.160"))
+        self.assertEqual(record["city"]["names"]["en"], "London")
+        reader.close()
+        with self.assertRaisesRegex(ValueError, "closed"):
+            reader.warm()
+
+        with self.assertRaisesRegex(ValueError, r"Unsupported advice \('often'\)"):
+            open_database(
+                "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode, advice="often"
+            )
+
+        if self.mode == MODE_MMAP and hasattr(mmap.mmap, "madvise"):
+            # Advice that the kernel rejects only warns.
+            with mock.patch.dict(maxminddb.reader._ADVICE, {"bogus": 0x7FFF}):
+                with self.assertWarnsRegex(RuntimeWarning, "Ignoring the bogus advice"):
+                    reader = open_database(
+                        "tests/data/test-data/GeoIP2-City-Test.mmdb",
+                        self.mode,
+                        advice="bogus",
+                    )
+            record = reader.get(self.ipf("81.2.69.160"))
+            self.assertEqual(record["city"]["names"]["en"], "London")
+            reader.close()
+
+    def test_aget(self):
+        addresses = ["81.2.69.160", "216.160.83.56", "1.1.1.1"]
+
+        async def lookup(reader):
+            # These single lookups are made together and so share a batch.
+            records = await asyncio.gather(
+                *[reader.aget(self.ipf(ip)) for ip in addresses],
+                reader.aget("not an ip"),
+                return_exceptions=True,
+            )
+            many = await reader.aget_many([self.ipf(ip) for ip in addresses])
+            return records, many
+
+        with open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode
+        ) as reader:
+            expected = [reader.get(self.ipf(ip)) for ip in addresses]
+            records, many = asyncio.run(lookup(reader))
+            self.assertEqual(records[:3], expected)
+            self.assertIsInstance(records[3], ValueError)
+            self.assertEqual(many, expected)
+
+            with self.assertRaises(ValueError):
+                asyncio.run(reader.aget_many(["81.2.69.160", "not an ip"]))
+
+        if self.mode not in [MODE_MEMORY, MODE_FD]:
+            with self.assertRaisesRegex(ValueError, "closed"):
+                asyncio.run(reader.aget(self.ipf("81.2.69.160")))
+
+    def test_get_lazy(self):
+        with open_database(
+            "tests/data/test-data/MaxMind-DB-test-decoder.mmdb", self.mode
+        ) as reader:
+            record = reader.get_lazy(self.ipf("::1.1.1.0"))
+
+            self.assertIsInstance(record, collections.abc.Mapping)
+            self.assertEqual(len(record), 12)
+            self.assertEqual(record["utf8_string"], "unicode! ☯ - ♫")
+            self.assertEqual(record["map"]["mapX"]["arrayX"], [7, 8, 9])
+            self.assertIsInstance(record["map"], collections.abc.Mapping)
+            self.assertIs(record["map"], record["map"], "values are memoized")
+            self.assertIn("uint128", record)
+            self.assertNotIn("missing", record)
+            self.assertIsNone(record.get("missing"))
+            with self.assertRaises(KeyError):
+                record["missing"]
+
+            expected = reader.get(self.ipf("::1.1.1.0"))
+            self.assertEqual(sorted(record.keys()), sorted(expected))
+            self.assertEqual(record, expected)
+            self.assertEqual(dict(record.items())["array"], [1, 2, 3])
+
+        with open_database(
+            "tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb", self.mode
+        ) as reader:
+            self.assertIsNone(reader.get_lazy(self.ipf("1.1.1.33")))
+
+    def test_get_lazy_after_close(self):
+        if self.mode in [MODE_MEMORY, MODE_FD]:
+            return
+        reader = open_database(
+            "tests/data/test-data/MaxMind-DB-test-decoder.mmdb", self.mode
+        )
+        record = reader.get_lazy(self.ipf("::1.1.1.0"))
+        self.assertEqual(record["uint16"], 100)
+        reader.close()
+
+        self.assertEqual(record["uint16"], 100, "memoized values remain")
+        with self.assertRaisesRegex(
+            ValueError, "Attempt to read from a closed MaxMind DB.|closed"
+        ):
+            record["uint32"]
+
+    def test_immutable(self):
+        with open_database(
+            "tests/data/test-data/MaxMind-DB-test-decoder.mmdb",
+            self.mode,
+            immutable=True,
+        ) as reader:
+            record = reader.get(self.ipf("::1.1.1.0"))
+
+            self.assertIsInstance(record, types.MappingProxyType)
+            self.assertEqual(record["array"], (1, 2, 3))
+            self.assertIsInstance(record["bytes"], bytes)
+            self.assertEqual(record["bytes"], b"\x00\x00\x00*")
+            self.assertIsInstance(record["map"]["mapX"], types.MappingProxyType)
+            self.assertEqual(record["map"]["mapX"]["arrayX"], (7, 8, 9))
+            with self.assertRaises(TypeError):
+                record["array"] = None
+
+            self.assertEqual(reader.get_lazy(self.ipf("::1.1.1.0"))["array"], (1, 2, 3))
+            self.assertIsInstance(reader.metadata().description, dict)
+
+    def test_get_raw(self):
+        with open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode
+        ) as reader:
+            raw = reader.get_raw(self.ipf("81.2.69.160"))
+            self.assertIsInstance(raw, bytes, "pointers are inlined")
+            self.assertEqual(
+                maxminddb.decode_raw(raw), reader.get(self.ipf("81.2.69.160"))
+            )
+            self.assertIsNone(reader.get_raw(self.ipf("10.0.0.1")))
+
+        with open_database(
+            "tests/data/test-data/MaxMind-DB-test-decoder.mmdb", self.mode
+        ) as reader:
+            raw = reader.get_raw(self.ipf("::1.1.1.0"))
+            record = reader.get(self.ipf("::1.1.1.0"))
+            self.assertEqual(maxminddb.decode_raw(raw), record)
+            # Views do not come from the reader itself.
+            with self.assertRaises(TypeError):
+                memoryview(reader)
+            exporter = raw.obj if isinstance(raw, memoryview) else None
+        # The reader may be closed while the raw record is alive, and the
+        # record remains valid.
+        self.assertEqual(maxminddb.decode_raw(raw), record)
+        del raw
+        if exporter is not None and not isinstance(exporter, bytes):
+            with self.assertRaises(ValueError):
+                memoryview(exporter)
+
+        with self.assertRaises(InvalidDatabaseError):
+            maxminddb.decode_raw(b"")
+
+    def test_get_json(self):
+        with open_database(
+            "tests/data/test-data/MaxMind-DB-test-decoder.mmdb", self.mode
+        ) as reader:
+            data = reader.get_json(self.ipf("::1.1.1.0"))
+            self.assertIsInstance(data, bytes)
+
+            record = reader.get(self.ipf("::1.1.1.0"))
+            record["bytes"] = base64.b64encode(record["bytes"]).decode("ascii")
+            self.assertEqual(json.loads(data), record)
+            self.assertIn("unicode! ☯ - ♫".encode(), data)
+
+            self.assertEqual(
+                json.loads(
+                    reader.get_json(
+                        self.ipf("::1.1.1.0"), fields=["uint16", "map", "missing"]
+                    )
+                ),
+                {
+                    "map": {"mapX": {"arrayX": [7, 8, 9], "utf8_stringX": "hello"}},
+                    "uint16": 100,
+                },
+            )
+            with self.assertRaises(TypeError):
+                reader.get_json(self.ipf("::1.1.1.0"), fields="uint16")
+
+        with open_database(
+            "tests/data/test-data/MaxMind-DB-test-ipv4-24.mmdb", self.mode
+        ) as reader:
+            self.assertIsNone(reader.get_json(self.ipf("1.1.1.33")))
+            self.assertEqual(
+                reader.get_many_json(
+                    [self.ipf("1.1.1.1"), self.ipf("1.1.1.33"), self.ipf("1.1.1.3")]
+                ),
+                b'[{"ip":"1.1.1.1"},null,{"ip":"1.1.1.2"}]',
+            )
+            self.assertEqual(reader.get_many_json([]), b"[]")
+
+    def test_materialize(self):
+        with open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb",
+            self.mode,
+            materialize=True,
+        ) as reader:
+            record = reader.get(self.ipf("81.2.69.160"))
+            self.assertIsInstance(record, types.MappingProxyType)
+            self.assertEqual(record["city"]["names"]["en"], "London")
+            self.assertIs(reader.get(self.ipf("81.2.69.160")), record)
+            self.assertIs(reader.get_lazy(self.ipf("81.2.69.160")), record)
+
+            stats = reader.materialize_stats()
+            self.assertEqual(set(stats), {"records", "seconds", "memory"})
+            self.assertGreater(stats["records"], 0)
+            self.assertGreaterEqual(stats["seconds"], 0)
+            self.assertGreater(stats["memory"], 0)
+
+        with open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb",
+            self.mode,
+            materialize="auto",
+        ) as reader:
+            self.assertIsNotNone(reader.materialize_stats())
+
+        with open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode
+        ) as reader:
+            self.assertIsNone(reader.materialize_stats())
+
+        with self.assertRaisesRegex(ValueError, "materialize must be a bool"):
+            open_database(
+                "tests/data/test-data/GeoIP2-City-Test.mmdb",
+                self.mode,
+                materialize="always",
+            )
+
+    def test_cache(self):
+        reader = open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode, cache=1
+        )
+        record = reader.get(self.ipf("81.2.69.160"))
+        self.assertIsInstance(record, types.MappingProxyType)
+        self.assertEqual(record["city"]["names"]["en"], "London")
+        self.assertIs(reader.get(self.ipf("81.2.69.160")), record)
+        other = reader.get(self.ipf("216.160.83.56"))
+        self.assertEqual(other["city"]["names"]["en"], "Milton")
+        self.assertEqual(reader.get(self.ipf("216.160.83.56")), other)
+
+        stats = reader.cache_stats()
+        self.assertEqual(
+            set(stats), {"capacity", "hits", "misses", "evictions", "contended"}
+        )
+        self.assertGreaterEqual(stats["capacity"], 1)
+        self.assertEqual(stats["hits"], 2)
+        self.assertEqual(stats["misses"], 2)
+        self.assertEqual(stats["contended"], 0)
+        reader.close()
+        self.assertIsNone(reader.cache_stats())
+
+        with open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode
+        ) as reader:
+            self.assertIsNone(reader.cache_stats())
+
+        with self.assertRaisesRegex(ValueError, "cache must not be negative"):
+            open_database(
+                "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode, cache=-1
+            )
+
+    def test_specialize(self):
+        for database, ip in [
+            ("MaxMind-DB-test-decoder.mmdb", "::1.1.1.0"),
+            ("GeoIP2-City-Test.mmdb", "81.2.69.160"),
+        ]:
+            path = "tests/data/test-data/" + database
+            with open_database(path, self.mode) as reader:
+                expected = reader.get(self.ipf(ip))
+            with open_database(path, self.mode, specialize=True) as reader:
+                record = reader.get(self.ipf(ip))
+                self.assertEqual(record, expected)
+                self.assertIs(
+                    next(iter(record)),
+                    next(iter(reader.get(self.ipf(ip)))),
+                    "keys are shared between records",
+                )
+                self.assertIsNone(reader.get(self.ipf("10.0.0.1")))
+
+    def test_typed(self):
+        with open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode
+        ) as reader:
+            expected = reader.get(self.ipf("81.2.69.160"))
+
+        with open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode, typed=True
+        ) as reader:
+            record = reader.get(self.ipf("81.2.69.160"))
+
+            self.assertIsInstance(record, maxminddb.types.TypedRecord)
+            self.assertEqual(type(record).__name__, "GeoIP2CityRecord")
+            self.assertEqual(record.country.iso_code, "GB")
+            self.assertEqual(record.city.names.en, "London")
+            self.assertEqual(record.subdivisions[0].iso_code, "ENG")
+            self.assertIsNone(record.postal, "missing keys are None")
+            self.assertEqual(record._asdict(), expected)
+            self.assertEqual(record, reader.get(self.ipf("81.2.69.160")))
+            with self.assertRaises(AttributeError):
+                record.country = None
+
+            # The classes are built from every record, so no record comes
+            # back as a dict.
+            for ip in ["2001:218::", "216.160.83.56", "89.160.20.112", "2.125.160.216"]:
+                record = reader.get(self.ipf(ip))
+                self.assertIsInstance(record, maxminddb.types.TypedRecord)
+                self.assertIsInstance(record.country, maxminddb.types.TypedRecord)
+
+        with open_database(
+            "tests/data/test-data/MaxMind-DB-test-decoder.mmdb",
+            self.mode,
+            typed=True,
+        ) as reader:
+            record = reader.get(self.ipf("::1.1.1.0"))
+            self.assertEqual(record.map.mapX.arrayX, [7, 8, 9])
+            self.assertEqual(record.uint16, 100)
+
+    def test_get_columns(self):
+        with open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode
+        ) as reader:
+            ips = [self.ipf(ip) for ip in ["81.2.69.160", "10.0.0.1", "2001:218::"]]
+            columns = reader.get_columns(
+                ips,
+                ["location.latitude", "country.iso_code", ("city", "geoname_id")],
+            )
+
+            latitude = columns["location.latitude"]
+            self.assertEqual(latitude.values.format, "d")
+            self.assertEqual(latitude.values[0], 51.5142)
+            self.assertTrue(math.isnan(latitude.values[1]), "missing values are NaN")
+            self.assertEqual(latitude.valid.tolist(), [True, False, True])
+
+            iso_code = columns["country.iso_code"]
+            self.assertEqual(iso_code.offsets.tolist(), [0, 2, 2, 4])
+            self.assertEqual(bytes(iso_code.values), b"GBJP")
+
+            geoname_id = columns[("city", "geoname_id")]
+            self.assertEqual(geoname_id.values.tolist(), [2643743, 0, 0])
+            self.assertEqual(geoname_id.valid.tolist(), [True, False, False])
+
+            with self.assertRaises(TypeError):
+                reader.get_columns(ips, ["location"])
+
+    def test_get_many_text(self):
+        with open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode
+        ) as reader:
+            records = reader.get_many_text(
+                b"81.2.69.160\r\n 10.0.0.1 \n\n2001:218::\n::81.2.69.160"
+            )
+            self.assertEqual(
+                records,
+                [
+                    reader.get("81.2.69.160"),
+                    None,
+                    reader.get("2001:218::"),
+                    reader.get("::81.2.69.160"),
+                ],
+            )
+            self.assertEqual(
+                len(reader.get_many_text(memoryview(b"1.1.1.1,2.2.2.2"), b",")), 2
+            )
+
+            with self.assertRaisesRegex(ValueError, "'1.2.3.04' on line 2"):
+                reader.get_many_text(b"81.2.69.160\n1.2.3.04\n")
+
+    def test_lookup_buffer(self):
+        with open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode
+        ) as reader:
+            addresses = array.array(
+                "I",
+                [int(ipaddress.IPv4Address(ip)) for ip in ["81.2.69.160", "10.0.0.1"]],
+            )
+            offsets = array.array("q", [0, 0])
+            prefix_lens = bytearray(2)
+            self.assertEqual(reader.lookup_buffer(addresses, offsets, prefix_lens), 1)
+            self.assertEqual(offsets[1], -1)
+            self.assertEqual(
+                reader.decode_offset(offsets[0]), reader.get("81.2.69.160")
+            )
+            self.assertEqual(
+                list(prefix_lens),
+                [
+                    reader.get_with_prefix_len("81.2.69.160")[1],
+                    reader.get_with_prefix_len("10.0.0.1")[1],
+                ],
+            )
+
+            packed = memoryview(
+                ipaddress.IPv6Address("2001:218::").packed
+                + ipaddress.IPv6Address("::81.2.69.160").packed
+            ).cast("B", (2, 16))
+            self.assertEqual(reader.lookup_buffer(packed, offsets), 2)
+            self.assertEqual(reader.decode_offset(offsets[0]), reader.get("2001:218::"))
+            self.assertEqual(
+                reader.decode_offset(offsets[1]), reader.get("::81.2.69.160")
+            )
+
+            with self.assertRaises(TypeError):
+                reader.lookup_buffer(b"1.1.1.1", offsets)
+            with self.assertRaises(TypeError):
+                reader.lookup_buffer(addresses, array.array("i", [0, 0]))
+            with self.assertRaises(ValueError):
+                reader.lookup_buffer(addresses, array.array("q", [0]))
+            with self.assertRaises(ValueError):
+                reader.decode_offset(-1)
+
     def test_metadata_pointers(self):
         with open_database(
             "tests/data/test-data/MaxMind-DB-test-metadata-pointers.mmdb", self.mode
@@ -569,6 +1289,124 @@ class TestExtensionReader(BaseTestReader, unittest.TestCase):
     if has_maxminddb_extension():
         readerClass = maxminddb.extension.Reader
 
+    def test_threads(self):
+        # Enough addresses and text to be split between the threads.
+        start = int(ipaddress.IPv4Address("81.2.69.0"))
+        addresses = array.array("I", range(start, start + 20000))
+        text = b"\n".join(
+            str(ipaddress.IPv4Address(address)).encode() for address in addresses
+        )
+        results = []
+        for threads in [1, 4]:
+            with open_database(
+                "tests/data/test-data/GeoIP2-City-Test.mmdb",
+                self.mode,
+                threads=threads,
+            ) as reader:
+                offsets = array.array("q", bytes(8 * len(addresses)))
+                prefix_lens = bytearray(len(addresses))
+                found = reader.lookup_buffer(addresses, offsets, prefix_lens)
+                records = reader.get_many_text(text)
+                self.assertEqual(len(records), len(addresses))
+                results.append((found, offsets, prefix_lens, records))
+
+                with self.assertRaisesRegex(ValueError, "on line 20001"):
+                    reader.get_many_text(text + b"\nx\n" + text)
+        self.assertEqual(results[0], results[1])
+
+        # Batches on several threads at once share the module's workers.
+        with open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode, threads=4
+        ) as reader:
+            batches = [None] * 4
+
+            def lookup(i):
+                batches[i] = reader.get_many_text(text)
+
+            workers = [threading.Thread(target=lookup, args=(i,)) for i in range(4)]
+            for worker in workers:
+                worker.start()
+            for worker in workers:
+                worker.join()
+            self.assertEqual(batches, [results[0][3]] * 4)
+
+        with self.assertRaises(ValueError):
+            open_database(
+                "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode, threads=0
+            )
+
+    def test_reload_while_exported(self):
+        reader = open_database(
+            "tests/data/test-data/MaxMind-DB-test-decoder.mmdb", self.mode
+        )
+        raw = reader.get_raw("::1.1.1.0")
+        self.assertIsInstance(raw, memoryview)
+        record = maxminddb.decode_raw(raw)
+
+        # The view keeps the database it came from mapped.
+        reader.reload("tests/data/test-data/GeoIP2-Country-Test.mmdb")
+        self.assertEqual(maxminddb.decode_raw(raw), record)
+        raw.release()
+        reader.close()
+
+    def test_subinterpreter(self):
+        try:
+            import _xxsubinterpreters as interpreters
+        except ImportError:
+            self.skipTest("subinterpreters are not available")
+
+        # The subinterpreter imports its own copy of the module, with its own
+        # types and exception.
+        code = f"""
+import sys
+sys.path[:] = {sys.path!r}
+import maxminddb.extension
+import maxminddb.errors
+reader = maxminddb.extension.Reader(
+    "tests/data/test-data/GeoIP2-City-Test.mmdb"
+)
+assert reader.get("81.2.69.160")["city"]["names"]["en"] == "London"
+assert isinstance(reader.get_lazy("81.2.69.160"), maxminddb.extension.LazyRecord)
+assert maxminddb.extension.InvalidDatabaseError is (
+    maxminddb.errors.InvalidDatabaseError
+)
+reader.close()
+"""
+        interpreter = interpreters.create()
+        try:
+            interpreters.run_string(interpreter, code)
+        finally:
+            interpreters.destroy(interpreter)
+
+    def test_close_while_reading(self):
+        reader = open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode
+        )
+        lazy = reader.get_lazy("81.2.69.160")
+        errors = []
+
+        def lookup():
+            try:
+                while True:
+                    record = reader.get("81.2.69.160")
+                    if record["city"]["names"]["en"] != "London":
+                        errors.append(record)
+                        return
+            except ValueError:
+                # Lookups after the close must fail cleanly.
+                return
+
+        threads = [threading.Thread(target=lookup) for _ in range(4)]
+        for thread in threads:
+            thread.start()
+        reader.close()
+        for thread in threads:
+            thread.join()
+
+        self.assertEqual(errors, [])
+        with self.assertRaisesRegex(ValueError, "closed MaxMind DB"):
+            lazy["city"]
+
 
 @unittest.skipIf(
     not has_maxminddb_extension() and not os.environ.get("MM_FORCE_EXT_TESTS"),
@@ -582,6 +1420,28 @@ class TestExtensionReaderWithIPObjects(BaseTestReader, unittest.TestCase):
         readerClass = maxminddb.extension.Reader
 
 
+@unittest.skipIf(
+    not has_maxminddb_extension() and not os.environ.get("MM_FORCE_EXT_TESTS"),
+    "No C extension module found. Skipping tests",
+)
+@unittest.skipIf(sys.platform != "linux", "MODE_HYBRID requires Linux")
+class TestHybridReader(BaseTestReader, unittest.TestCase):
+    mode = MODE_HYBRID
+
+    if has_maxminddb_extension():
+        readerClass = maxminddb.extension.Reader
+
+    def test_tree_copied(self):
+        with open_database(
+            "tests/data/test-data/GeoIP2-City-Test.mmdb", self.mode
+        ) as reader:
+            # The copy of the tree is always in memory.
+            self.assertEqual(reader.residency()["tree"], 1.0)
+            self.assertEqual(
+                reader.get("81.2.69.160")["city"]["names"]["en"], "London"
+            )
+
+
 class TestAutoReader(BaseTestReader, unittest.TestCase):
     mode = MODE_AUTO
 
@@ -614,7 +1474,14 @@ class TestFileReader(BaseTestReader, unittest.TestCase):
 
 class TestMemoryReader(BaseTestReader, unittest.TestCase):
     mode = MODE_MEMORY
-    readerClass = maxminddb.reader.Reader
+
+    readerClass: Union[
+        Type["maxminddb.extension.Reader"], Type["maxminddb.reader.Reader"]
+    ]
+    if has_maxminddb_extension():
+        readerClass = maxminddb.extension.Reader
+    else:
+        readerClass = maxminddb.reader.Reader
 
 
 class TestFDReader(BaseTestReader, unittest.TestCase):
@@ -625,8 +1492,135 @@ class TestFDReader(BaseTestReader, unittest.TestCase):
         self.open_database.side_effect = get_reader_from_file_descriptor
 
     mode = MODE_FD
+
+    readerClass: Union[
+        Type["maxminddb.extension.Reader"], Type["maxminddb.reader.Reader"]
+    ]
+    if has_maxminddb_extension():
+        readerClass = maxminddb.extension.Reader
+    else:
+        readerClass = maxminddb.reader.Reader
+
+    def test_descriptor(self):
+        path = "tests/data/test-data/GeoIP2-City-Test.mmdb"
+        fd = os.open(path, os.O_RDONLY)
+        try:
+            reader = maxminddb.open_database(fd, MODE_FD)
+        finally:
+            os.close(fd)
+        # The database stays open after the caller closes the descriptor.
+        self.assertEqual(reader.get("81.2.69.160")["city"]["names"]["en"], "London")
+        reader.close()
+
+        # A pipe cannot be memory mapped, so it is read into memory.
+        read_fd, write_fd = os.pipe()
+        with open(path, "rb") as db_file:
+            contents = db_file.read()
+        writer = threading.Thread(target=self._write_pipe, args=(write_fd, contents))
+        writer.start()
+        try:
+            with maxminddb.open_database(read_fd, MODE_FD) as reader:
+                record = reader.get("216.160.83.56")
+                self.assertEqual(record["city"]["names"]["en"], "Milton")
+        finally:
+            writer.join()
+            os.close(read_fd)
+
+        # What is read from a pipe is decompressed if it is compressed.
+        read_fd, write_fd = os.pipe()
+        writer = threading.Thread(
+            target=self._write_pipe, args=(write_fd, gzip.compress(contents))
+        )
+        writer.start()
+        try:
+            with maxminddb.open_database(read_fd, MODE_FD) as reader:
+                record = reader.get("216.160.83.56")
+                self.assertEqual(record["city"]["names"]["en"], "Milton")
+        finally:
+            writer.join()
+            os.close(read_fd)
+
+        fd = os.open("README.rst", os.O_RDONLY)
+        try:
+            with self.assertRaisesRegex(
+                InvalidDatabaseError, "Is this a valid MaxMind DB file"
+            ):
+                maxminddb.open_database(fd, MODE_FD)
+        finally:
+            os.close(fd)
+
+    @staticmethod
+    def _write_pipe(fd, contents):
+        with open(fd, "wb") as pipe:
+            pipe.write(contents)
+
+
+# MODE_MEMORY and MODE_FD use the C extension when it is available, so these
+# hide it to test the pure Python reader in those modes too.
+class TestPythonMemoryReader(TestMemoryReader):
     readerClass = maxminddb.reader.Reader
 
+    def setUp(self):
+        extension_patcher = mock.patch.object(maxminddb, "_extension", None)
+        self.addCleanup(extension_patcher.stop)
+        extension_patcher.start()
+
+
+class TestPythonFDReader(TestFDReader):
+    readerClass = maxminddb.reader.Reader
+
+    def setUp(self):
+        super().setUp()
+        extension_patcher = mock.patch.object(maxminddb, "_extension", None)
+        self.addCleanup(extension_patcher.stop)
+        extension_patcher.start()
+
+
+@unittest.skipIf(sys.platform != "linux", "Shared databases are tested on Linux")
+class TestSharedDatabase(unittest.TestCase):
+    path = "tests/data/test-data/GeoIP2-City-Test.mmdb"
+
+    def test_memfd(self):
+        with open(self.path, "rb") as db_file:
+            contents = db_file.read()
+        for database in [self.path, bytearray(contents), open(self.path, "rb")]:
+            with maxminddb.SharedDatabase(database) as shared:
+                self.assertTrue(shared.sealed)
+                with self.assertRaises(PermissionError):
+                    os.write(shared.fd, b"\0")
+                reader = open_database(shared.fd, MODE_FD)
+                other = open_database(shared.path)
+            if hasattr(database, "close"):
+                database.close()
+            # The readers keep the copy after its descriptor is closed.
+            for r in [reader, other]:
+                self.assertEqual(r.get("81.2.69.160")["city"]["names"]["en"], "London")
+                r.close()
+
+        # The pure Python reader maps the copy too.
+        with maxminddb.SharedDatabase(self.path) as shared:
+            with maxminddb.reader.Reader(shared.fd, MODE_FD) as reader:
+                self.assertIsInstance(reader._buffer, mmap.mmap)
+                self.assertEqual(reader.get("81.2.69.160")["country"]["iso_code"], "GB")
+
+    def test_named(self):
+        name = f"maxminddb-test-{os.getpid()}"
+        shared = maxminddb.SharedDatabase(self.path, name=name)
+        self.addCleanup(shared.unlink)
+        shared.close()
+        self.assertEqual(os.stat(shared.path).st_mode & 0o777, 0o444)
+        with maxminddb.open_shared(name) as reader:
+            self.assertEqual(reader.get("81.2.69.160")["country"]["iso_code"], "GB")
+
+        # Loading under the same name replaces the copy.
+        with open("tests/data/test-data/GeoIP2-Country-Test.mmdb", "rb") as db_file:
+            maxminddb.SharedDatabase(db_file, name=name).close()
+        with maxminddb.open_shared(name) as reader:
+            self.assertEqual(reader.metadata().database_type, "GeoIP2-Country")
+
+        with self.assertRaisesRegex(ValueError, "Invalid shared memory name"):
+            maxminddb.open_shared("a/b")
+
 
 class TestOldReader(unittest.TestCase):
     def test_old_reader(self):